@@ -5,39 +5,88 @@
 #include <boost/beast.hpp>
 #include <boost/beast/http/message.hpp>
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <concepts>
+#include <cstdint>
+#include <iterator>
 #include <list>
+#include <optional>
 #include <queue>
 
+#include "BodyStream.h"
+#include "Compression.h"
 #include "Define.h"
+#include "FanOut.h"
+#include "Log.h"
+#include "Metrics.h"
 #include "MiddleWare.h"
+#include "QueryParams.h"
+#include "ResponseBuilder.h"
+#include "ResponseCache.h"
+#include "ResponseStream.h"
+#include "Router.h"
+#include "StaticFiles.h"
 
-struct APIEntry
+using ApiHandler = std::function<boost::asio::awaitable<boost::beast::http::message_generator>(const Request& req, const RouteParams& params)>;
+using StreamHandler = std::function<boost::asio::awaitable<boost::beast::http::message_generator>(const Request& req, BodyStream& body, const RouteParams& params)>;
+
+/// <summary>
+/// A route: its handler (buffered body) or stream handler (body pulled from a BodyStream), its body policy,
+/// whether its GET responses are cached and whether they go through the compression filter
+/// </summary>
+struct ApiEndpoint
 {
-    std::string uri;
-    Verb verb;
-    std::function<boost::asio::awaitable<boost::beast::http::message_generator>(const Request& req)> fnct;
+    ApiHandler handler;
+    StreamHandler stream_handler{};
+    BodyPolicy body_policy{};
+    CachePolicy cache{};
+    bool compress = true;
 };
 
 template <typename T>
-concept IApi = requires(T api, const Request & req)
+concept IApi = requires(T api, const Request & req, BodyStream * body)
 {
-	{ api.HandleRequest(req) } -> std::convertible_to<boost::asio::awaitable<boost::beast::http::message_generator>>;
+	{ api.HandleRequest(req, body) } -> std::convertible_to<boost::asio::awaitable<boost::beast::http::message_generator>>;
+	{ api.Policy(req) } -> std::convertible_to<std::optional<BodyPolicy>>;
 };
 
 /// <summary>
 /// Define an Api
+/// Chain is the middleware chain run before the routes: MiddleWareList to register them at runtime
+/// or a Pipeline<...> to compose them at compile time
 /// </summary>
-class Api final
+template <IMiddleWare Chain = MiddleWareList>
+class BasicApi final
 {
-    using StoredMiddleware = std::function<boost::asio::awaitable<bool>(const Request& req, Status& code, std::string& err)>;
 public:
-    Api()
-        // can also use regex to match specific data..
-        : _entries { APIEntry{"/toto", Verb::post, std::bind(&Api::HandlePostToto, this, std::placeholders::_1)}, 
-                     APIEntry{"/", Verb::get, std::bind(&Api::HandleGet, this, std::placeholders::_1)}}
-    {
+    // bounds of the query values of /export and /events, a value beyond them is brought back within them
+    static constexpr std::size_t MaxExportRows = 1000000;
+    static constexpr std::size_t MaxEvents = 1000;
+    static constexpr std::chrono::milliseconds MinEventInterval{ 10 };
+    static constexpr std::chrono::milliseconds MaxEventInterval{ 60000 };
 
+    explicit BasicApi(Chain chain = {})
+        : _middleware{ std::move(chain) }
+    {
+        // {name} captures a segment, a trailing * captures the rest of the path
+        _router.Add(Verb::post, "/toto", { std::bind(&BasicApi::HandlePostToto, this, std::placeholders::_1, std::placeholders::_2) });
+        // constant payload, served from its serialized bytes once built
+        _router.Add(Verb::get, "/", { std::bind(&BasicApi::HandleGet, this, std::placeholders::_1, std::placeholders::_2), {}, {}, CachePolicy{ std::chrono::seconds(60) } });
+        _router.Add(Verb::get, "/users/{id}", { std::bind(&BasicApi::HandleGetUser, this, std::placeholders::_1, std::placeholders::_2) });
+        _router.Add(Verb::get, "/search/{scope}", { std::bind(&BasicApi::HandleSearch, this, std::placeholders::_1, std::placeholders::_2) });
+        // scatter/gather over several backends
+        _router.Add(Verb::get, "/aggregate", { std::bind(&BasicApi::HandleAggregate, this, std::placeholders::_1, std::placeholders::_2) });
+        // uploads are streamed, whatever their size they only cost one BodyStream window
+        _router.Add(Verb::post, "/upload", { {}, std::bind(&BasicApi::HandleUpload, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3), BodyPolicy{ 64 * 1024 * 1024, true } });
+        // files under the EnableStaticFiles root, sent precompressed or as they are: never through the compression filter
+        _router.Add(Verb::get, "/static/*path", { std::bind(&BasicApi::HandleStatic, this, std::placeholders::_1, std::placeholders::_2), {}, {}, {}, false });
+        _router.Add(Verb::head, "/static/*path", { std::bind(&BasicApi::HandleStatic, this, std::placeholders::_1, std::placeholders::_2), {}, {}, {}, false });
+        // responses streamed while they are produced (ResponseStream), their body is not in the handler response
+        _router.Add(Verb::get, "/export", { std::bind(&BasicApi::HandleExport, this, std::placeholders::_1, std::placeholders::_2), {}, {}, {}, false });
+        _router.Add(Verb::get, "/events", { std::bind(&BasicApi::HandleEvents, this, std::placeholders::_1, std::placeholders::_2), {}, {}, {}, false });
+        _router.Freeze();
     }
 
     /// <summary>
@@ -45,90 +94,444 @@ public:
     /// </summary>
     /// <param name="middleware"></param>
     template <IMiddleWare T>
-    void AddMiddleWare(T& middleware)
+    void AddMiddleWare(T& middleware) requires std::same_as<Chain, MiddleWareList>
     {
-        _middleware.push_back([&middleware](const Request& req, Status& code, std::string& err) {
-            return middleware.HandleRequest(req, code, err);
-        });
+        _middleware.Add(middleware);
+    }
+
+    /// <summary>
+    /// Access the middleware chain (e.g. Pipeline::Get to configure one of its middlewares)
+    /// </summary>
+    Chain& MiddleWares()
+    {
+        return _middleware;
+    }
+
+    /// <summary>
+    /// Serialized responses of the cached routes, to invalidate them or read the stats
+    /// </summary>
+    ResponseCache& Cache()
+    {
+        return _cache;
+    }
+
+    /// <summary>
+    /// Compress the route responses for the clients accepting it, cached routes keep one compressed copy per encoding
+    /// To call before the api serves requests
+    /// </summary>
+    void EnableCompression(CompressionPolicy policy = {})
+    {
+        _compressor.emplace(policy);
     }
 
     /// <summary>
-    /// Handle a request
+    /// Serve the files under root on /static/, the routes answer 404 until it is called
+    /// To call before the api serves requests
+    /// </summary>
+    void EnableStaticFiles(std::string root, StaticFilesPolicy policy = {})
+    {
+        _files.emplace(std::move(root), policy);
+    }
+
+    /// <summary>
+    /// Files served on /static/, to read the stats, null when EnableStaticFiles was not called
+    /// </summary>
+    const StaticFiles* Files() const
+    {
+        return _files ? &*_files : nullptr;
+    }
+
+    /// <summary>
+    /// Record the requests of this api in Metrics and serve them on GET path as Prometheus text
+    /// The path goes through the middlewares like any route
+    /// To call before the api serves requests
+    /// </summary>
+    void EnableMetrics(std::string path = "/metrics")
+    {
+        Metrics::Enable();
+        auto& metrics = Metrics::Instance();
+        _metric_routes.clear();
+        for (const auto& route : _router.Routes())
+        {
+            const auto method = boost::beast::http::to_string(route.verb);
+            _metric_routes.push_back(metrics.RouteId(std::string_view(method.data(), method.size()), route.pattern));
+        }
+        _metrics_route = metrics.RouteId("GET", path);
+        _metrics_path = std::move(path);
+    }
+
+    /// <summary>
+    /// Body policy of the route matching the request header, nullopt if no route matches
+    /// </summary>
+    std::optional<BodyPolicy> Policy(const Request& req) const
+    {
+        if (IsMetrics(req))
+            return BodyPolicy{};
+
+        // kept in the context for Handle, the route is only matched once
+        RequestContext& context = Context(req);
+        const auto* route = _router.Match(req.get().method(), req.get().target(), context.params);
+        context.router = &_router;
+        context.route = route;
+        if (route)
+        {
+            BodyPolicy policy = route->handler.body_policy;
+            policy.streaming = static_cast<bool>(route->handler.stream_handler);
+            return policy;
+        }
+        return std::nullopt;
+    }
+
+    /// <summary>
+    /// Handle a request, body is given for the routes streaming their body and is null otherwise
+    /// Plain function: without metrics the request goes straight to Handle, no frame is added
     /// </summary>
     /// <param name="req"></param>
     /// <returns></returns>
-    boost::asio::awaitable<boost::beast::http::message_generator> HandleRequest(const Request& req) const 
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleRequest(const Request& req, BodyStream* body = nullptr) const
+    {
+        if (_metric_routes.empty())
+            return Handle(req, body, nullptr);
+        return HandleMeasured(req, body);
+    }
+
+private:
+    /// <summary>
+    /// Filled by Handle for the metrics: when the middlewares were done and which route answered
+    /// </summary>
+    struct Timing
+    {
+        std::int64_t start = 0;
+        std::int64_t routed = 0;
+        std::uint32_t route = Metrics::Unmatched;
+    };
+
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleMeasured(const Request& req, BodyStream* body) const
+    {
+        Timing timing{ Metrics::Now() };
+        auto response = co_await Handle(req, body, &timing);
+        const std::int64_t end = Metrics::Now();
+
+        auto& metrics = Metrics::Instance();
+        if (timing.routed)
+        {
+            metrics.RecordPhase(Metrics::Phase::Middleware, timing.routed - timing.start);
+            metrics.RecordPhase(Metrics::Phase::Handler, end - timing.routed);
+        }
+        metrics.RecordRequest(timing.route, PeekStatus(response), end - timing.start);
+        co_return response;
+    }
+
+    boost::asio::awaitable<boost::beast::http::message_generator> Handle(const Request& req, BodyStream* body, Timing* timing) const
     {
         std::string err;
         Status code;
 
-        for (auto& middleware : _middleware)
+        // matched first so the requests refused by a middleware are counted under their route, by Policy when the
+        // server asked it for the body policy
+        const RequestContext& context = Context(req);
+        RouteParams matched;
+        const Route* route = context.router == &_router ? static_cast<const Route*>(context.route) : _router.Match(req.get().method(), req.get().target(), matched);
+        const RouteParams& params = context.router == &_router ? context.params : matched;
+        const bool metrics = !route && IsMetrics(req);
+        if (timing)
+            timing->route = route ? _metric_routes[route - _router.Routes().data()] : metrics ? _metrics_route : Metrics::Unmatched;
+
+        bool success;
+        if constexpr (ISyncMiddleWare<Chain>)
+            success = _middleware.Check(req, code, err);
+        else
+            success = co_await _middleware.HandleRequest(req, code, err);
+
+        if (!success)
+            co_return GenerateResponse(req, code, err);
+        if (timing)
+            timing->routed = Metrics::Now();
+
+        if (metrics)
         {
-            const auto& success = co_await middleware(req, code, err);
-            if (!success)
-            {
-                auto res = co_await GenerateResponse(req, code, err);
-                co_return res;
-            }
+            const std::string text = Metrics::Instance().Render();
+            co_return Compress(req, ResponseBuilder(Status::ok, req.get().version(), req.get().keep_alive(), req.get().get_allocator())
+                .Field(boost::beast::http::field::content_type, "text/plain; version=0.0.4")
+                .Body(text));
         }
 
-        for (auto& entry : _entries)
+        if (route)
         {
-            if (entry.uri == req.get().target() && entry.verb == req.get().method())
+            const ApiEndpoint& endpoint = route->handler;
+            if (!endpoint.stream_handler && IsCached(endpoint, req))
+                co_return co_await HandleCached(req, endpoint, params);
+            if (!endpoint.stream_handler)
+            {
+                auto response = co_await endpoint.handler(req, params);
+                co_return endpoint.compress ? Compress(req, std::move(response)) : std::move(response);
+            }
+
+            if (!body)
+            {
+                code = Status::internal_server_error;
+                co_return GenerateResponse(req, code, "\"Streaming route called without a body stream\"");
+            }
+
+            try
             {
-                auto res = co_await entry.fnct(req);
-                co_return res;
+                auto response = co_await endpoint.stream_handler(req, *body, params);
+                co_return endpoint.compress ? Compress(req, std::move(response)) : std::move(response);
             }
+            catch (const boost::system::system_error& e)
+            {
+                // a chunked body going over the limit is only detected while it is read
+                if (e.code() != boost::beast::http::error::body_limit)
+                    throw;
+            }
+
+            code = Status::payload_too_large;
+            co_return GenerateResponse(req, code, "\"Body too large\"");
         }
 
         code = Status::not_found;
-        co_return co_await GenerateResponse(req, code, err);
+        co_return GenerateResponse(req, code, err);
     }
 
-private:
+    bool IsMetrics(const Request& req) const
+    {
+        if (_metrics_path.empty() || req.get().method() != Verb::get)
+            return false;
+        const std::string_view target = req.get().target();
+        return target.substr(0, target.find('?')) == _metrics_path;
+    }
 
-    boost::asio::awaitable<boost::beast::http::message_generator> HandlePostToto(const Request& req) const
+    boost::asio::awaitable<boost::beast::http::message_generator> HandlePostToto(const Request& req, const RouteParams& /*params*/) const
     {
         Status code = Status::created;
 
         const std::string body("\"Hello World!\"");
-        auto res = co_await GenerateResponse(req, code, body);
-        co_return res;
+        co_return GenerateResponse(req, code, body);
     }
 
-    boost::asio::awaitable<boost::beast::http::message_generator> HandleGet(const Request& req) const
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleGet(const Request& req, const RouteParams& /*params*/) const
     {
         Status code = Status::ok;
 
         const std::string body("\"Hello World!\"");
-        auto res = co_await GenerateResponse(req, code, body);
-        co_return res;
+        co_return GenerateResponse(req, code, body);
+    }
+
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleGetUser(const Request& req, const RouteParams& params) const
+    {
+        Status code = Status::ok;
+
+        const std::string body = "{\"id\":\"" + std::string(params.Get("id")) + "\"}";
+        co_return GenerateResponse(req, code, body);
+    }
+
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleSearch(const Request& req, const RouteParams& params) const
+    {
+        Status code = Status::ok;
+
+        // only the parameters read are decoded, the rest of the query string is never copied
+        const QueryParams query(req);
+        std::string buffer;
+        const std::string body = "{\"scope\":\"" + std::string(params.Decode("scope", buffer)) + "\",\"q\":\"" + std::string(query.Get("q").value_or(""))
+            + "\",\"limit\":\"" + std::string(query.Get("limit").value_or("10")) + "\"}";
+        co_return GenerateResponse(req, code, body);
+    }
+
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleAggregate(const Request& req, const RouteParams& /*params*/) const
+    {
+        Status code = Status::ok;
+
+        // both backends are called at once: the route costs the slowest one, a backend missing the deadline is null
+        const auto [users, orders] = co_await FanOut::Gather(std::chrono::milliseconds(500), Backend("users", std::chrono::milliseconds(50)), Backend("orders", std::chrono::milliseconds(80)));
+        const std::string body = "{\"users\":" + users.value_or("null") + ",\"orders\":" + orders.value_or("null") + "}";
+        co_return GenerateResponse(req, code, body);
+    }
+
+    /// <summary>
+    /// Stand-in for a backend call (HttpClientPool request, database query...) answering after latency
+    /// </summary>
+    static boost::asio::awaitable<std::string> Backend(std::string name, std::chrono::milliseconds latency)
+    {
+        boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor, latency);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        co_return "\"" + name + "\"";
+    }
+
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleUpload(const Request& req, BodyStream& body, const RouteParams& /*params*/) const
+    {
+        Status code = Status::ok;
+
+        // the body is only counted here, a real route would hash it or write it to a file chunk by chunk
+        for (auto chunk = co_await body.Next(); chunk.size() > 0; chunk = co_await body.Next())
+        {
+        }
+
+        const std::string response = "{\"size\":" + std::to_string(body.Received()) + "}";
+        co_return GenerateResponse(req, code, response);
+    }
+
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleStatic(const Request& req, const RouteParams& params) const
+    {
+        if (!_files)
+        {
+            Status code = Status::not_found;
+            co_return GenerateResponse(req, code, "\"Not found\"");
+        }
+        co_return _files->Serve(req, params.Get("path"));
+    }
+
+    /// <summary>
+    /// JSON array of ?rows= rows (1000 by default, at most MaxExportRows) written while they are generated: the client
+    /// gets the first ones at once and the export costs one ResponseStream window whatever its size
+    /// </summary>
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleExport(const Request& req, const RouteParams& /*params*/) const
+    {
+        const QueryParams query(req);
+        const auto rows = Number(query.Get("rows"), 1000, 0, MaxExportRows);
+        if (!rows)
+        {
+            Status code = Status::bad_request;
+            co_return GenerateResponse(req, code, "\"rows must be a number\"");
+        }
+        co_return ResponseStream::Start(req, "application/json", [rows = *rows](ResponseStream& out) -> boost::asio::awaitable<void>
+        {
+            co_await out.Write("[");
+            char row[64];
+            for (std::size_t i = 0; i < rows; ++i)
+            {
+                char* end = row;
+                if (i > 0)
+                    *end++ = ',';
+                for (const char c : std::string_view("{\"id\":"))
+                    *end++ = c;
+                end = std::to_chars(end, row + sizeof(row), i).ptr;
+                for (const char c : std::string_view(",\"name\":\"user\"}"))
+                    *end++ = c;
+                co_await out.Write(std::string_view(row, end - row));
+            }
+            co_await out.Write("]");
+        });
+    }
+
+    /// <summary>
+    /// Live feed stand-in: ?count= Server-Sent Events (10 by default, at most MaxEvents), one every ?interval=
+    /// milliseconds (1000 by default, within MinEventInterval and MaxEventInterval), each flushed as it happens
+    /// </summary>
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleEvents(const Request& req, const RouteParams& /*params*/) const
+    {
+        const QueryParams query(req);
+        const auto count = Number(query.Get("count"), 10, 0, MaxEvents);
+        const auto interval = Number(query.Get("interval"), 1000, MinEventInterval.count(), MaxEventInterval.count());
+        if (!count || !interval)
+        {
+            Status code = Status::bad_request;
+            co_return GenerateResponse(req, code, !count ? "\"count must be a number\"" : "\"interval must be a number\"");
+        }
+        co_return ResponseStream::Events(req, [count = *count, interval = std::chrono::milliseconds(*interval)](ResponseStream& out) -> boost::asio::awaitable<void>
+        {
+            boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                if (i > 0)
+                {
+                    timer.expires_after(interval);
+                    co_await timer.async_wait(boost::asio::use_awaitable);
+                }
+                const std::string id = std::to_string(i);
+                co_await out.Event("{\"tick\":" + id + "}", "tick", id);
+            }
+        });
+    }
+
+    /// <summary>
+    /// Query value text as a number brought within [min, max], fallback when it is absent and nothing when it is not
+    /// a number
+    /// </summary>
+    static std::optional<std::size_t> Number(std::optional<std::string_view> text, std::size_t fallback, std::size_t min, std::size_t max)
+    {
+        if (!text)
+            return fallback;
+        std::size_t value = 0;
+        const auto [end, error] = std::from_chars(text->data(), text->data() + text->size(), value);
+        if (error == std::errc::result_out_of_range)
+            return max;
+        if (error != std::errc{} || end != text->data() + text->size())
+            return std::nullopt;
+        return std::clamp(value, min, max);
+    }
+
+    /// <summary>
+    /// Only the keep-alive HTTP/1.1 GET requests are answered from the cache, its entries are serialized for them
+    /// </summary>
+    static bool IsCached(const ApiEndpoint& endpoint, const Request& req)
+    {
+        return endpoint.cache.ttl > std::chrono::steady_clock::duration::zero() && req.get().method() == Verb::get && req.get().version() == 11 && req.get().keep_alive();
+    }
+
+    boost::beast::http::message_generator Compress(const Request& req, boost::beast::http::message_generator response) const
+    {
+        if (!_compressor)
+            return response;
+        return _compressor->Filter(req, std::move(response));
+    }
+
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleCached(const Request& req, const ApiEndpoint& endpoint, const RouteParams& params) const
+    {
+        const std::string_view target = req.get().target();
+        if (auto cached = _cache.Find(target))
+            co_return _cache.Serve(std::move(cached), req, Compressor(endpoint));
+
+        const std::uint64_t version = _cache.Version();
+        auto response = co_await endpoint.handler(req, params);
+        co_return _cache.Serve(_cache.Store(target, response, endpoint.cache.ttl, version), req, Compressor(endpoint));
+    }
+
+    /// <summary>
+    /// Compressor the responses of endpoint go through, none when compression is off or the route opted out
+    /// </summary>
+    const ResponseCompressor* Compressor(const ApiEndpoint& endpoint) const
+    {
+        return _compressor && endpoint.compress ? &*_compressor : nullptr;
     }
 
     /// <summary>
     /// Private implementation, OnError to return a error response
+    /// Plain function: it never suspends so it does not need a coroutine frame
+    /// The response is written straight to its wire form by ResponseBuilder
     /// </summary>
     /// <param name="code"></param>
     /// <param name="err"></param>
     /// <returns></returns>
-    boost::asio::awaitable<boost::beast::http::message_generator> GenerateResponse(const Request& req, Status& code, const std::string& body) const
+    boost::beast::http::message_generator GenerateResponse(const Request& req, Status& code, const std::string& body) const
     {
-        boost::beast::http::response<boost::beast::http::string_body> res{ code, req.get().version() };
-        {
-            res.keep_alive(req.get().keep_alive());
-            res.set(boost::beast::http::field::server, BOOST_BEAST_VERSION_STRING);
-            res.set(boost::beast::http::field::content_type, "application/json");
-            res.set(boost::beast::http::field::content_length, std::to_string(body.size()));
-            res.body() = body;
-            res.prepare_payload();
-        }
+        Log::Debug("Response[{}] : {}", code, body);
 
-        std::cout << "Response[" << code << "] : " << body << "\n";
+        ResponseBuilder builder(code, req.get().version(), req.get().keep_alive(), req.get().get_allocator());
+        builder.Line(HeaderLines::ContentTypeJson);
 
-        co_return res;
+        // set by a middleware refusing the request with 429
+        if (const std::uint32_t retry_after = Context(req).retry_after)
+        {
+            char digits[16];
+            const auto end = std::to_chars(std::begin(digits), std::end(digits), retry_after).ptr;
+            builder.Field(boost::beast::http::field::retry_after, std::string_view(digits, end - digits));
+        }
+        return builder.Body(body);
     }
 
 private:
-    std::list<APIEntry> _entries;
-    std::list<StoredMiddleware> _middleware;
-};
\ No newline at end of file
+    using Route = typename Router<ApiEndpoint>::Route;
+
+    Router<ApiEndpoint> _router;
+    mutable Chain _middleware;
+    mutable ResponseCache _cache;
+    std::optional<ResponseCompressor> _compressor;
+    mutable std::optional<StaticFiles> _files;
+
+    // metrics id of each route, in router order, empty when metrics are off
+    std::vector<std::uint32_t> _metric_routes;
+    std::uint32_t _metrics_route = Metrics::Unmatched;
+    std::string _metrics_path;
+};
+
+using Api = BasicApi<>;
\ No newline at end of file
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+
+/// <summary>
+/// Per connection memory arena
+/// Allocations are bumped from a list of blocks and Reset() gives everything back at once at the end of a request
+/// Blocks are kept across Reset(), so once a keep-alive connection has seen its largest request it stops
+/// calling the upstream resource (global operator new by default)
+/// Not thread safe: a connection is only ever resumed by one thread at a time
+/// </summary>
+class RequestArena final : public std::pmr::memory_resource
+{
+public:
+    explicit RequestArena(std::size_t block_size = 16 * 1024, std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : _upstream{ upstream }
+    {
+        _first = _current = NewBlock(block_size);
+    }
+
+    ~RequestArena()
+    {
+        for (Block* block = _first; block;)
+        {
+            Block* next = block->next;
+            _upstream->deallocate(block, sizeof(Block) + block->size, alignof(std::max_align_t));
+            block = next;
+        }
+    }
+
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    /// <summary>
+    /// Release every allocation made since the last reset, nothing allocated from the arena may be used afterward
+    /// </summary>
+    void Reset()
+    {
+        _current = _first;
+        _offset = 0;
+    }
+
+    /// <summary>
+    /// Bytes currently reserved from the upstream resource
+    /// </summary>
+    std::size_t Capacity() const
+    {
+        std::size_t capacity = 0;
+        for (Block* block = _first; block; block = block->next)
+            capacity += block->size;
+        return capacity;
+    }
+
+private:
+    struct alignas(std::max_align_t) Block
+    {
+        Block* next;
+        std::size_t size;
+
+        std::byte* data() { return reinterpret_cast<std::byte*>(this + 1); }
+    };
+
+    Block* NewBlock(std::size_t size)
+    {
+        void* memory = _upstream->allocate(sizeof(Block) + size, alignof(std::max_align_t));
+        return ::new (memory) Block{ nullptr, size };
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        for (;;)
+        {
+            const std::size_t offset = (_offset + alignment - 1) & ~(alignment - 1);
+            if (offset + bytes <= _current->size)
+            {
+                _offset = offset + bytes;
+                return _current->data() + offset;
+            }
+
+            // move to the next kept block, or grow the chain when the request is larger than ever before
+            if (!_current->next)
+                _current->next = NewBlock(std::max(_current->size * 2, bytes + alignment));
+            _current = _current->next;
+            _offset = 0;
+        }
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override
+    {
+        // released by Reset()
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    std::pmr::memory_resource* _upstream;
+    Block* _first = nullptr;
+    Block* _current = nullptr;
+    std::size_t _offset = 0;
+};
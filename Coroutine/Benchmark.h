@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// <summary>
+/// Minimal microbenchmark runner, in the manner of google benchmark without the dependency
+/// A benchmark loops over its State, the runner grows the iteration count until a run lasts min_time then
+/// reports the time per iteration of the best of repetitions runs (the least disturbed by the rest of the machine)
+///
+///     Benchmark::Register("uri/parse", [](Benchmark::State& state)
+///     {
+///         for (auto _ : state)
+///             Benchmark::DoNotOptimize(uri(text));
+///     });
+/// </summary>
+class Benchmark
+{
+public:
+    class State
+    {
+    public:
+        // non trivial, so for (auto _ : state) is not reported as an unused variable
+        struct Value
+        {
+            ~Value() {}
+        };
+
+        class Iterator
+        {
+        public:
+            explicit Iterator(std::uint64_t remaining)
+                : _remaining{ remaining }
+            {
+            }
+
+            Value operator*() const { return {}; }
+            Iterator& operator++() { --_remaining; return *this; }
+            bool operator!=(const Iterator&) const { return _remaining != 0; }
+
+        private:
+            std::uint64_t _remaining;
+        };
+
+        explicit State(std::uint64_t iterations)
+            : _iterations{ iterations }
+        {
+        }
+
+        // the clock starts when the loop does, setup done before it is not measured
+        Iterator begin()
+        {
+            _start = std::chrono::steady_clock::now();
+            return Iterator(_iterations);
+        }
+
+        Iterator end()
+        {
+            return Iterator(0);
+        }
+
+        std::uint64_t Iterations() const
+        {
+            return _iterations;
+        }
+
+        // bytes handled by the whole run, reported as a throughput
+        void SetBytesProcessed(std::uint64_t bytes)
+        {
+            _bytes = bytes;
+        }
+
+    private:
+        friend class Benchmark;
+
+        std::uint64_t _iterations;
+        std::uint64_t _bytes = 0;
+        std::chrono::steady_clock::time_point _start;
+    };
+
+    using Function = std::function<void(State&)>;
+
+    /// <summary>
+    /// Keep the compiler from discarding a result only computed for the benchmark
+    /// </summary>
+    template <typename T>
+    static void DoNotOptimize(const T& value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+
+    static void Register(std::string name, Function function)
+    {
+        Registry().push_back({ std::move(name), std::move(function) });
+    }
+
+    /// <summary>
+    /// Run the registered benchmarks whose name contains filter, return how many ran
+    /// </summary>
+    static std::size_t RunAll(std::string_view filter = {}, std::chrono::milliseconds min_time = std::chrono::milliseconds(200), int repetitions = 3)
+    {
+        std::printf("%-40s %14s %14s %12s\n", "Benchmark", "Time", "Iterations", "Throughput");
+        std::size_t ran = 0;
+        for (auto& [name, function] : Registry())
+        {
+            if (!filter.empty() && name.find(filter) == std::string::npos)
+                continue;
+
+            double best = 0;
+            std::uint64_t iterations = 1;
+            std::uint64_t bytes = 0;
+            for (int repetition = 0; repetition < repetitions; ++repetition)
+            {
+                // calibrated on the first repetition, the next ones run as many iterations
+                for (;;)
+                {
+                    State state(iterations);
+                    function(state);
+                    const auto elapsed = std::chrono::steady_clock::now() - state._start;
+                    const double per_iteration = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+                    if (repetition == 0 && elapsed < min_time)
+                    {
+                        iterations = std::max<std::uint64_t>(iterations + 1, iterations * std::min<std::uint64_t>(10, std::max<std::uint64_t>(2, min_time / std::max(elapsed, std::chrono::steady_clock::duration(1)))));
+                        continue;
+                    }
+                    if (repetition == 0 || per_iteration < best)
+                    {
+                        best = per_iteration;
+                        bytes = state._bytes / iterations;
+                    }
+                    break;
+                }
+            }
+
+            char throughput[32] = "";
+            if (bytes)
+                std::snprintf(throughput, sizeof(throughput), "%.1fMB/s", bytes * 1e3 / best);
+            std::printf("%-40s %11.1f ns %14llu %12s\n", name.c_str(), best, static_cast<unsigned long long>(iterations), throughput);
+            ++ran;
+        }
+        return ran;
+    }
+
+private:
+    struct Entry
+    {
+        std::string name;
+        Function function;
+    };
+
+    static std::vector<Entry>& Registry()
+    {
+        static std::vector<Entry> registry;
+        return registry;
+    }
+};
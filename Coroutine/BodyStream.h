@@ -0,0 +1,130 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/beast.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <tuple>
+
+#include "Define.h"
+#include "ServerConfig.h"
+
+/// <summary>
+/// How a route receives its request body
+/// </summary>
+struct BodyPolicy
+{
+    // largest body accepted, a larger Content-Length is answered 413 before any byte of the body is read
+    std::size_t limit = 1024 * 1024;
+
+    // the handler pulls the body through a BodyStream instead of receiving it buffered in the request
+    bool streaming = false;
+};
+
+/// <summary>
+/// Pull based reader over the body of a streaming route
+/// Each Next() parses at most one window of body bytes, reading the socket only when the parser needs more: nothing
+/// is read ahead of the handler, so a slow handler slows the client down (TCP backpressure) and the memory of an
+/// upload is the window plus the connection read buffer whatever the body size
+/// The connection governor applies as for a buffered body: each read must complete within body_timeout and a client
+/// sending slower than min_rate is dropped. The rate only counts the time spent waiting for the client, a handler
+/// pulling slowly does not make its client look slow
+/// The header stays available in the request given to the handler
+/// </summary>
+class BodyStream
+{
+public:
+    static constexpr std::size_t WindowSize = 16 * 1024;
+
+    /// <summary>
+    /// too_slow, when given, counts the clients dropped for min_rate
+    /// </summary>
+    template <typename Stream>
+    BodyStream(Stream& stream, boost::beast::flat_buffer& buffer, Request& req, std::span<char> window, const ConnectionLimits& limits, std::atomic<std::size_t>* too_slow = nullptr)
+        : _stream{ &stream }
+        , _read{ &BodyStream::ReadSome<Stream> }
+        , _buffer{ buffer }
+        , _req{ req }
+        , _window{ window }
+        , _limits{ limits }
+        , _too_slow{ too_slow }
+    {
+        _req.get().body().streaming = true;
+    }
+
+    /// <summary>
+    /// Next chunk of the body, valid until the next call, empty once the body is complete
+    /// Throw boost::system::system_error on read error, timeout (deadline or min_rate) or when a chunked body goes over
+    /// the route limit
+    /// </summary>
+    boost::asio::awaitable<boost::asio::const_buffer> Next()
+    {
+        auto& body = _req.get().body();
+        body.window = _window.data();
+        body.window_size = _window.size();
+        body.window_used = 0;
+
+        while (!_req.is_done() && body.window_used == 0)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            auto [ec, bytes] = co_await _read(_stream, _buffer, _req, _limits.body_timeout);
+            _reading += std::chrono::steady_clock::now() - start;
+            if (ec && ec != boost::beast::http::error::need_buffer)
+                throw boost::system::system_error(ec);
+
+            const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(_reading);
+            if (_limits.min_rate && !_req.is_done() && elapsed > _limits.min_rate_grace
+                && (_received + body.window_used) * 1000 < _limits.min_rate * static_cast<std::uint64_t>(elapsed.count()))
+            {
+                if (_too_slow)
+                    ++*_too_slow;
+                throw boost::system::system_error(boost::beast::error::timeout);
+            }
+        }
+
+        _received += body.window_used;
+        co_return boost::asio::const_buffer(_window.data(), body.window_used);
+    }
+
+    /// <summary>
+    /// The whole body has been read, otherwise the rest is still in the socket and the connection cannot be reused
+    /// </summary>
+    bool Done() const
+    {
+        return _req.is_done();
+    }
+
+    std::size_t Received() const
+    {
+        return _received;
+    }
+
+private:
+    using ReadResult = std::tuple<boost::beast::error_code, std::size_t>;
+
+    template <typename Stream>
+    static boost::asio::awaitable<ReadResult> ReadSome(void* stream, boost::beast::flat_buffer& buffer, Request& req, std::chrono::milliseconds timeout)
+    {
+        auto& s = *static_cast<Stream*>(stream);
+
+        // deadline per read, a long upload is fine as long as it keeps moving at min_rate
+        boost::beast::get_lowest_layer(s).expires_after(timeout);
+        co_return co_await boost::beast::http::async_read_some(s, buffer, req, boost::asio::as_tuple(boost::asio::use_awaitable));
+    }
+
+    void* _stream;
+    boost::asio::awaitable<ReadResult>(*_read)(void* stream, boost::beast::flat_buffer& buffer, Request& req, std::chrono::milliseconds timeout);
+    boost::beast::flat_buffer& _buffer;
+    Request& _req;
+    std::span<char> _window;
+    const ConnectionLimits& _limits;
+    std::atomic<std::size_t>* _too_slow;
+    std::size_t _received = 0;
+    // time spent waiting for the client, the min_rate check is made against it
+    std::chrono::steady_clock::duration _reading{};
+};
@@ -0,0 +1,445 @@
+#pragma once
+
+#include <boost/beast.hpp>
+#include <boost/beast/zlib.hpp>
+#include <boost/crc.hpp>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// brotli needs libbrotlienc, define HTTP_WITH_BROTLI to compile it in and offer "br"
+#if defined(HTTP_WITH_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#include "Define.h"
+#include "ResponseBuilder.h"
+
+enum class ContentEncoding : uint8_t
+{
+    Identity,
+    Deflate,
+    Gzip,
+    Brotli
+};
+
+inline constexpr std::size_t ContentEncodingCount = 4;
+
+/// <summary>
+/// Define how responses are compressed
+/// </summary>
+struct CompressionPolicy
+{
+    // bodies smaller than this are sent as they are, the framing would eat what is saved
+    std::size_t threshold = 1024;
+
+    // deflate and gzip level, 1 (fastest) to 9 (smallest)
+    int level = 6;
+
+    // brotli quality, 0 to 11
+    int brotli_quality = 5;
+};
+
+/// <summary>
+/// Compress serialized responses according to the request Accept-Encoding
+/// Works on the wire form: the body of a response is compressed and its header rewritten (Content-Length,
+/// Content-Encoding, Vary, ETag), so any handler is covered without knowing about it
+/// The deflate state is kept per thread and reset between responses, its windows are allocated once per thread
+/// </summary>
+class ResponseCompressor
+{
+public:
+    explicit ResponseCompressor(CompressionPolicy policy = {})
+        : _policy{ policy }
+    {
+    }
+
+    const CompressionPolicy& Policy() const
+    {
+        return _policy;
+    }
+
+    /// <summary>
+    /// Preferred encoding accepted by the request, Identity when none is
+    /// Highest q-value wins, ties go to br then gzip then deflate, q=0 refuses an encoding and * covers the unlisted
+    /// </summary>
+    static ContentEncoding Negotiate(std::string_view accept_encoding)
+    {
+        const auto q = Qualities(accept_encoding);
+
+        ContentEncoding best = ContentEncoding::Identity;
+        int best_q = 0;
+        for (const auto encoding : { ContentEncoding::Brotli, ContentEncoding::Gzip, ContentEncoding::Deflate })
+        {
+            if (encoding == ContentEncoding::Brotli && !BrotliAvailable())
+                continue;
+
+            const int value = q[static_cast<std::size_t>(encoding)];
+            if (value > best_q)
+            {
+                best = encoding;
+                best_q = value;
+            }
+        }
+        return best;
+    }
+
+    /// <summary>
+    /// q-value in thousandths the Accept-Encoding header gives each encoding, * applied to the ones it does not
+    /// list, 0 for refused or not accepted
+    /// For the representations encoded ahead of time (StaticFiles) whatever the encoders compiled in
+    /// </summary>
+    static std::array<int, ContentEncodingCount> Qualities(std::string_view accept_encoding)
+    {
+        std::array<int, ContentEncodingCount> q;
+        q.fill(-1);
+        int any = -1;
+
+        while (!accept_encoding.empty())
+        {
+            const auto comma = accept_encoding.find(',');
+            std::string_view item = Trim(accept_encoding.substr(0, comma));
+            accept_encoding = comma == std::string_view::npos ? std::string_view{} : accept_encoding.substr(comma + 1);
+
+            const auto semicolon = item.find(';');
+            const std::string_view name = Trim(item.substr(0, semicolon));
+            const int value = semicolon == std::string_view::npos ? 1000 : Quality(item.substr(semicolon + 1));
+
+            if (name == "*")
+                any = value;
+            else if (const auto encoding = Parse(name))
+                q[static_cast<std::size_t>(*encoding)] = value;
+        }
+
+        for (auto& value : q)
+            value = std::max(value >= 0 ? value : any, 0);
+        return q;
+    }
+
+    static ContentEncoding Negotiate(const Request& req)
+    {
+        const auto value = req.get()[boost::beast::http::field::accept_encoding];
+        return Negotiate(std::string_view(value.data(), value.size()));
+    }
+
+    /// <summary>
+    /// Compress the response the request accepts an encoding for, others are returned untouched
+    /// Its header is read first (PeekHeader): a response under the threshold, not a text type or already encoded is
+    /// handed back as it is, only one that qualifies is serialized to be compressed
+    /// </summary>
+    Response Filter(const Request& req, Response response) const
+    {
+        const ContentEncoding encoding = Negotiate(req);
+        if (encoding == ContentEncoding::Identity)
+            return response;
+
+        std::pmr::string header(req.get().get_allocator());
+        if (!PeekHeader(response, header) || !Qualifies(header))
+            return response;
+
+        const bool keep_alive = response.keep_alive();
+        std::pmr::string bytes(req.get().get_allocator());
+        if (!SerializeResponse(response, bytes))
+            throw std::runtime_error("ResponseCompressor: unable to serialize the response");
+
+        if (auto compressed = Compress(bytes, encoding))
+            bytes.assign(*compressed);
+        return boost::beast::http::message<false, boost::beast::http::empty_body, SerializedFields>{ std::piecewise_construct, std::make_tuple(), std::make_tuple(std::move(bytes), keep_alive) };
+    }
+
+    /// <summary>
+    /// Serialized response with its body compressed, nullopt when it does not qualify: body under the threshold,
+    /// not a text type, already encoded, chunked, or not smaller once compressed
+    /// </summary>
+    std::optional<std::string> Compress(std::string_view response, ContentEncoding encoding) const
+    {
+        const auto header_end = response.find("\r\n\r\n");
+        if (encoding == ContentEncoding::Identity || header_end == std::string_view::npos)
+            return std::nullopt;
+
+        const std::string_view body = response.substr(header_end + 4);
+        if (body.size() < _policy.threshold)
+            return std::nullopt;
+
+        // copy the header lines that stay, Content-Length is written again and ETag gets the encoding appended
+        std::string out;
+        out.reserve(header_end + 128);
+        bool compressible = false;
+        std::string_view rest = response.substr(0, header_end + 2);
+        const auto status_end = rest.find("\r\n");
+        out.append(rest.substr(0, status_end + 2));
+        rest.remove_prefix(status_end + 2);
+
+        while (!rest.empty())
+        {
+            const auto line_end = rest.find("\r\n");
+            const std::string_view line = rest.substr(0, line_end);
+            rest.remove_prefix(line_end + 2);
+
+            const auto colon = line.find(':');
+            const std::string_view name = line.substr(0, colon);
+            const std::string_view value = colon == std::string_view::npos ? std::string_view{} : Trim(line.substr(colon + 1));
+
+            if (IEquals(name, "Content-Encoding") || IEquals(name, "Transfer-Encoding"))
+                return std::nullopt;
+            if (IEquals(name, "Content-Length"))
+                continue;
+            if (IEquals(name, "Content-Type"))
+                compressible = Compressible(value);
+
+            if (IEquals(name, "ETag"))
+            {
+                out.append("ETag: ").append(VariantETag(value, encoding)).append("\r\n");
+                continue;
+            }
+            out.append(line).append("\r\n");
+        }
+        if (!compressible)
+            return std::nullopt;
+
+        std::string encoded;
+        if (!Encode(body, encoding, encoded) || encoded.size() >= body.size())
+            return std::nullopt;
+
+        char digits[20];
+        const auto length = std::to_chars(digits, digits + sizeof(digits), encoded.size());
+        out.append("Content-Encoding: ").append(Name(encoding)).append("\r\n");
+        out.append("Vary: Accept-Encoding\r\n");
+        out.append("Content-Length: ").append(digits, length.ptr).append("\r\n\r\n");
+        out.append(encoded);
+        return out;
+    }
+
+    /// <summary>
+    /// Compress data in the given encoding, appended to out
+    /// </summary>
+    bool Encode(std::string_view data, ContentEncoding encoding, std::string& out) const
+    {
+        switch (encoding)
+        {
+        case ContentEncoding::Deflate:
+        {
+            // zlib format (RFC 1950): header, raw deflate, adler32
+            out.append("\x78\x9c", 2);
+            if (!RawDeflate(data, out))
+                return false;
+            AppendBigEndian(out, Adler32(data));
+            return true;
+        }
+        case ContentEncoding::Gzip:
+        {
+            // gzip format (RFC 1952): fixed header without name or time, raw deflate, crc32 and size
+            out.append("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+            if (!RawDeflate(data, out))
+                return false;
+            boost::crc_32_type crc;
+            crc.process_bytes(data.data(), data.size());
+            AppendLittleEndian(out, crc.checksum());
+            AppendLittleEndian(out, static_cast<std::uint32_t>(data.size()));
+            return true;
+        }
+        case ContentEncoding::Brotli:
+        {
+#if defined(HTTP_WITH_BROTLI)
+            const std::size_t offset = out.size();
+            std::size_t size = BrotliEncoderMaxCompressedSize(data.size());
+            out.resize(offset + size);
+            if (!BrotliEncoderCompress(_policy.brotli_quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(), reinterpret_cast<const uint8_t*>(data.data()), &size, reinterpret_cast<uint8_t*>(out.data() + offset)))
+                return false;
+            out.resize(offset + size);
+            return true;
+#else
+            return false;
+#endif
+        }
+        default:
+            return false;
+        }
+    }
+
+    static std::string_view Name(ContentEncoding encoding)
+    {
+        switch (encoding)
+        {
+        case ContentEncoding::Deflate: return "deflate";
+        case ContentEncoding::Gzip: return "gzip";
+        case ContentEncoding::Brotli: return "br";
+        default: return "identity";
+        }
+    }
+
+    /// <summary>
+    /// ETag of the encoded variant of a response, strong ETags differ per representation
+    /// </summary>
+    static std::string VariantETag(std::string_view etag, ContentEncoding encoding)
+    {
+        if (etag.size() < 2 || etag.back() != '"')
+            return std::string(etag);
+        return std::string(etag.substr(0, etag.size() - 1)) + "-" + std::string(Name(encoding)) + "\"";
+    }
+
+    static constexpr bool BrotliAvailable()
+    {
+#if defined(HTTP_WITH_BROTLI)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+    bool RawDeflate(std::string_view data, std::string& out) const
+    {
+        thread_local boost::beast::zlib::deflate_stream stream;
+        thread_local int level = -1;
+        if (level != _policy.level)
+        {
+            stream.reset(_policy.level, 15, 8, boost::beast::zlib::Strategy::normal);
+            level = _policy.level;
+        }
+        else
+        {
+            stream.reset();
+        }
+
+        const std::size_t offset = out.size();
+        out.resize(offset + stream.upper_bound(data.size()));
+
+        boost::beast::zlib::z_params zs;
+        zs.next_in = data.data();
+        zs.avail_in = data.size();
+        zs.next_out = out.data() + offset;
+        zs.avail_out = out.size() - offset;
+
+        boost::beast::error_code ec;
+        stream.write(zs, boost::beast::zlib::Flush::finish, ec);
+        if (ec != boost::beast::zlib::error::end_of_stream)
+            return false;
+
+        out.resize(offset + zs.total_out);
+        return true;
+    }
+
+    static std::uint32_t Adler32(std::string_view data)
+    {
+        std::uint32_t a = 1;
+        std::uint32_t b = 0;
+        // 5552 bytes is the largest run before b can overflow
+        while (!data.empty())
+        {
+            const std::size_t n = std::min<std::size_t>(data.size(), 5552);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                a += static_cast<unsigned char>(data[i]);
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+            data.remove_prefix(n);
+        }
+        return (b << 16) | a;
+    }
+
+    static void AppendBigEndian(std::string& out, std::uint32_t value)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back(static_cast<char>((value >> shift) & 0xff));
+    }
+
+    static void AppendLittleEndian(std::string& out, std::uint32_t value)
+    {
+        for (int shift = 0; shift <= 24; shift += 8)
+            out.push_back(static_cast<char>((value >> shift) & 0xff));
+    }
+
+    // header worth compressing the body of: Content-Length at the threshold or above, a text type, not encoded
+    bool Qualifies(std::string_view header) const
+    {
+        std::uint64_t length = 0;
+        bool compressible = false;
+        std::string_view rest = header.substr(std::min(header.find("\r\n"), header.size()));
+
+        while (!rest.empty())
+        {
+            rest.remove_prefix(std::min<std::size_t>(2, rest.size()));
+            const auto line_end = rest.find("\r\n");
+            const std::string_view line = rest.substr(0, line_end);
+            rest.remove_prefix(std::min(line_end, rest.size()));
+
+            const auto colon = line.find(':');
+            const std::string_view name = line.substr(0, colon);
+            const std::string_view value = colon == std::string_view::npos ? std::string_view{} : Trim(line.substr(colon + 1));
+
+            if (IEquals(name, "Content-Encoding") || IEquals(name, "Transfer-Encoding"))
+                return false;
+            if (IEquals(name, "Content-Length"))
+                std::from_chars(value.data(), value.data() + value.size(), length);
+            else if (IEquals(name, "Content-Type"))
+                compressible = Compressible(value);
+        }
+        return compressible && length >= _policy.threshold;
+    }
+
+    static bool Compressible(std::string_view content_type)
+    {
+        content_type = content_type.substr(0, content_type.find(';'));
+        return content_type.starts_with("text/") || content_type == "application/json" || content_type == "application/javascript"
+            || content_type == "application/xml" || content_type == "image/svg+xml" || content_type.ends_with("+json") || content_type.ends_with("+xml");
+    }
+
+    static std::optional<ContentEncoding> Parse(std::string_view name)
+    {
+        if (IEquals(name, "gzip") || IEquals(name, "x-gzip")) return ContentEncoding::Gzip;
+        if (IEquals(name, "deflate")) return ContentEncoding::Deflate;
+        if (IEquals(name, "br")) return ContentEncoding::Brotli;
+        return std::nullopt;
+    }
+
+    // q-value in thousandths, "q=0.5" gives 500, malformed values count as 0
+    static int Quality(std::string_view params)
+    {
+        params = Trim(params);
+        if (params.size() < 3 || (params[0] != 'q' && params[0] != 'Q') || params[1] != '=')
+            return 1000;
+
+        const std::string_view value = params.substr(2);
+        if (value.empty() || (value[0] != '0' && value[0] != '1'))
+            return 0;
+
+        int q = (value[0] - '0') * 1000;
+        int scale = 100;
+        for (std::size_t i = 2; i < value.size() && i < 5 && value[1] == '.'; ++i, scale /= 10)
+        {
+            if (value[i] < '0' || value[i] > '9')
+                return 0;
+            q += (value[i] - '0') * scale;
+        }
+        return std::min(q, 1000);
+    }
+
+    static bool IEquals(std::string_view a, std::string_view b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+        {
+            return (x >= 'A' && x <= 'Z' ? x + 32 : x) == (y >= 'A' && y <= 'Z' ? y + 32 : y);
+        });
+    }
+
+    static std::string_view Trim(std::string_view value)
+    {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+        return value;
+    }
+
+private:
+    CompressionPolicy _policy;
+};
@@ -1,17 +1,113 @@
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <coroutine>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <optional>
+#include <random>
+#include <regex>
 #include <stdexcept>
+#include <thread>
 
 #include <boost/asio.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/bind/bind.hpp>
 
+
 #include "http_server.h"
 #include "HttpClient.h"
+#include "HttpClientPool.h"
+#include "IoBackend.h"
+#include "Metrics.h"
+#include "RateLimit.h"
+#include "SelfSignedCertificate.h"
+#include "TokenAuth.h"
 
 static int count = 0;
 static int success = 0;
 
+// global allocations made by the current thread, used to prove the steady state of the request path allocates nothing
+static thread_local std::size_t thread_allocations = 0;
+// the same for the whole process, the server answering on the threads of the pool
+static std::atomic<std::size_t> process_allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    ++thread_allocations;
+    process_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// std::pmr::new_delete_resource goes through the aligned overloads
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    ++thread_allocations;
+    process_allocations.fetch_add(1, std::memory_order_relaxed);
+    const std::size_t align = static_cast<std::size_t>(alignment);
+#if defined(_WIN32)
+    if (void* p = _aligned_malloc(size ? size : 1, align))
+        return p;
+#else
+    if (void* p = std::aligned_alloc(align, (std::max<std::size_t>(size, 1) + align - 1) & ~(align - 1)))
+        return p;
+#endif
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+    operator delete(p, alignment);
+}
+
+/// <summary>
+/// Upstream resource counting the allocations reaching it
+/// </summary>
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+    std::size_t allocations = 0;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        ++allocations;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
 template <class T>
 void UnitTest(const boost::beast::http::response<T>& res, const Status& s)
 {
@@ -27,16 +123,1260 @@ void UnitTest(const boost::beast::http::response<T>& res, const Status& s)
     count++;
 }
 
-boost::asio::awaitable<void> DoUnitTests(boost::asio::any_io_executor exec)
+void UnitTest(const std::string& name, bool result)
+{
+    std::cout << "EXPECTED RESULT\t=> [" << name << "]";
+    if (result)
+    {
+        success++;
+        std::cout << " SUCCESS\n\n";
+    }
+    else
+        std::cout << " FAILED\n\n";
+
+    count++;
+}
+
+void ArenaUnitTests()
+{
+    // parse the same keep-alive request again and again, once warm nothing may reach the upstream or operator new
+    CountingResource upstream;
+    RequestArena arena(1024, &upstream);
+
+    const std::string body(8 * 1024, 'x');
+    const std::string raw = "POST /toto HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n"
+        "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+    std::size_t warm_upstream = 0;
+    std::size_t warm_global = 0;
+    bool parsed = true;
+    for (int i = 0; i < 100; ++i)
+    {
+        if (i == 1)
+        {
+            warm_upstream = upstream.allocations;
+            warm_global = thread_allocations;
+        }
+
+        arena.Reset();
+        Request req{ std::piecewise_construct, std::make_tuple(Allocator(&arena)), std::make_tuple(Allocator(&arena)) };
+        req.eager(true);
+
+        boost::beast::error_code ec;
+        req.put(boost::asio::buffer(raw), ec);
+        parsed = parsed && !ec && req.is_done() && req.get().body().size() == body.size();
+    }
+
+    std::cout << "Arena: " << upstream.allocations - warm_upstream << " upstream and " << thread_allocations - warm_global << " global allocations after warm up\n";
+    UnitTest("request parsing allocates nothing once the arena is warm", parsed && upstream.allocations == warm_upstream && thread_allocations == warm_global);
+}
+
+void LogUnitTests()
+{
+    // a full ring refuses the record instead of blocking the producer
+    auto ring = std::make_unique<LogRing>(0);
+    std::size_t pushed = 0;
+    for (std::size_t i = 0; i < LogRing::Capacity + 10; ++i)
+        pushed += ring->TryPush([i](LogRecord& record) { record.arg_count = static_cast<uint8_t>(i % 7); });
+
+    std::size_t drained = ring->Drain([](const LogRecord&) {});
+    UnitTest("log ring drops records once full", pushed == LogRing::Capacity && drained == LogRing::Capacity && ring->Empty());
+}
+
+/// <summary>
+/// Components given by the regex pair uri used to be parsed with, reference for the uri fuzz test
+/// </summary>
+struct RegexUri
+{
+    std::string scheme, authority, user, pass, host, path, query, fragment, target;
+    uint16_t port = 0;
+
+    explicit RegexUri(const std::string& str)
+    {
+        static const std::regex url_rx("^(?:([a-z]+):)*(?://)*([^/?#]+)*([^?#]*)([^#]*)(.*)$", std::regex::icase);
+        static const std::regex authority_rx("^(?:([^:@]*)(?::([^@]*))*@)*([^:]*)(?::(\\d+))*$", std::regex::icase);
+
+        std::smatch m;
+        if (!std::regex_match(str, m, url_rx))
+            throw std::invalid_argument("unable to parse uri: " + str);
+        scheme = m[1];
+        authority = m[2];
+        path = m[3];
+        query = m[4];
+        fragment = m[5];
+        target = str.substr(m.position(3));
+
+        std::smatch a;
+        if (!std::regex_match(authority, a, authority_rx))
+            throw std::invalid_argument("unable to parse authority: " + authority);
+        user = a[1];
+        pass = a[2];
+        host = a[3];
+        if (a[4].matched)
+        {
+            if (std::from_chars(&*a[4].first, &*a[4].first + a[4].length(), port).ec != std::errc{})
+                throw std::runtime_error("Invalid port specified");
+        }
+        if (port == 0)
+        {
+            if (scheme.empty() || scheme == "http") port = 80;
+            else if (scheme == "https") port = 443;
+            else if (scheme == "ftp") port = 21;
+            else if (scheme == "ssh") port = 22;
+        }
+        if (scheme.empty()) scheme = "http";
+        if (path.empty()) path = "/";
+        if (target.empty()) target = "/";
+    }
+};
+
+void UriUnitTests()
+{
+    // random urls built from the delimiters must give the same components (or the same error) as the regex parser
+    std::mt19937 rng(42);
+    const std::string alphabet = "aZ09:/?#@.-%\n";
+    std::size_t mismatches = 0;
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::string str(rng() % 32, ' ');
+        for (auto& c : str)
+            c = alphabet[rng() % alphabet.size()];
+
+        std::string expected_error;
+        std::optional<RegexUri> expected;
+        try { expected.emplace(str); }
+        catch (const std::exception& e) { expected_error = e.what(); }
+
+        try
+        {
+            const uri parsed(str, i % 2);
+            // regex engines disagree on the captures kept by a repeated group, pass is only compared for a single userinfo
+            const bool single_userinfo = std::count(parsed.authority().begin(), parsed.authority().end(), '@') <= 1;
+            mismatches += !expected || parsed.scheme() != expected->scheme || parsed.authority() != expected->authority
+                || parsed.user() != expected->user || (single_userinfo && parsed.pass() != expected->pass)
+                || parsed.host() != expected->host || parsed.port() != expected->port || parsed.path() != expected->path
+                || parsed.query() != expected->query || parsed.fragment() != expected->fragment || parsed.target() != expected->target;
+        }
+        catch (const std::exception& e)
+        {
+            mismatches += expected.has_value() || expected_error != e.what();
+        }
+    }
+
+    // an owned copy keeps its components valid once the source is gone
+    std::optional<uri> copied;
+    {
+        std::string source = "https://user:pw@example.com:8443/a/b?x=1#top";
+        copied.emplace(source, true);
+        source.assign(source.size(), '*');
+    }
+    const uri moved = std::move(*copied);
+    const bool owned = moved.scheme() == "https" && moved.user() == "user" && moved.pass() == "pw" && moved.host() == "example.com"
+        && moved.port() == 8443 && moved.path() == "/a/b" && moved.query() == "?x=1" && moved.fragment() == "#top";
+
+    UnitTest("uri parser matches the regex parser on random urls", mismatches == 0 && owned);
+}
+
+void QueryUnitTests()
+{
+    // reading two parameters out of a long query copies nothing unless they hold an escape
+    std::string target = "/events?session=8f14e45fceea167a5a36dedd4bea2543&page=%2Fhome&ref=&flag";
+    for (int i = 0; i < 40; ++i)
+        target += "&dim" + std::to_string(i) + "=" + std::to_string(i * i);
+    target += "&q=hello+w%6Frld%zz#top";
+
+    const std::size_t allocations = thread_allocations;
+    const QueryParams query(target);
+    const bool plain = query.Get("session") == "8f14e45fceea167a5a36dedd4bea2543" && query.Get("dim39") == "1521" && query.Has("flag") && query.Get("ref") == "";
+    const std::size_t plain_allocations = thread_allocations - allocations;
+
+    const bool decoded = query.Get("page") == "/home" && query.Raw("page") == "%2Fhome" && query.Get("q") == "hello world%zz" && !query.Get("missing")
+        && query.Size() == 45 && query.Get("page")->data() == query.Get("page")->data();
+
+    RouteParams params;
+    Router<int> router;
+    router.Add(Verb::get, "/files/{name}", 0);
+    router.Freeze();
+    std::string buffer;
+    const bool path = router.Match(Verb::get, "/files/a%20b+c", params) && params.Decode("name", buffer) == "a b+c";
+
+    UnitTest("query parameters are split lazily and decoded on read", plain && plain_allocations == 0 && decoded && path);
+}
+
+void CacheUnitTests()
+{
+    const auto make = [](std::size_t size)
+    {
+        boost::beast::http::response<boost::beast::http::string_body> res{ Status::ok, 11 };
+        res.body().assign(size, 'x');
+        res.prepare_payload();
+        return boost::beast::http::message_generator(std::move(res));
+    };
+
+    // the least recently used entries go first once the bound is reached, an invalidation drops what is being built
+    ResponseCache cache(2000);
+    for (int i = 0; i < 5; ++i)
+    {
+        auto response = make(300);
+        cache.Store("/" + std::to_string(i), response, std::chrono::seconds(60), cache.Version());
+        cache.Find("/0");
+    }
+    const bool bounded = cache.Bytes() <= 2000 && cache.Find("/0") && !cache.Find("/1") && cache.Find("/4") && cache.GetStats().evicted > 0;
+
+    const std::uint64_t version = cache.Version();
+    cache.Invalidate();
+    auto late = make(10);
+    cache.Store("/late", late, std::chrono::seconds(60), version);
+    auto expired = make(10);
+    cache.Store("/expired", expired, std::chrono::seconds(0), cache.Version());
+    const bool invalidated = !cache.Find("/0") && !cache.Find("/late") && !cache.Find("/expired");
+
+    // the Date a response was stored with is not sent again, the current one is, 304 included
+    auto dated = ResponseBuilder(Status::ok, 11, true).Line(HeaderLines::ContentTypeJson).Body("{}");
+    const auto stored = cache.Store("/dated", dated, std::chrono::seconds(60), cache.Version());
+    static constexpr std::string_view epoch = "Thu, 01 Jan 1970 00:00:00 GMT";
+    auto& identity = stored->variants[static_cast<std::size_t>(ContentEncoding::Identity)];
+    for (auto* bytes : { &identity.bytes, &identity.not_modified })
+    {
+        const auto at = bytes->find("Date: ");
+        if (at != std::string::npos)
+            bytes->replace(at + 6, epoch.size(), epoch);
+    }
+    const auto served_date = [&](std::string_view header)
+    {
+        Request req;
+        const std::string raw = "GET /dated HTTP/1.1\r\nHost: 127.0.0.1\r\n" + std::string(header) + "\r\n";
+        boost::beast::error_code ec;
+        req.put(boost::asio::buffer(raw), ec);
+        std::string bytes;
+        SerializeResponse(cache.Serve(stored, req), bytes);
+
+        boost::beast::http::response_parser<boost::beast::http::string_body> parser;
+        parser.eager(true);
+        parser.put(boost::asio::buffer(bytes), ec);
+        return ec ? std::string() : std::string(parser.get()[boost::beast::http::field::date]);
+    };
+    const std::string date = served_date("");
+    const std::string not_modified_date = served_date("If-None-Match: *\r\n");
+    const bool current = date.size() == HttpDate::Size && date != epoch && not_modified_date.size() == HttpDate::Size && not_modified_date != epoch;
+
+    UnitTest("response cache is bounded, expires and invalidates", bounded && invalidated);
+    UnitTest("cached responses are sent with the current Date", current);
+}
+
+void ResponseBuilderUnitTests()
+{
+    const auto serialize = [](boost::beast::http::message_generator response)
+    {
+        std::string bytes;
+        SerializeResponse(response, bytes);
+        return bytes;
+    };
+
+    char date[HttpDate::Size];
+    HttpDate::Format(784111777, date);
+    const bool formatted = std::string_view(date, sizeof(date)) == "Sun, 06 Nov 1994 08:49:37 GMT";
+
+    // the builder output must read back as the response beast used to build
+    const std::string body = "{\"id\":\"42\"}";
+    boost::beast::http::response_parser<boost::beast::http::string_body> parser;
+    parser.eager(true);
+    boost::beast::error_code ec;
+    const std::string built = serialize(ResponseBuilder(Status::ok, 11, true).Line(HeaderLines::ContentTypeJson).Body(body));
+    parser.put(boost::asio::buffer(built), ec);
+    const auto& res = parser.get();
+    const bool same = !ec && parser.is_done() && res.result() == Status::ok && res.keep_alive() && res.body() == body
+        && res[boost::beast::http::field::content_type] == "application/json" && res[boost::beast::http::field::server] == BOOST_BEAST_VERSION_STRING
+        && res[boost::beast::http::field::date].size() == HttpDate::Size;
+
+    UnitTest("response builder writes the wire form beast would", formatted && same);
+}
+
+/// <summary>
+/// Inflate a raw deflate stream, reference decoder for the compression tests
+/// </summary>
+std::string Inflate(std::string_view data)
+{
+    boost::beast::zlib::inflate_stream stream;
+    std::string out(1024 * 1024, '\0');
+    boost::beast::zlib::z_params zs;
+    zs.next_in = data.data();
+    zs.avail_in = data.size();
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    boost::beast::error_code ec;
+    stream.write(zs, boost::beast::zlib::Flush::finish, ec);
+    out.resize(ec == boost::beast::zlib::error::end_of_stream ? zs.total_out : 0);
+    return out;
+}
+
+void CompressionUnitTests()
+{
+    const bool negotiated = ResponseCompressor::Negotiate("gzip, deflate") == ContentEncoding::Gzip
+        && ResponseCompressor::Negotiate("deflate;q=1, gzip;q=0.5") == ContentEncoding::Deflate
+        && ResponseCompressor::Negotiate("gzip;q=0, deflate;q=0.5, *;q=0.1") == ContentEncoding::Deflate
+        && ResponseCompressor::Negotiate("gzip;q=0, *") == (ResponseCompressor::BrotliAvailable() ? ContentEncoding::Brotli : ContentEncoding::Deflate)
+        && ResponseCompressor::Negotiate("identity") == ContentEncoding::Identity
+        && ResponseCompressor::Negotiate("") == ContentEncoding::Identity;
+
+    // an analytics like json document
+    std::string body = "[";
+    for (int i = 0; i < 400; ++i)
+        body += "{\"id\":" + std::to_string(i) + ",\"name\":\"item " + std::to_string(i) + "\",\"tags\":[\"red\",\"blue\"],\"score\":" + std::to_string(i * 37 % 101) + "},";
+    body.back() = ']';
+
+    const auto request = [](std::string_view accept_encoding)
+    {
+        auto req = std::make_unique<Request>();
+        const std::string raw = "GET /items HTTP/1.1\r\nHost: 127.0.0.1\r\nAccept-Encoding: " + std::string(accept_encoding) + "\r\n\r\n";
+        boost::beast::error_code ec;
+        req->put(boost::asio::buffer(raw), ec);
+        return req;
+    };
+    const auto parse = [](const std::string& bytes)
+    {
+        boost::beast::http::response_parser<boost::beast::http::string_body> parser;
+        parser.eager(true);
+        boost::beast::error_code ec;
+        parser.put(boost::asio::buffer(bytes), ec);
+        return parser.release();
+    };
+
+    // gzip and deflate bodies decode back to the original, a small body is left alone
+    const ResponseCompressor compressor;
+    std::string gzip, deflate, small;
+    SerializeResponse(compressor.Filter(*request("gzip"), ResponseBuilder(Status::ok, 11, true).Line(HeaderLines::ContentTypeJson).Body(body)), gzip);
+    SerializeResponse(compressor.Filter(*request("deflate"), ResponseBuilder(Status::ok, 11, true).Line(HeaderLines::ContentTypeJson).Body(body)), deflate);
+    SerializeResponse(compressor.Filter(*request("gzip"), ResponseBuilder(Status::ok, 11, true).Line(HeaderLines::ContentTypeJson).Body("{}")), small);
+
+    const auto gzip_res = parse(gzip);
+    const auto deflate_res = parse(deflate);
+    const std::string_view gzip_body = gzip_res.body();
+    const std::string_view deflate_body = deflate_res.body();
+    const bool decoded = gzip_res[boost::beast::http::field::content_encoding] == "gzip" && gzip_body.starts_with("\x1f\x8b")
+        && Inflate(gzip_body.substr(10, gzip_body.size() - 18)) == body
+        && deflate_res[boost::beast::http::field::content_encoding] == "deflate" && Inflate(deflate_body.substr(2, deflate_body.size() - 6)) == body
+        && parse(small)[boost::beast::http::field::content_encoding].empty();
+
+    // a response that does not qualify is decided on its header and handed back as it is, never serialized
+    const auto first_byte = [](Response& response)
+    {
+        boost::beast::error_code ec;
+        const auto chunk = response.prepare(ec);
+        return ec || chunk.begin() == chunk.end() ? nullptr : (*chunk.begin()).data();
+    };
+    Response image = ResponseBuilder(Status::ok, 11, true).Line("Content-Type: image/png\r\n").Body(std::string(4096, 'x'));
+    Response tiny = ResponseBuilder(Status::ok, 11, true).Line(HeaderLines::ContentTypeJson).Body("{}");
+    const void* const image_bytes = first_byte(image);
+    const void* const tiny_bytes = first_byte(tiny);
+    Response image_filtered = compressor.Filter(*request("gzip"), std::move(image));
+    Response tiny_filtered = compressor.Filter(*request("gzip"), std::move(tiny));
+    const bool untouched = first_byte(image_filtered) == image_bytes && first_byte(tiny_filtered) == tiny_bytes;
+
+    // a cached response is compressed once per encoding, with its own ETag
+    ResponseCache cache;
+    auto response = ResponseBuilder(Status::ok, 11, true).Line(HeaderLines::ContentTypeJson).Body(body);
+    const auto cached = cache.Store("/items", response, std::chrono::seconds(60), cache.Version());
+    std::string first, second;
+    SerializeResponse(cache.Serve(cached, *request("gzip"), &compressor), first);
+    SerializeResponse(cache.Serve(cached, *request("gzip"), &compressor), second);
+    const auto& variant = cached->variants[static_cast<std::size_t>(ContentEncoding::Gzip)];
+    const bool variants = parse(first).body() == parse(variant.bytes).body() && parse(second).body() == parse(variant.bytes).body() && variant.etag == ResponseCompressor::VariantETag(cached->Identity().etag, ContentEncoding::Gzip)
+        && parse(first)[boost::beast::http::field::etag] == variant.etag;
+
+    UnitTest("responses are compressed for the encoding the client accepts", negotiated && decoded && variants);
+    UnitTest("a response that does not qualify for compression is not serialized by the filter", untouched);
+}
+
+void RateLimitUnitTests()
+{
+    // 10 requests per second, bursts of 5: the sixth request at once waits, one interval later one token is back
+    RateLimiter limiter(RateLimitPolicy{ .rate = 10, .burst = 5 });
+    const std::int64_t now = RateLimiter::Now();
+    bool burst = true;
+    for (int i = 0; i < 5; ++i)
+        burst = burst && limiter.Acquire("10.0.0.1", now) == 0;
+    const std::uint32_t retry_after = limiter.Acquire("10.0.0.1", now);
+    const bool other = limiter.Acquire("10.0.0.2", now) == 0;
+    const bool refilled = limiter.Acquire("10.0.0.1", now + 100'000'000) == 0 && limiter.Acquire("10.0.0.1", now + 100'000'000) != 0;
+    UnitTest("token buckets admit a burst, then refuse with Retry-After until refilled", burst && retry_after == 1 && other && refilled);
+
+    // the middleware answers from the request alone, keyed by the address the server stamped on it
+    RateLimitMiddleWare middleware(RateLimitPolicy{ .rate = 1, .burst = 1 });
+    RequestArena arena;
+    Request req{ std::piecewise_construct, std::make_tuple(Allocator(&arena)), std::make_tuple(Allocator(&arena)) };
+    const std::string raw = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    boost::beast::error_code ec;
+    req.put(boost::asio::buffer(raw), ec);
+    Context(req).peer = "192.168.0.1";
+
+    Status code = Status::ok;
+    std::string err;
+    const std::size_t allocations = thread_allocations;
+    const bool first = middleware.Check(req, code, err);
+    const bool allocation_free = thread_allocations == allocations;
+    const bool second = middleware.Check(req, code, err);
+    UnitTest("rate limited requests are refused 429 with Retry-After", first && !second && code == Status::too_many_requests && Context(req).retry_after >= 1);
+    UnitTest("rate limit check allocates nothing", allocation_free);
+
+    // idle keys: once the table is full, new clients take over the slots of buckets back to full
+    RateLimiter small(RateLimitPolicy{ .rate = 1000, .burst = 1, .max_keys = 16 });
+    for (int i = 0; i < 1000; ++i)
+        small.Acquire("client" + std::to_string(i), now);
+    const std::size_t overflow = small.GetStats().overflow;
+    for (int i = 0; i < 8; ++i)
+        small.Acquire("late" + std::to_string(i), now + 1'000'000'000);
+    UnitTest("idle buckets are reused lazily", overflow > 0 && small.GetStats().overflow == overflow);
+
+}
+
+void MetricsUnitTests()
 {
-    // let http server start
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    // every value lands in a bucket whose bounds hold it, within 1/16 of it
+    bool bucketed = true;
+    for (const std::uint64_t us : { 0ull, 15ull, 16ull, 17ull, 1000ull, 123456ull, 999999999ull })
+    {
+        const std::size_t i = LatencyHistogram::Index(us);
+        const std::uint64_t low = i ? LatencyHistogram::UpperBound(i - 1) + 1 : 0;
+        const std::uint64_t high = LatencyHistogram::UpperBound(i);
+        bucketed = bucketed && low <= us && us <= high && high - low <= std::max<std::uint64_t>(1, us / 16);
+    }
+
+    // 1..1000us, recorded from two threads: merged when read
+    auto& metrics = Metrics::Instance();
+    const std::uint32_t route = metrics.RouteId("GET", "/metrics-test/{id}");
+    for (int i = 1; i <= 500; ++i)
+        metrics.RecordRequest(route, 200, i * 1000);
+    std::thread([&] { for (int i = 501; i <= 1000; ++i) metrics.RecordRequest(route, i % 100 ? 200 : 503, i * 1000); }).join();
+    const auto latency = metrics.RouteLatency(route);
+    const bool percentiles = latency.count == 1000 && latency.Percentile(50) >= 480 && latency.Percentile(50) <= 530 && latency.Percentile(99) >= 960 && latency.Percentile(99) <= 1030;
+    UnitTest("latency histograms keep their percentiles within a bucket, across threads", bucketed && percentiles);
+
+    const std::string text = metrics.Render();
+    UnitTest("metrics render as Prometheus text", text.find("http_requests_total{method=\"GET\",route=\"/metrics-test/{id}\",status=\"200\"} 995\n") != std::string::npos
+        && text.find("http_requests_total{method=\"GET\",route=\"/metrics-test/{id}\",status=\"503\"} 5\n") != std::string::npos
+        && text.find("http_request_duration_seconds_bucket{method=\"GET\",route=\"/metrics-test/{id}\",le=\"+Inf\"} 1000\n") != std::string::npos
+        && text.find("# TYPE http_phase_duration_seconds histogram\n") != std::string::npos);
+}
+
+boost::asio::awaitable<void> PipeliningUnitTests(boost::asio::any_io_executor exec)
+{
+    // three pipelined requests sent in one write must be answered in order
+    boost::asio::ip::tcp::socket socket(exec);
+    co_await socket.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+
+    const std::string requests =
+        "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n"
+        "GET /users/7 HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n"
+        "GET /nope HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\nConnection: close\r\n\r\n";
+    co_await boost::asio::async_write(socket, boost::asio::buffer(requests), boost::asio::use_awaitable);
+
+    boost::beast::flat_buffer buffer;
+    for (const auto expected : { Status::ok, Status::ok, Status::not_found })
+    {
+        boost::beast::http::response<boost::beast::http::string_body> res;
+        co_await boost::beast::http::async_read(socket, buffer, res, boost::asio::use_awaitable);
+        UnitTest(res, expected);
+    }
+}
+
+/// <summary>
+/// Wait until the server has closed every connection, so it can be destroyed
+/// </summary>
+boost::asio::awaitable<bool> ConnectionsClosed(const HttpServer& server)
+{
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+    for (int i = 0; i < 200 && server.GetStats().open > 0; ++i)
+    {
+        timer.expires_after(std::chrono::milliseconds(10));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+    co_return server.GetStats().open == 0;
+}
+
+boost::asio::awaitable<void> KeepAliveAllocationUnitTests(boost::asio::any_io_executor exec)
+{
+    // a warm keep-alive connection to the api of the main server, the global allocations left per request
+    // the server runs on one PerCore thread and the client blocks on fixed buffers without allocating: no coroutine
+    // frame moves between the thread caches, the count is the same on every request
+    BasicApi<Pipeline<LoggingMiddleWare, RateLimitMiddleWare, TokenAuthMiddleWare>> api;
+    api.EnableCompression();
+    api.EnableMetrics();
+    ServerConfig config;
+    config.mode = ServerMode::PerCore;
+    config.threads = 1;
+    const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 8085);
+    HttpServer server(exec, endpoint, config);
+    server.AddApi(api);
+    server.Start();
+
+    boost::asio::io_context client;
+    boost::asio::ip::tcp::socket socket(client);
+    socket.connect(endpoint);
+    const std::string request = "GET /users/7 HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n";
+
+    // the first answers warm the arena, the recycling caches and the token cache, and give the size of the next ones
+    std::size_t size = 0;
+    for (int i = 0; i < 10; ++i)
+    {
+        boost::asio::write(socket, boost::asio::buffer(request));
+        boost::beast::flat_buffer buffer;
+        boost::beast::http::response<boost::beast::http::string_body> res;
+        size = boost::beast::http::read(socket, buffer, res);
+    }
+
+    // the log writer thread grows its output buffer to the largest batch it formats, off the request path: the
+    // request log is left out while counting
+    Log::Flush();
+    const LogLevel level = Log::Level();
+    Log::SetLevel(LogLevel::Warn);
+
+    constexpr std::size_t requests = 1000;
+    std::array<char, 1024> response;
+    bool complete = size <= response.size();
+    const std::size_t allocations = process_allocations.load();
+    for (std::size_t i = 0; i < requests && complete; ++i)
+    {
+        boost::asio::write(socket, boost::asio::buffer(request));
+        const std::size_t read = boost::asio::read(socket, boost::asio::buffer(response), boost::asio::transfer_exactly(size));
+        complete = read == size && std::string_view(response.data(), 15) == "HTTP/1.1 200 OK";
+    }
+    const std::size_t allocated = process_allocations.load() - allocations;
+    Log::SetLevel(level);
+
+    // the response bytes come from the request arena; what is left is the one block message_generator takes from
+    // the global heap for its type erased message and serializer (boost::make_unique, no allocator to give it)
+    std::cout << "KeepAlive: " << static_cast<double>(allocated) / requests << " global allocations per request once the connection is warm\n";
+    UnitTest("a warm keep-alive request only allocates its message_generator", complete && allocated == requests);
+
+    socket.close();
+    co_await server.Drain();
+    co_await ConnectionsClosed(server);
+    server.Stop();
+    server.Join();
+}
+
+boost::asio::awaitable<void> BodyUnitTests(boost::asio::any_io_executor exec)
+{
+    // a streamed upload is read chunk by chunk by its route
+    HttpClient client(exec, "127.0.0.1:8080");
+    co_await client.connect();
+    Headers headers = { {"Authorization", "Bearer toto"} };
+    Body upload(4 * 1024 * 1024 + 3, 'u');
+    auto res = co_await client.post<boost::beast::http::string_body>("/upload", upload, "application/octet-stream", headers);
+    UnitTest(res, Status::ok);
+    UnitTest("streamed upload size is reported", res.body() == "{\"size\":" + std::to_string(upload.size()) + "}");
+
+    // a body over the route limit is refused from its header, before it is sent
+    boost::asio::ip::tcp::socket socket(exec);
+    co_await socket.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+    const std::string header = "POST /toto HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\nContent-Length: 2000000000\r\n\r\n";
+    co_await boost::asio::async_write(socket, boost::asio::buffer(header), boost::asio::use_awaitable);
+
+    boost::beast::flat_buffer buffer;
+    boost::beast::http::response<boost::beast::http::string_body> too_large;
+    co_await boost::beast::http::async_read(socket, buffer, too_large, boost::asio::use_awaitable);
+    UnitTest(too_large, Status::payload_too_large);
+
+    // a chunked body has no length to refuse it from, a streamed route stops reading it at its limit (64 MB)
+    boost::asio::ip::tcp::socket chunked(exec);
+    co_await chunked.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+    const std::string chunked_upload = "POST /upload HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "4000001\r\n" + std::string(1000, 'u');
+    co_await boost::asio::async_write(chunked, boost::asio::buffer(chunked_upload), boost::asio::use_awaitable);
+
+    buffer.clear();
+    boost::beast::http::response<boost::beast::http::string_body> chunked_too_large;
+    co_await boost::beast::http::async_read(chunked, buffer, chunked_too_large, boost::asio::use_awaitable);
+    UnitTest(chunked_too_large, Status::payload_too_large);
+
+    char byte;
+    const auto [closed, read] = co_await chunked.async_read_some(boost::asio::buffer(&byte, 1), boost::asio::as_tuple(boost::asio::use_awaitable));
+    UnitTest("a chunked upload over the route limit is refused and its connection closed", closed && read == 0);
+}
+
+boost::asio::awaitable<void> PoolUnitTests(boost::asio::any_io_executor exec)
+{
+    // the second lease must get the keep-alive connection given back by the first one
+    HttpClientPool pool(exec, PoolConfig{ .max_per_host = 1 });
+    Headers headers = { {"Authorization", "Bearer toto"} };
+    {
+        auto lease = co_await pool.acquire("127.0.0.1:8080");
+        UnitTest(co_await lease->get<boost::beast::http::string_body>("/", headers), Status::ok);
+    }
+    {
+        auto lease = co_await pool.acquire("http://127.0.0.1:8080");
+        UnitTest(co_await lease->get<boost::beast::http::string_body>("/users/1", headers), Status::ok);
+    }
+    UnitTest("pool reuses the idle keep-alive connection", pool.stats().created == 1 && pool.stats().reused == 1);
+
+    // host limit reached: the waiter gets the connection as soon as it is released, or times out
+    boost::asio::steady_timer timer(exec);
+    {
+        auto lease = co_await pool.acquire("127.0.0.1:8080");
+        bool timed_out = false;
+        try
+        {
+            co_await pool.acquire("127.0.0.1:8080", std::chrono::seconds(1));
+        }
+        catch (const std::runtime_error&)
+        {
+            timed_out = true;
+        }
+        UnitTest("pool waiter times out while the host is at its limit", timed_out);
+
+        timer.expires_after(std::chrono::milliseconds(100));
+        timer.async_wait([lease = std::make_shared<HttpClientPool::Lease>(std::move(lease))](auto) {});
+    }
+    auto handed = co_await pool.acquire("127.0.0.1:8080", std::chrono::seconds(5));
+    std::cout << "Pool: " << pool.stats().created << " created " << pool.stats().reused << " reused " << pool.stats().waited << " waited\n";
+    UnitTest("pool hands the released connection to the waiter", pool.stats().created == 1 && pool.stats().waited == 2);
+}
+
+/// <summary>
+/// Time until the server closes the connection, what it sends meanwhile is discarded
+/// </summary>
+boost::asio::awaitable<std::chrono::milliseconds> ClosedAfter(boost::beast::tcp_stream& stream)
+{
+    const auto start = std::chrono::steady_clock::now();
+    stream.expires_after(std::chrono::seconds(5));
+    char data[1024];
+    for (;;)
+    {
+        auto [ec, bytes] = co_await stream.async_read_some(boost::asio::buffer(data), boost::asio::as_tuple(boost::asio::use_awaitable));
+        if (ec)
+            break;
+    }
+    co_return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+}
+
+/// <summary>
+/// Send bytes a few at a time every delay, until the server closes the connection
+/// </summary>
+boost::asio::awaitable<void> Trickle(std::shared_ptr<boost::beast::tcp_stream> stream, std::string bytes, std::size_t per_write, std::chrono::milliseconds delay)
+{
+    boost::asio::steady_timer timer(stream->get_executor());
+    for (std::size_t sent = 0; sent < bytes.size(); sent += per_write)
+    {
+        auto [ec, written] = co_await boost::asio::async_write(*stream, boost::asio::buffer(bytes.data() + sent, std::min(per_write, bytes.size() - sent)), boost::asio::as_tuple(boost::asio::use_awaitable));
+        if (ec)
+            co_return;
+        timer.expires_after(delay);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+}
+
+boost::asio::awaitable<void> GovernorUnitTests(boost::asio::any_io_executor exec, const HttpServer& server)
+{
+    // server started by main on 8081 with short deadlines and 2 connections at most
+    const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 8081);
+    const std::string request = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n";
+    boost::asio::steady_timer timer(exec);
+
+    // slowloris: the header keeps coming one byte at a time but never ends, the header deadline is not extended by it
+    // (writer and reader share the stream, both run on its strand)
+    {
+        auto stream = std::make_shared<boost::beast::tcp_stream>(boost::asio::make_strand(exec));
+        co_await stream->async_connect(endpoint, boost::asio::use_awaitable);
+        boost::asio::co_spawn(stream->get_executor(), Trickle(stream, "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n" + std::string(100, 'X'), 1, std::chrono::milliseconds(50)), boost::asio::detached);
+        const auto closed = co_await boost::asio::co_spawn(stream->get_executor(), ClosedAfter(*stream), boost::asio::use_awaitable);
+        std::cout << "Governor: trickled header closed after " << closed.count() << "ms\n";
+        UnitTest("a header trickled byte by byte is cut at the header deadline", closed < std::chrono::milliseconds(1500));
+    }
+
+    // idle keep-alive connection: counted as idle, then reaped
+    {
+        boost::beast::tcp_stream stream(exec);
+        co_await stream.async_connect(endpoint, boost::asio::use_awaitable);
+        co_await boost::asio::async_write(stream, boost::asio::buffer(request), boost::asio::use_awaitable);
+        boost::beast::flat_buffer buffer;
+        boost::beast::http::response<boost::beast::http::string_body> res;
+        co_await boost::beast::http::async_read(stream, buffer, res, boost::asio::use_awaitable);
+        UnitTest(res, Status::ok);
+
+        timer.expires_after(std::chrono::milliseconds(100));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        const std::size_t idle = server.GetStats().idle;
+        const auto closed = co_await ClosedAfter(stream);
+        UnitTest("idle keep-alive connection is counted then closed", idle == 1 && closed < std::chrono::milliseconds(1500));
+    }
+
+    // body sent at 100 bytes/s against a 1000 bytes/s minimum
+    {
+        auto stream = std::make_shared<boost::beast::tcp_stream>(boost::asio::make_strand(exec));
+        co_await stream->async_connect(endpoint, boost::asio::use_awaitable);
+        const std::size_t too_slow = server.GetStats().too_slow;
+        const std::string upload = "POST /toto HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\nContent-Length: 100000\r\n\r\n";
+        co_await boost::asio::async_write(*stream, boost::asio::buffer(upload), boost::asio::use_awaitable);
+        boost::asio::co_spawn(stream->get_executor(), Trickle(stream, std::string(1000, 'b'), 10, std::chrono::milliseconds(100)), boost::asio::detached);
+        const auto closed = co_await boost::asio::co_spawn(stream->get_executor(), ClosedAfter(*stream), boost::asio::use_awaitable);
+        UnitTest("a body sent below the minimum rate is dropped", server.GetStats().too_slow == too_slow + 1 && closed < std::chrono::milliseconds(1500));
+    }
+
+    // the same trickle on a streamed upload: the route pulls the body, the deadline and the rate still apply
+    {
+        auto stream = std::make_shared<boost::beast::tcp_stream>(boost::asio::make_strand(exec));
+        co_await stream->async_connect(endpoint, boost::asio::use_awaitable);
+        const std::size_t too_slow = server.GetStats().too_slow;
+        const std::string upload = "POST /upload HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\nContent-Length: 100000\r\n\r\n";
+        co_await boost::asio::async_write(*stream, boost::asio::buffer(upload), boost::asio::use_awaitable);
+        boost::asio::co_spawn(stream->get_executor(), Trickle(stream, std::string(1000, 'b'), 10, std::chrono::milliseconds(100)), boost::asio::detached);
+        const auto closed = co_await boost::asio::co_spawn(stream->get_executor(), ClosedAfter(*stream), boost::asio::use_awaitable);
+        std::cout << "Governor: trickled streamed upload closed after " << closed.count() << "ms\n";
+        UnitTest("a streamed upload sent below the minimum rate is dropped", server.GetStats().too_slow == too_slow + 1 && closed < std::chrono::milliseconds(1500));
+    }
+
+    // connection cap: a third client waits in the backlog until one of the two open connections is reaped
+    {
+        timer.expires_after(std::chrono::milliseconds(100));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+
+        // the accept loop defers as soon as the second connection is taken, before the loop below returns
+        const std::size_t deferred = server.GetStats().deferred;
+        std::vector<boost::beast::tcp_stream> open;
+        open.reserve(2);
+        for (int i = 0; i < 2; ++i)
+        {
+            auto& stream = open.emplace_back(exec);
+            co_await stream.async_connect(endpoint, boost::asio::use_awaitable);
+            co_await boost::asio::async_write(stream, boost::asio::buffer(request), boost::asio::use_awaitable);
+            boost::beast::flat_buffer buffer;
+            boost::beast::http::response<boost::beast::http::string_body> res;
+            co_await boost::beast::http::async_read(stream, buffer, res, boost::asio::use_awaitable);
+        }
+        const std::size_t gauge = server.GetStats().open;
+
+        boost::beast::tcp_stream third(exec);
+        const auto start = std::chrono::steady_clock::now();
+        co_await third.async_connect(endpoint, boost::asio::use_awaitable);
+        co_await boost::asio::async_write(third, boost::asio::buffer(request), boost::asio::use_awaitable);
+        boost::beast::flat_buffer buffer;
+        boost::beast::http::response<boost::beast::http::string_body> res;
+        co_await boost::beast::http::async_read(third, buffer, res, boost::asio::use_awaitable);
+        const auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+        std::cout << "Governor: third connection served after " << waited.count() << "ms\n";
+        UnitTest(res, Status::ok);
+        UnitTest("accepts stop at max_connections until a connection ends", gauge == 2 && server.GetStats().deferred > deferred && waited >= std::chrono::milliseconds(200));
+    }
+}
+
+/// <summary>
+/// Wait until a SharedPool server accepts on endpoint and, when given, listens on its handoff path: Start() only
+/// spawns the coroutines opening them
+/// </summary>
+boost::asio::awaitable<bool> Listening(boost::asio::ip::tcp::endpoint endpoint, const std::string& handoff_path = {})
+{
+    const auto exec = co_await boost::asio::this_coro::executor;
+    boost::asio::steady_timer timer(exec);
+    for (int i = 0; i < 200; ++i)
+    {
+        boost::asio::ip::tcp::socket probe(exec);
+        const auto [ec] = co_await probe.async_connect(endpoint, boost::asio::as_tuple(boost::asio::use_awaitable));
+        if (!ec && (handoff_path.empty() || std::filesystem::exists(handoff_path)))
+            co_return true;
+        timer.expires_after(std::chrono::milliseconds(10));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+    co_return false;
+}
+
+boost::asio::awaitable<void> HandoffUnitTests(boost::asio::any_io_executor exec)
+{
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    // two instances on 8082 in this process: the second one inherits the listening socket of the first which drains
+    const std::string path = (std::filesystem::temp_directory_path() / "coroutine-handoff-test.sock").string();
+    const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 8082);
+    const std::string request = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    boost::asio::steady_timer timer(exec);
+    Api api;
+
+    ServerConfig config;
+    config.handoff_path = path;
+    config.drain_timeout = std::chrono::milliseconds(2000);
+
+    // a path left by a former run would be taken for the handoff loop of the previous instance
+    std::filesystem::remove(path);
+    auto previous = std::make_unique<HttpServer>(exec, endpoint, config);
+    previous->AddApi(api);
+    std::atomic<bool> handed_off = false;
+    previous->OnHandoff([&]()
+    {
+        previous->BeginDrain();
+        handed_off = true;
+    });
+    previous->Start();
+    co_await Listening(endpoint, path);
+
+    // keep-alive connection opened on the previous instance
+    boost::beast::tcp_stream kept(exec);
+    boost::beast::flat_buffer buffer;
+    co_await kept.async_connect(endpoint, boost::asio::use_awaitable);
+    co_await boost::asio::async_write(kept, boost::asio::buffer(request), boost::asio::use_awaitable);
+    boost::beast::http::response<boost::beast::http::string_body> before;
+    co_await boost::beast::http::async_read(kept, buffer, before, boost::asio::use_awaitable);
+    UnitTest(before, Status::ok);
+
+    // Start() receives the socket from the handoff loop of the previous instance, running on another thread of the pool
+    HttpServer next(exec, endpoint, config);
+    next.AddApi(api);
+    next.Start();
+    for (int i = 0; i < 200 && !handed_off; ++i)
+    {
+        timer.expires_after(std::chrono::milliseconds(10));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+
+    // the draining instance still answers the kept connection, then closes it
+    co_await boost::asio::async_write(kept, boost::asio::buffer(request), boost::asio::use_awaitable);
+    boost::beast::http::response<boost::beast::http::string_body> during;
+    co_await boost::beast::http::async_read(kept, buffer, during, boost::asio::use_awaitable);
+    const auto closed = co_await ClosedAfter(kept);
+    UnitTest(during, Status::ok);
+    UnitTest("draining instance answers with Connection: close", handed_off && !during.keep_alive() && closed < std::chrono::seconds(1));
+
+    const bool drained = co_await previous->Drain();
+    co_await ConnectionsClosed(*previous);
+    previous.reset();
+
+    // the listening socket never closed: new connections are accepted by the next instance
+    boost::beast::tcp_stream fresh(exec);
+    boost::beast::flat_buffer fresh_buffer;
+    co_await fresh.async_connect(endpoint, boost::asio::use_awaitable);
+    co_await boost::asio::async_write(fresh, boost::asio::buffer(request), boost::asio::use_awaitable);
+    boost::beast::http::response<boost::beast::http::string_body> after;
+    co_await boost::beast::http::async_read(fresh, fresh_buffer, after, boost::asio::use_awaitable);
+    UnitTest(after, Status::ok);
+    UnitTest("inherited listening socket is served by the next instance", drained && next.GetStats().open == 1);
+
+    fresh.close();
+    co_await next.Drain();
+    co_await ConnectionsClosed(next);
+
+    // SharedPool to PerCore on 8084: the inherited socket has no SO_REUSEPORT, the contexts share it instead of
+    // binding their own
+    {
+        const boost::asio::ip::tcp::endpoint shared_endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 8084);
+        auto shared = std::make_unique<HttpServer>(exec, shared_endpoint, config);
+        shared->AddApi(api);
+        std::atomic<bool> shared_handed_off = false;
+        shared->OnHandoff([&]()
+        {
+            shared->BeginDrain();
+            shared_handed_off = true;
+        });
+        std::filesystem::remove(path);
+        shared->Start();
+        co_await Listening(shared_endpoint, path);
+
+        ServerConfig per_core_config = config;
+        per_core_config.mode = ServerMode::PerCore;
+        per_core_config.threads = 2;
+        HttpServer per_core(exec, shared_endpoint, per_core_config);
+        per_core.AddApi(api);
+        bool started = true;
+        try
+        {
+            per_core.Start();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "PerCore start failed: " << e.what() << "\n";
+            started = false;
+        }
+        for (int i = 0; i < 200 && !shared_handed_off; ++i)
+        {
+            timer.expires_after(std::chrono::milliseconds(10));
+            co_await timer.async_wait(boost::asio::use_awaitable);
+        }
+        co_await shared->Drain();
+        shared.reset();
+
+        bool served = started;
+        for (int i = 0; i < 4 && served; ++i)
+        {
+            boost::beast::tcp_stream client(exec);
+            boost::beast::flat_buffer client_buffer;
+            co_await client.async_connect(shared_endpoint, boost::asio::use_awaitable);
+            co_await boost::asio::async_write(client, boost::asio::buffer(request), boost::asio::use_awaitable);
+            boost::beast::http::response<boost::beast::http::string_body> res;
+            co_await boost::beast::http::async_read(client, client_buffer, res, boost::asio::use_awaitable);
+            served = res.result() == Status::ok;
+        }
+        UnitTest("a PerCore instance takes over the socket of a SharedPool one", shared_handed_off && served);
+
+        co_await per_core.Drain();
+        co_await ConnectionsClosed(per_core);
+        per_core.Stop();
+        per_core.Join();
+    }
+    std::filesystem::remove(path);
+#else
+    co_return;
+#endif
+}
+
+boost::asio::awaitable<int> Delayed(int value, std::chrono::milliseconds delay)
+{
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor, delay);
+    co_await timer.async_wait(boost::asio::use_awaitable);
+    co_return value;
+}
+
+boost::asio::awaitable<std::string> Failing()
+{
+    throw std::runtime_error("backend down");
+    co_return std::string();
+}
+
+boost::asio::awaitable<void> FanOutUnitTests(boost::asio::any_io_executor /*exec*/)
+{
+    // the slow call misses the deadline and is cancelled, the fast one and the failed one do not hold the others
+    const auto start = std::chrono::steady_clock::now();
+    const auto [fast, slow, failed] = co_await FanOut::Gather(std::chrono::milliseconds(100), Delayed(1, std::chrono::milliseconds(20)), Delayed(2, std::chrono::seconds(5)), Failing());
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    UnitTest("fan-out keeps the results in time and cancels the rest at the deadline", fast == 1 && !slow && !failed && elapsed < std::chrono::milliseconds(1000));
+
+    const auto [a, b] = co_await FanOut::Gather(std::chrono::seconds(1), Delayed(3, std::chrono::milliseconds(10)), Delayed(4, std::chrono::milliseconds(30)));
+    UnitTest("fan-out gathers every result before the deadline", a == 3 && b == 4);
+}
+
+/// <summary>
+/// Api answering the /echo routes only, registered after an Api to check the dispatch
+/// </summary>
+struct EchoApi
+{
+    boost::asio::awaitable<boost::beast::http::message_generator> HandleRequest(const Request& req, BodyStream* /*body*/) const
+    {
+        co_return ResponseBuilder(Status::ok, req.get().version(), req.get().keep_alive()).Line(HeaderLines::ContentTypeText).Body("echo");
+    }
+
+    std::optional<BodyPolicy> Policy(const Request& req) const
+    {
+        if (req.get().target().starts_with("/echo"))
+            return BodyPolicy{};
+        return std::nullopt;
+    }
+};
+
+boost::asio::awaitable<void> DispatchUnitTests(boost::asio::any_io_executor exec)
+{
+    // each request gets one response, from the first api with a route for it or the first api for its 404
+    Api api;
+    EchoApi echo;
+    const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 8083);
+    HttpServer server(exec, endpoint);
+    server.AddApi(api);
+    server.AddApi(echo);
+    server.Start();
+    co_await Listening(endpoint);
+
+    boost::beast::tcp_stream stream(exec);
+    co_await stream.async_connect(endpoint, boost::asio::use_awaitable);
+    const std::string requests =
+        "GET /echo HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+        "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+        "GET /nope HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+    co_await boost::asio::async_write(stream, boost::asio::buffer(requests), boost::asio::use_awaitable);
+
+    std::string wire;
+    stream.expires_after(std::chrono::seconds(5));
+    // read up to the close, the end of file is expected
+    co_await boost::asio::async_read(stream, boost::asio::dynamic_buffer(wire), boost::asio::as_tuple(boost::asio::use_awaitable));
+
+    std::size_t responses = 0;
+    for (auto at = wire.find("HTTP/1.1 "); at != std::string::npos; at = wire.find("HTTP/1.1 ", at + 1))
+        ++responses;
+    const auto echoed = wire.find("\r\n\r\necho");
+    const auto hello = wire.find("Hello World!");
+    const auto missing = wire.find("HTTP/1.1 404 ");
+    UnitTest("each request is answered once by the api claiming it", responses == 3 && echoed < hello && hello < missing && missing != std::string::npos);
+
+    co_await server.Drain();
+    co_await ConnectionsClosed(server);
+}
+
+/// <summary>
+/// Validator accepting the token "good" and counting how often it is asked
+/// </summary>
+struct CountingValidator
+{
+    std::shared_ptr<std::atomic<int>> calls = std::make_shared<std::atomic<int>>(0);
+
+    boost::asio::awaitable<bool> Validate(std::string_view token) const
+    {
+        ++*calls;
+        co_return token == "good";
+    }
+};
+
+boost::asio::awaitable<void> AuthUnitTests(boost::asio::any_io_executor exec)
+{
+    // each token reaches the validator once, valid or not, a cached answer allocates nothing
+    CountingValidator validator;
+    BasicTokenAuth<CountingValidator> auth(validator);
+    RequestArena arena;
+
+    const auto check = [&](std::string_view authorization) -> boost::asio::awaitable<std::tuple<bool, Status, std::string>>
+    {
+        arena.Reset();
+        Request req{ std::piecewise_construct, std::make_tuple(Allocator(&arena)), std::make_tuple(Allocator(&arena)) };
+        const std::string raw = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n" + std::string(authorization) + "\r\n";
+        boost::beast::error_code ec;
+        req.put(boost::asio::buffer(raw), ec);
+
+        Status code = Status::ok;
+        std::string err;
+        const bool success = co_await auth.HandleRequest(req, code, err);
+        co_return std::make_tuple(success, code, err);
+    };
+
+    const auto [first, first_code, first_err] = co_await check("Authorization: Bearer good\r\n");
+    const auto [second, second_code, second_err] = co_await check("Authorization: bearer good\r\n");
+    const auto [evil, evil_code, evil_err] = co_await check("Authorization: Bearer evil\r\n");
+    const auto [again, again_code, again_err] = co_await check("Authorization: Bearer evil\r\n");
+    const auto [missing, missing_code, missing_err] = co_await check("");
+    UnitTest("bearer tokens are validated once and cached, valid or not", first && second && first_err.empty() && !evil && !again && again_code == Status::unauthorized && !missing && *validator.calls == 2);
+
+    TokenCache cache(AuthPolicy{ .ttl = std::chrono::seconds(60), .negative_ttl = std::chrono::milliseconds(20) });
+    cache.Store("toto", true);
+    cache.Store("tata", false);
+    const std::string_view token = "toto";
+    const std::size_t allocations = thread_allocations;
+    const bool hit = cache.Find(token) == true;
+    const bool allocation_free = thread_allocations == allocations;
+    const bool negative = cache.Find("tata") == false;
+
+    boost::asio::steady_timer timer(exec, std::chrono::milliseconds(30));
+    co_await timer.async_wait(boost::asio::use_awaitable);
+    UnitTest("token cache hits allocate nothing and negative answers expire first", hit && allocation_free && negative && !cache.Find("tata") && cache.Find("toto") == true);
+}
+
+/// <summary>
+/// Directory served on /static/ by the apis of main, filled by StaticFilesUnitTests
+/// </summary>
+std::filesystem::path StaticRoot()
+{
+    return std::filesystem::temp_directory_path() / "coroutine-static-test";
+}
+
+boost::asio::awaitable<void> StaticFilesUnitTests(boost::asio::any_io_executor exec, const StaticFiles& files)
+{
+    const auto root = StaticRoot();
+    std::filesystem::create_directories(root);
+    std::ofstream(root / "hello.txt", std::ios::binary) << "Hello static world";
+    std::ofstream(root / "site.css", std::ios::binary) << "body { color: black; }";
+    std::ofstream(root / "site.css.gz", std::ios::binary) << "precompressed";
+    // over map_max_file: sent from the file, sendfile on plain connections and read by windows over TLS
+    std::string large(1024 * 1024 + 17, '\0');
+    for (std::size_t i = 0; i < large.size(); ++i)
+        large[i] = static_cast<char>('a' + i * 7 % 26);
+    std::ofstream(root / "large.bin", std::ios::binary) << large;
+
+    char formatted[HttpDate::Size];
+    HttpDate::Format(std::time_t(1700000000), formatted);
+    const bool dates = HttpDate::Parse("Sun, 06 Nov 1994 08:49:37 GMT") == std::time_t(784111777) && !HttpDate::Parse("Sunday, 06-Nov-94 08:49:37 GMT")
+        && HttpDate::Parse(std::string_view(formatted, sizeof(formatted))) == std::time_t(1700000000);
+    UnitTest("http dates are parsed back to the time they were formatted from", dates);
+
+    HttpClient client(exec, "127.0.0.1:8080");
+    co_await client.connect();
+    Headers headers = { {"Authorization", "Bearer toto"} };
+
+    auto res = co_await client.get<boost::beast::http::string_body>("/static/hello.txt", headers);
+    const std::string etag(res[boost::beast::http::field::etag]);
+    const std::string last_modified(res[boost::beast::http::field::last_modified]);
+    UnitTest("static file is served with its validators", res.result() == Status::ok && res.body() == "Hello static world" && !etag.empty()
+        && HttpDate::Parse(last_modified) && res[boost::beast::http::field::content_encoding].empty());
+
+    Headers conditional = headers;
+    conditional["If-None-Match"] = etag;
+    UnitTest(co_await client.get<boost::beast::http::string_body>("/static/hello.txt", conditional), Status::not_modified);
+    conditional = headers;
+    conditional["If-Modified-Since"] = last_modified;
+    UnitTest(co_await client.get<boost::beast::http::string_body>("/static/hello.txt", conditional), Status::not_modified);
+
+    Headers range = headers;
+    range["Range"] = "bytes=6-11";
+    auto partial = co_await client.get<boost::beast::http::string_body>("/static/hello.txt", range);
+    range["Range"] = "bytes=-5";
+    auto suffix = co_await client.get<boost::beast::http::string_body>("/static/hello.txt", range);
+    range["Range"] = "bytes=100-";
+    auto unsatisfiable = co_await client.get<boost::beast::http::string_body>("/static/hello.txt", range);
+    UnitTest("byte ranges are answered 206, out of the file 416", partial.result() == Status::partial_content && partial.body() == "static"
+        && partial[boost::beast::http::field::content_range] == "bytes 6-11/18" && suffix.body() == "world"
+        && unsatisfiable.result() == Status::range_not_satisfiable && unsatisfiable[boost::beast::http::field::content_range] == "bytes */18");
+
+    range["Range"] = "bytes=1048576-1048592";
+    auto large_partial = co_await client.get<boost::beast::http::string_body>("/static/large.bin", range);
+    auto large_res = co_await client.get<boost::beast::http::string_body>("/static/large.bin", headers);
+    UnitTest("large static file is sent whole from the file", large_res.result() == Status::ok && large_res.body() == large && large_partial.body() == large.substr(1048576));
+
+    Headers gzip = headers;
+    gzip["Accept-Encoding"] = "gzip, deflate";
+    auto encoded = co_await client.get<boost::beast::http::string_body>("/static/site.css", gzip);
+    auto identity = co_await client.get<boost::beast::http::string_body>("/static/site.css", headers);
+    UnitTest("precompressed sibling is sent to the clients accepting it", encoded[boost::beast::http::field::content_encoding] == "gzip" && encoded.body() == "precompressed"
+        && identity.body() == "body { color: black; }" && encoded[boost::beast::http::field::vary] == "Accept-Encoding" && encoded[boost::beast::http::field::etag] != identity[boost::beast::http::field::etag]);
+
+    UnitTest(co_await client.get<boost::beast::http::string_body>("/static/..%2F..%2Fetc%2Fpasswd", headers), Status::not_found);
+    UnitTest(co_await client.get<boost::beast::http::string_body>("/static/missing.txt", headers), Status::not_found);
+
+    // HEAD: the header of the file, no body follows it
+    {
+        boost::asio::ip::tcp::socket socket(exec);
+        co_await socket.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+        const std::string request = "HEAD /static/large.bin HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n"
+            "GET /static/hello.txt HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\nConnection: close\r\n\r\n";
+        co_await boost::asio::async_write(socket, boost::asio::buffer(request), boost::asio::use_awaitable);
+
+        boost::beast::flat_buffer buffer;
+        boost::beast::http::response_parser<boost::beast::http::string_body> head;
+        head.skip(true);
+        co_await boost::beast::http::async_read(socket, buffer, head, boost::asio::use_awaitable);
+        boost::beast::http::response<boost::beast::http::string_body> next;
+        co_await boost::beast::http::async_read(socket, buffer, next, boost::asio::use_awaitable);
+        UnitTest("HEAD on a static file sends its length only", head.get()[boost::beast::http::field::content_length] == std::to_string(large.size())
+            && head.get().body().empty() && next.body() == "Hello static world");
+    }
+
+    // same file over https: read by windows and encrypted, the plain path used sendfile
+    HttpClient https_client(exec, std::make_shared<TlsClientContext>(), "https://127.0.0.1:8443");
+    co_await https_client.connect();
+    auto tls_res = co_await https_client.get<boost::beast::http::string_body>("/static/large.bin", headers);
+    UnitTest("large static file is sent whole over https", tls_res.result() == Status::ok && tls_res.body() == large);
+
+    const auto& stats = files.GetStats();
+    UnitTest("static files count their answers", stats.not_modified == 2 && stats.partial >= 3 && stats.precompressed >= 1 && files.MappedBytes() > 0);
+}
+
+boost::asio::awaitable<void> StreamingUnitTests(boost::asio::any_io_executor exec)
+{
+    // a chunked export followed by a pipelined request on the same connection
+    {
+        boost::asio::ip::tcp::socket socket(exec);
+        co_await socket.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+        const std::string requests =
+            "GET /export?rows=5000 HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n"
+            "GET /users/5 HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n";
+        co_await boost::asio::async_write(socket, boost::asio::buffer(requests), boost::asio::use_awaitable);
+
+        boost::beast::flat_buffer buffer;
+        boost::beast::http::response<boost::beast::http::string_body> export_res;
+        co_await boost::beast::http::async_read(socket, buffer, export_res, boost::asio::use_awaitable);
+        boost::beast::http::response<boost::beast::http::string_body> next;
+        co_await boost::beast::http::async_read(socket, buffer, next, boost::asio::use_awaitable);
+
+        const std::string& rows = export_res.body();
+        std::size_t count = 0;
+        for (std::size_t at = rows.find("{\"id\":"); at != std::string::npos; at = rows.find("{\"id\":", at + 1))
+            ++count;
+        UnitTest("streamed export is chunked and complete", export_res.chunked() && !export_res.has_content_length() && count == 5000
+            && rows.starts_with("[{\"id\":0,") && rows.ends_with("{\"id\":4999,\"name\":\"user\"}]"));
+        UnitTest(next, Status::ok);
+    }
+
+    // server-sent events: the header leaves before the first event, each event when it happens
+    {
+        boost::asio::ip::tcp::socket socket(exec);
+        co_await socket.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+        const std::string request = "GET /events?count=3&interval=200 HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n";
+        const auto start = std::chrono::steady_clock::now();
+        co_await boost::asio::async_write(socket, boost::asio::buffer(request), boost::asio::use_awaitable);
+
+        boost::beast::flat_buffer buffer;
+        boost::beast::http::response_parser<boost::beast::http::string_body> events;
+        co_await boost::beast::http::async_read_header(socket, buffer, events, boost::asio::use_awaitable);
+        const auto first_byte = std::chrono::steady_clock::now() - start;
+        co_await boost::beast::http::async_read(socket, buffer, events, boost::asio::use_awaitable);
+        const auto whole = std::chrono::steady_clock::now() - start;
+
+        std::cout << "Events: first byte after " << std::chrono::duration_cast<std::chrono::milliseconds>(first_byte).count() << "ms, stream of "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(whole).count() << "ms\n";
+        UnitTest("event stream header is sent before its events", events.get()[boost::beast::http::field::content_type] == "text/event-stream"
+            && first_byte < std::chrono::milliseconds(150) && whole >= std::chrono::milliseconds(400));
+        UnitTest("events are framed as server-sent events", events.get().body() ==
+            "event: tick\nid: 0\ndata: {\"tick\":0}\n\nevent: tick\nid: 1\ndata: {\"tick\":1}\n\nevent: tick\nid: 2\ndata: {\"tick\":2}\n\n");
+    }
+
+    // HTTP/1.0 has no chunked encoding: the body ends with the connection
+    {
+        boost::asio::ip::tcp::socket socket(exec);
+        co_await socket.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+        const std::string request = "GET /export?rows=2 HTTP/1.0\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n";
+        co_await boost::asio::async_write(socket, boost::asio::buffer(request), boost::asio::use_awaitable);
+
+        std::string wire;
+        auto [ec, bytes] = co_await boost::asio::async_read(socket, boost::asio::dynamic_buffer(wire), boost::asio::as_tuple(boost::asio::use_awaitable));
+        UnitTest("HTTP/1.0 stream is sent unframed up to the close", ec == boost::asio::error::eof && wire.find("chunked") == std::string::npos
+            && wire.ends_with("\r\n\r\n[{\"id\":0,\"name\":\"user\"},{\"id\":1,\"name\":\"user\"}]"));
+    }
+
+    // query values: a value that is not a number is refused, one out of bounds is brought within them
+    {
+        boost::asio::ip::tcp::socket socket(exec);
+        co_await socket.async_connect({ boost::asio::ip::address::from_string("127.0.0.1"), 8080 }, boost::asio::use_awaitable);
+        const std::string requests =
+            "GET /export?rows=ten HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n"
+            "GET /events?count=2&interval=0 HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer toto\r\n\r\n";
+        const auto start = std::chrono::steady_clock::now();
+        co_await boost::asio::async_write(socket, boost::asio::buffer(requests), boost::asio::use_awaitable);
+
+        boost::beast::flat_buffer buffer;
+        boost::beast::http::response<boost::beast::http::string_body> refused;
+        co_await boost::beast::http::async_read(socket, buffer, refused, boost::asio::use_awaitable);
+        boost::beast::http::response<boost::beast::http::string_body> events;
+        co_await boost::beast::http::async_read(socket, buffer, events, boost::asio::use_awaitable);
+        const auto whole = std::chrono::steady_clock::now() - start;
+
+        UnitTest(refused, Status::bad_request);
+        UnitTest("event interval is raised to its minimum", events.result() == Status::ok && events.body().find("id: 1\n") != std::string::npos
+            && whole >= Api::MinEventInterval);
+    }
+}
+
+boost::asio::awaitable<void> TlsUnitTests(boost::asio::any_io_executor exec)
+{
+    // https server started by main on 8443, the second connection must resume the session ticket received on the first one
+    auto tls = std::make_shared<TlsClientContext>();
+    Headers headers = { {"Authorization", "Bearer toto"} };
+    std::chrono::microseconds elapsed[2];
+    for (auto& handshake : elapsed)
+    {
+        HttpClient client(exec, tls, "https://127.0.0.1:8443");
+        const auto start = std::chrono::steady_clock::now();
+        co_await client.connect();
+        handshake = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        UnitTest(co_await client.get<boost::beast::http::string_body>("/users/3", headers), Status::ok);
+    }
+
+    std::cout << "TLS: full handshake " << elapsed[0].count() << "us, resumed handshake " << elapsed[1].count() << "us\n";
+    UnitTest("second https connection resumes the cached session", tls->stats().handshakes == 2 && tls->stats().resumed == 1);
+}
+
+/// <summary>
+/// Run every test, online adds the ones reaching the internet, the number of failed tests is returned
+/// </summary>
+boost::asio::awaitable<int> DoUnitTests(boost::asio::any_io_executor exec, const HttpServer& guarded_server, const StaticFiles& files, bool online)
+{
+    ArenaUnitTests();
+    LogUnitTests();
+    UriUnitTests();
+    QueryUnitTests();
+    CacheUnitTests();
+    ResponseBuilderUnitTests();
+    CompressionUnitTests();
+    RateLimitUnitTests();
+    MetricsUnitTests();
+
+    // let http server start, without blocking a thread of the pool serving it
+    boost::asio::steady_timer start(exec, std::chrono::seconds(1));
+    co_await start.async_wait(boost::asio::use_awaitable);
 
 	// -- Expecting full success
 	try
 	{
-		// let http server start
-		std::this_thread::sleep_for(std::chrono::seconds(2));
 		HttpClient client(exec, "127.0.0.1:8080");
 		co_await client.connect();
 
@@ -46,6 +1386,36 @@ boost::asio::awaitable<void> DoUnitTests(boost::asio::any_io_executor exec)
 		std::cout << "Result: " << res << "\n";
 		UnitTest(res, Status::ok);
 
+		// routing is done on the path only, the query string is ignored
+		auto q_res = co_await client.get<boost::beast::http::string_body>("/?x=1", headers);
+		UnitTest(q_res, Status::ok);
+
+		auto p_res = co_await client.get<boost::beast::http::string_body>("/users/42", headers);
+		std::cout << "Result: " << p_res << "\n";
+		UnitTest(p_res, Status::ok);
+
+		// GET / is cached: served with an ETag, a matching If-None-Match is answered 304
+		auto c_res = co_await client.get<boost::beast::http::string_body>("/", headers);
+		const std::string etag(c_res[boost::beast::http::field::etag]);
+		Headers conditional = headers;
+		conditional["If-None-Match"] = etag;
+		auto m_res = co_await client.get<boost::beast::http::string_body>("/", conditional);
+		UnitTest(m_res, Status::not_modified);
+		UnitTest("cached route is served with its ETag", !etag.empty() && c_res.body() == "\"Hello World!\"");
+
+		auto s_res = co_await client.get<boost::beast::http::string_body>("/search/all%20users?utm=x&q=caf%C3%A9+bar&limit=5", headers);
+		UnitTest("query and path parameters are decoded", s_res.body() == "{\"scope\":\"all users\",\"q\":\"caf\xC3\xA9 bar\",\"limit\":\"5\"}");
+
+		// two backends of 50 and 80ms gathered concurrently
+		const auto aggregate_start = std::chrono::steady_clock::now();
+		auto g_res = co_await client.get<boost::beast::http::string_body>("/aggregate", headers);
+		const auto aggregate = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - aggregate_start);
+		std::cout << "Aggregate: " << aggregate.count() << "ms\n";
+		UnitTest("aggregation route pays its slowest backend, not the sum", g_res.body() == "{\"users\":\"users\",\"orders\":\"orders\"}" && aggregate < std::chrono::milliseconds(130));
+
+		auto n_res = co_await client.get<boost::beast::http::string_body>("/users", headers);
+		UnitTest(n_res, Status::not_found);
+
 		auto r_res = co_await client.post<boost::beast::http::string_body>("/toto", body,
 			"application/json", headers);
 		std::cout << "Result: " << r_res << "\n";
@@ -59,60 +1429,171 @@ boost::asio::awaitable<void> DoUnitTests(boost::asio::any_io_executor exec)
 		UnitTest(t_res, Status::unauthorized);
 		std::cout << "\n";
 
-		HttpClient https_client(exec, "https://www.google.com");
-		co_await https_client.connect();
-		auto e_res = co_await https_client.get<boost::beast::http::string_body>("/");
-		std::cout << "Result: " << e_res << "\n";
-		UnitTest(e_res, Status::ok);
-		std::cout << "\n";
+		// the requests above are counted per route and status, along with the connection gauges
+		auto metrics_res = co_await client.get<boost::beast::http::string_body>("/metrics", { {"Authorization", "Bearer toto"} });
+		const std::string& scraped = metrics_res.body();
+		UnitTest("metrics endpoint counts the requests per route and status", metrics_res.result() == Status::ok
+			&& scraped.find("http_requests_total{method=\"GET\",route=\"/users/{id}\",status=\"200\"} ") != std::string::npos
+			&& scraped.find("http_requests_total{method=\"POST\",route=\"/toto\",status=\"401\"} ") != std::string::npos
+			&& scraped.find("http_phase_duration_seconds_count{phase=\"read\"} ") != std::string::npos
+			&& scraped.find("http_connections_open{server=\"127.0.0.1:8080\"} ") != std::string::npos);
+
+		co_await PipeliningUnitTests(exec);
+		co_await KeepAliveAllocationUnitTests(exec);
+		co_await PoolUnitTests(exec);
+		co_await BodyUnitTests(exec);
+		co_await TlsUnitTests(exec);
+		co_await GovernorUnitTests(exec, guarded_server);
+		co_await HandoffUnitTests(exec);
+		co_await FanOutUnitTests(exec);
+		co_await DispatchUnitTests(exec);
+		co_await AuthUnitTests(exec);
+		co_await StaticFilesUnitTests(exec, files);
+		co_await StreamingUnitTests(exec);
+
+		if (online)
+		{
+			HttpClient https_client(exec, "https://www.google.com");
+			co_await https_client.connect();
+			auto e_res = co_await https_client.get<boost::beast::http::string_body>("/");
+			std::cout << "Result: " << e_res << "\n";
+			UnitTest(e_res, Status::ok);
+			std::cout << "\n";
+		}
 	}
 	catch (std::exception& e)
 	{
 		std::cerr << e.what() << "\n";
+		count++;
 	}
 
 	// -- Expecting failed
-	try
+	if (online)
 	{
-		HttpClient https_client_2(exec, "https://www.invalid-url-that-doesnt-exists.com");
-		co_await https_client_2.connect();
-		count++;
-	}
-	catch (std::exception& e)
-	{
-		std::cerr << e.what() << std::endl;
+		try
+		{
+			HttpClient https_client_2(exec, "https://www.invalid-url-that-doesnt-exists.com");
+			co_await https_client_2.connect();
+			count++;
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << e.what() << std::endl;
+		}
 	}
     
 	std::cout << "\n\tResult: " << count << " tests => " << success << " SUCCESS " << count - success << " FAILED\n\n";
 
-	co_return;
+	co_return count - success;
 }
 
-int main()
+/// <summary>
+/// Stop accepting on every server, let the requests in flight be answered, then stop the process
+/// </summary>
+boost::asio::awaitable<void> DrainAndStop(boost::asio::thread_pool& pool, std::vector<HttpServer*> servers)
 {
+    for (auto* server : servers)
+        server->BeginDrain();
+    for (auto* server : servers)
+        co_await server->Drain();
+    for (auto* server : servers)
+        server->Stop();
+    pool.stop();
+}
+
+int main(int argc, char** argv)
+{
+    if (const auto error = IoBackend::Unavailable())
+    {
+        std::cerr << *error << "\n";
+        return 1;
+    }
+
     boost::asio::thread_pool pool{ 8 };
+    int failed = -1;
+    bool test = false;
 
     try
     {
-        // install sighandlers
-        boost::asio::signal_set signals(pool, SIGINT, SIGTERM);
-        signals.async_wait(boost::bind(&boost::asio::thread_pool::stop, &pool));
+        // --per-core: one SO_REUSEPORT acceptor and one pinned io_context per core
+        // --handoff <path>: take the listening sockets over from the running instance, and hand them to the next one
+        // --test: stop once the tests ran, the exit code tells whether they all passed (ctest)
+        // --online: also run the tests reaching the internet
+        ServerConfig config;
+        bool online = false;
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string_view arg = argv[i];
+            if (arg == "--per-core")
+                config.mode = ServerMode::PerCore;
+            else if (arg == "--handoff" && i + 1 < argc)
+                config.handoff_path = argv[++i];
+            else if (arg == "--test")
+                test = true;
+            else if (arg == "--online")
+                online = true;
+        }
 
         boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 8080);
-        HttpServer server(pool.get_executor(), endpoint);
-        Api api;
+        HttpServer server(pool.get_executor(), endpoint, config);
 
-        server.AddApi(api);
+        // same apis over https, with a certificate generated for the tests
+        const auto [cert, key] = MakeSelfSignedCertificate();
+        ServerConfig tls_config = config;
+        tls_config.tls = TlsConfig{ .certificate_chain = cert, .private_key = key };
+        if (!tls_config.handoff_path.empty())
+            tls_config.handoff_path += ".tls";
+        HttpServer tls_server(pool.get_executor(), { endpoint.address(), 8443 }, tls_config);
+
+        // short deadlines and a tiny connection cap for the governor tests, under the default accept_depth
+        ServerConfig guarded_config;
+        guarded_config.limits = ConnectionLimits{
+            .max_connections = 2,
+            .header_timeout = std::chrono::milliseconds(500),
+            .idle_timeout = std::chrono::milliseconds(500),
+            .body_timeout = std::chrono::milliseconds(2000),
+            .write_timeout = std::chrono::milliseconds(2000),
+            .min_rate = 1000,
+            .min_rate_grace = std::chrono::milliseconds(300)
+        };
+        HttpServer guarded_server(pool.get_executor(), { endpoint.address(), 8081 }, guarded_config);
 
-        auto log = LoggingMiddleWare();
-        auto auth = TokenAuthMiddleWare();
-        api.AddMiddleWare(log);
-        api.AddMiddleWare(auth);
+        // install sighandlers: a signal, or the next instance taking the listening sockets over, drains then stops
+        const auto shutdown = [&pool, &server, &tls_server, &guarded_server]()
+        {
+            boost::asio::co_spawn(pool, DrainAndStop(pool, { &server, &tls_server, &guarded_server }), boost::asio::detached);
+        };
+        boost::asio::signal_set signals(pool, SIGINT, SIGTERM);
+        signals.async_wait([shutdown](const boost::system::error_code&, int)
+        {
+            shutdown();
+        });
+        server.OnHandoff(shutdown);
+        tls_server.OnHandoff(shutdown);
+        // middlewares composed at compile time, Api (BasicApi<MiddleWareList>) keeps the runtime AddMiddleWare path
+        BasicApi<Pipeline<LoggingMiddleWare, RateLimitMiddleWare, TokenAuthMiddleWare>> api;
+        api.EnableCompression();
+        api.EnableMetrics();
+        api.EnableStaticFiles(StaticRoot().string());
+
+        server.AddApi(api);
+        tls_server.AddApi(api);
+        guarded_server.AddApi(api);
 
-        boost::asio::co_spawn(pool, server.DoAccept(), boost::asio::detached);
-        boost::asio::co_spawn(pool, DoUnitTests(pool.get_executor()), boost::asio::detached);
+        server.Start();
+        tls_server.Start();
+        guarded_server.Start();
+        boost::asio::co_spawn(pool, DoUnitTests(pool.get_executor(), guarded_server, *api.Files(), online), [&failed, test, shutdown](std::exception_ptr error, int failures)
+        {
+            failed = error ? 1 : failures;
+            if (test)
+                shutdown();
+        });
 
         pool.join();
+        server.Join();
+        tls_server.Join();
+        guarded_server.Join();
     }
     catch (std::exception& e)
     {
@@ -120,5 +1601,5 @@ int main()
         pool.join();
     }
 
-    return 0;
+    return test && failed != 0 ? 1 : 0;
 }
\ No newline at end of file
@@ -5,13 +5,196 @@
 #include <boost/beast.hpp>
 #include <boost/beast/http/message.hpp>
 
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
+#include <utility>
 #include <vector>
 
-using Request = boost::beast::http::request_parser<boost::beast::http::vector_body<char>>;
-using Parameters = std::map<std::string, std::string>;
+#include "Uri.h"
+
+// request bodies and fields are allocated through a memory_resource (see RequestArena)
+using Allocator = std::pmr::polymorphic_allocator<char>;
+using Body = std::pmr::vector<char>;
+
+/// <summary>
+/// Part of a file sent by the server as the body of a response whose header was built alone
+/// (ResponseBuilder::Header): sendfile on plain connections, read in chunks through TLS
+/// The file is opened for the request, its position is never shared with another response
+/// </summary>
+struct FileRange
+{
+    std::shared_ptr<boost::beast::file> file;
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+};
+
+class ResponseStream;
+
+/// <summary>
+/// Body of a streamed response, run by the server once the header is sent: it writes the body through the
+/// ResponseStream as it is produced (see ResponseStream::Start)
+/// </summary>
+using StreamProducer = std::function<boost::asio::awaitable<void>(ResponseStream&)>;
+
+template <typename Handler>
+class Router;
+
+/// <summary>
+/// Path parameters captured while matching a route
+/// Names are views into the frozen router, values are views into the request target, nothing is allocated
+/// </summary>
+class RouteParams
+{
+public:
+    static constexpr std::size_t MaxParams = 8;
+
+    /// <summary>
+    /// Return the value captured for name, empty if the route has no such parameter
+    /// </summary>
+    std::string_view Get(std::string_view name) const
+    {
+        for (std::size_t i = 0; i < _size; ++i)
+        {
+            if (_params[i].first == name)
+                return _params[i].second;
+        }
+        return {};
+    }
+
+    /// <summary>
+    /// Percent-decoded value captured for name, copied into buffer only when it holds an escape ('+' is kept)
+    /// </summary>
+    template <typename String>
+    std::string_view Decode(std::string_view name, String& buffer) const
+    {
+        return uri::decode(Get(name), buffer, false);
+    }
+
+    std::size_t Size() const { return _size; }
+    const std::pair<std::string_view, std::string_view>& operator[](std::size_t i) const { return _params[i]; }
+
+private:
+    template <typename Handler>
+    friend class Router;
+
+    std::array<std::pair<std::string_view, std::string_view>, MaxParams> _params{};
+    std::size_t _size = 0;
+};
+
+/// <summary>
+/// Per request state shared by the server, the middlewares and the api, outside of the message itself
+/// </summary>
+struct RequestContext
+{
+    // address of the client, a view on the connection valid while the request is handled
+    std::string_view peer;
+
+    // set by a middleware refusing the request with 429 (seconds), sent back as Retry-After
+    std::uint32_t retry_after = 0;
+
+    // body of the response sent from a file after its header, set by the route answering it (StaticFiles)
+    FileRange file;
+
+    // body of the response produced after its header was sent, set by the route answering it (ResponseStream)
+    StreamProducer stream;
+
+    // route matched by an api giving its body policy (BasicApi::Policy), reused to handle the request instead of
+    // matching the target again; router tells which api matched it, route is null when none did
+    const void* router = nullptr;
+    const void* route = nullptr;
+    RouteParams params;
+};
+
+/// <summary>
+/// Request body, buffered in a Body by default
+/// A streaming route sets streaming and hands out a window: incoming bytes are then written in the window instead
+/// of being appended, and the parser stops when it is full (see BodyStream)
+/// </summary>
+struct RequestBody
+{
+    struct value_type : Body
+    {
+        using Body::Body;
+
+        bool streaming = false;
+        char* window = nullptr;
+        std::size_t window_size = 0;
+        std::size_t window_used = 0;
+
+        // carried by the body as the one part of the parser the server owns, mutable as the request is const
+        // once handed to the api
+        mutable RequestContext context;
+    };
+
+    static std::uint64_t size(const value_type& body)
+    {
+        return body.size();
+    }
+
+    class reader
+    {
+    public:
+        template <bool isRequest, class Fields>
+        explicit reader(boost::beast::http::header<isRequest, Fields>&, value_type& body)
+            : _body{ body }
+        {
+        }
+
+        void init(const boost::optional<std::uint64_t>& length, boost::beast::error_code& ec)
+        {
+            if (length && !_body.streaming)
+            {
+                if (*length > _body.max_size())
+                {
+                    ec = boost::beast::http::error::buffer_overflow;
+                    return;
+                }
+                _body.reserve(static_cast<std::size_t>(*length));
+            }
+            ec = {};
+        }
+
+        template <class ConstBufferSequence>
+        std::size_t put(const ConstBufferSequence& buffers, boost::beast::error_code& ec)
+        {
+            const std::size_t size = boost::asio::buffer_size(buffers);
+            if (_body.streaming)
+            {
+                const std::size_t n = boost::asio::buffer_copy(boost::asio::buffer(_body.window + _body.window_used, _body.window_size - _body.window_used), buffers);
+                _body.window_used += n;
+                ec = n == size ? boost::beast::error_code{} : boost::beast::http::error::need_buffer;
+                return n;
+            }
+
+            const std::size_t offset = _body.size();
+            _body.resize(offset + size);
+            ec = {};
+            return boost::asio::buffer_copy(boost::asio::buffer(_body.data() + offset, size), buffers);
+        }
+
+        void finish(boost::beast::error_code& ec)
+        {
+            ec = {};
+        }
+
+    private:
+        value_type& _body;
+    };
+};
+
+using Request = boost::beast::http::request_parser<RequestBody, Allocator>;
+
+inline RequestContext& Context(const Request& req)
+{
+    return req.get().body().context;
+}
+
 using Headers = std::map<std::string, std::string>;
 using Verb = boost::beast::http::verb;
 using Status = boost::beast::http::status;
-using Body = std::vector<char>;
-using Response = boost::beast::http::message_generator;
\ No newline at end of file
+using Response = boost::beast::http::message_generator;
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/experimental/awaitable_operators.hpp>
+#include <boost/asio/experimental/parallel_group.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <chrono>
+#include <exception>
+#include <optional>
+#include <tuple>
+#include <utility>
+
+#include "Log.h"
+
+/// <summary>
+/// Scatter/gather of independent calls, e.g. the backend requests of an aggregation route
+/// The calls run concurrently so the route pays the slowest of them instead of their sum, all of them under a
+/// single deadline: when it expires the calls still running are cancelled
+/// A call that throws or misses the deadline leaves its optional empty, the results of the others are kept
+/// </summary>
+class FanOut
+{
+public:
+    template <typename... T>
+    static boost::asio::awaitable<std::tuple<std::optional<T>...>> Gather(std::chrono::steady_clock::duration deadline, boost::asio::awaitable<T>... calls)
+    {
+        using namespace boost::asio::experimental::awaitable_operators;
+
+        std::tuple<std::optional<T>...> results;
+        boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor, deadline);
+
+        // whichever ends first cancels the other, the group only returns once the cancelled calls have unwound so
+        // none of them writes its result after this frame is gone
+        co_await (All(results, std::index_sequence_for<T...>{}, std::move(calls)...) || timer.async_wait(boost::asio::use_awaitable));
+        co_return results;
+    }
+
+private:
+    template <typename... T, std::size_t... I>
+    static boost::asio::awaitable<void> All(std::tuple<std::optional<T>...>& results, std::index_sequence<I...>, boost::asio::awaitable<T>... calls)
+    {
+        const auto exec = co_await boost::asio::this_coro::executor;
+        co_await boost::asio::experimental::make_parallel_group(boost::asio::co_spawn(exec, Into(std::move(calls), std::get<I>(results)), boost::asio::deferred)...)
+            .async_wait(boost::asio::experimental::wait_for_all(), boost::asio::use_awaitable);
+    }
+
+    template <typename T>
+    static boost::asio::awaitable<void> Into(boost::asio::awaitable<T> call, std::optional<T>& result)
+    {
+        try
+        {
+            result = co_await std::move(call);
+        }
+        catch (const boost::system::system_error& e)
+        {
+            if (e.code() != boost::asio::error::operation_aborted)
+                Log::Warn("Fan-out call failed: {}", e.what());
+        }
+        catch (const std::exception& e)
+        {
+            Log::Warn("Fan-out call failed: {}", e.what());
+        }
+    }
+};
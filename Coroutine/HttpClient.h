@@ -1,3 +1,5 @@
+#pragma once
+
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/thread_pool.hpp>
@@ -5,12 +7,13 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <chrono>
-#include <iomanip>
 #include <iostream>
-#include <sstream>
 #include <stdexcept>
 
 #include "Define.h"
+#include "HttpDate.h"
+#include "Log.h"
+#include "TlsClientContext.h"
 #include "Uri.h"
 
 enum Connection
@@ -25,23 +28,35 @@ public:
 
 	HttpClient(boost::asio::any_io_executor exec, boost::asio::ssl::context& ssl_context, const std::string_view url)
 		: _resolver{ exec }
-		, _ssl_context{ std::move(ssl_context) }
-		, _ssl_stream{ exec, _ssl_context }
-		, _url{ url }
+		, _tls{ std::make_shared<TlsClientContext>(std::move(ssl_context)) }
+		, _ssl_stream{ exec, _tls->context() }
+		, _url{ url, true }
+	{
+	}
+
+	HttpClient(boost::asio::any_io_executor exec, std::shared_ptr<TlsClientContext> tls, const std::string_view url)
+		: _resolver{ exec }
+		, _tls{ std::move(tls) }
+		, _ssl_stream{ exec, _tls->context() }
+		, _url{ url, true }
 	{
 	}
 
 	explicit HttpClient(boost::asio::any_io_executor exec, const std::string_view url)
 		: _resolver{ exec }
-		, _ssl_context{ boost::asio::ssl::context{boost::asio::ssl::context::tlsv13_client} }
-		, _ssl_stream{ exec, _ssl_context }
-		, _url{ url }
+		, _tls{ TlsClientContext::shared() }
+		, _ssl_stream{ exec, _tls->context() }
+		, _url{ url, true }
 	{
 	}
 
 	~HttpClient()
 	{
-		std::cout << "HttpClient disconnect and destroyed\n";
+		Log::Debug("HttpClient disconnect and destroyed: {}", _url.str());
+
+		// no close_notify is sent, flag the TLS connection as cleanly closed or OpenSSL drops its session from the resumption cache
+		if (SSL_is_init_finished(_ssl_stream.native_handle()))
+			SSL_set_shutdown(_ssl_stream.native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
 
 		boost::system::error_code ec;
 		_ssl_stream.lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
@@ -71,6 +86,37 @@ public:
 		co_return co_await request<T>(target, Verb::head, {}, "", headers, timeout);
 	}
 
+	/// <summary>
+	/// The connection can serve another request: connected, keep-alive and no error so far
+	/// </summary>
+	bool reusable() const
+	{
+		return _reusable && _ssl_stream.next_layer().socket().is_open();
+	}
+
+	/// <summary>
+	/// Check an idle connection before reusing it
+	/// Nothing may be readable on an idle keep-alive connection, pending bytes or EOF mean the server closed it
+	/// </summary>
+	bool is_alive()
+	{
+		auto& socket = _ssl_stream.next_layer().socket();
+		if (!reusable())
+			return false;
+
+		boost::system::error_code ec, ignored;
+		char byte;
+		socket.non_blocking(true, ignored);
+		socket.receive(boost::asio::buffer(&byte, 1), boost::asio::socket_base::message_peek, ec);
+		socket.non_blocking(false, ignored);
+		return ec == boost::asio::error::would_block;
+	}
+
+	const uri& url() const
+	{
+		return _url;
+	}
+
 	boost::asio::awaitable<void> connect(const Connection& con_type = Connection::KEEP_ALIVE, const std::chrono::seconds& timeout = std::chrono::seconds(30))
 	{
 		const auto protocol = _url.scheme().empty() ? "http" : _url.scheme();
@@ -91,22 +137,25 @@ public:
 
 		if (protocol == "https")
 		{
-			// Set SNI Hostname (many hosts need this to handshake successfully)
-			if (!SSL_set_tlsext_host_name(_ssl_stream.native_handle(), _url.host().data()))
+			// Set SNI Hostname (many hosts need this to handshake successfully) and offer the cached session
+			if (!_tls->prepare(_ssl_stream.native_handle(), _url.host()))
 			{
 				ec = boost::beast::error_code{ static_cast<int>(::ERR_get_error()), boost::asio::error::get_ssl_category() };
-				std::cerr << ec.message() << "\n";
+				Log::Error("SNI setup failed for {}: {}", _url.host(), ec.message());
 				throw std::runtime_error(ec.message());
 			}
 
 			_ssl_stream.next_layer().socket().open(boost::asio::ip::tcp::v4());
 			co_await _ssl_stream.next_layer().async_connect(results, boost::asio::use_awaitable);
 			co_await _ssl_stream.async_handshake(boost::asio::ssl::stream_base::client, boost::asio::use_awaitable);
+			_tls->handshake_done(_ssl_stream.native_handle());
 		}
 		else
 		{
 			co_await _ssl_stream.next_layer().async_connect(results, boost::asio::use_awaitable);
 		}
+
+		_reusable = con_type == Connection::KEEP_ALIVE;
 	}
 
 private:
@@ -137,7 +186,8 @@ private:
 				}
 			}
 
-			std::cout << "Send request to: " << _url.str() << " " << target_ << "\n" << req;
+			Log::Info("Send request to: {} {} {}", _url.str(), req.method_string(), target_);
+			_ssl_stream.next_layer().expires_after(timeout);
 			if (_url.scheme() == "https")
 				co_await boost::beast::http::async_write(_ssl_stream, req, boost::asio::use_awaitable);
 			else
@@ -150,11 +200,14 @@ private:
 			else
 				co_await boost::beast::http::async_read(_ssl_stream.next_layer(), buffer, res, boost::asio::use_awaitable);
 
+			if (!res.keep_alive())
+				_reusable = false;
 			co_return res;
 		}
 		catch (const std::exception& e)
 		{
-			std::cerr << "Error: " << e.what() << std::endl;
+			_reusable = false;
+			Log::Error("Request to {} {} failed: {}", _url.str(), target_, e.what());
 			co_return boost::beast::http::response<T>(Status::internal_server_error, 11);
 		}
 	}
@@ -166,16 +219,16 @@ private:
 
 	static std::string to_http_date(const std::chrono::seconds& seconds)
 	{
-		std::time_t time = std::chrono::system_clock::to_time_t(seconds_to_time_point(seconds));
-		std::stringstream ss;
-		ss << std::put_time(std::gmtime(&time), "%a, %d %b %Y %H:%M:%S GMT");
-		return ss.str();
+		std::string date(HttpDate::Size, '\0');
+		HttpDate::Format(std::chrono::system_clock::to_time_t(seconds_to_time_point(seconds)), date.data());
+		return date;
 	}
 
 private:
 	boost::asio::ip::tcp::resolver _resolver;
-	boost::asio::ssl::context _ssl_context{ boost::asio::ssl::context::sslv23_client };
+	std::shared_ptr<TlsClientContext> _tls;
 	boost::asio::ssl::stream<boost::beast::tcp_stream> _ssl_stream;
 	const uri _url;
 	Connection _keep_alive;
+	bool _reusable = false;
 };
\ No newline at end of file
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "HttpClient.h"
+
+/// <summary>
+/// Define the HttpClientPool limits
+/// </summary>
+struct PoolConfig
+{
+	// connections per scheme/host/port, leased and idle together
+	std::size_t max_per_host = 16;
+
+	// an idle connection older than this is closed by the evictor and never reused
+	std::chrono::seconds idle_timeout{ 30 };
+
+	// how often the evictor runs
+	std::chrono::seconds eviction_interval{ 5 };
+};
+
+/// <summary>
+/// Keep-alive HttpClient connections shared by scheme/host/port
+/// acquire() hands out an idle connection when one is still alive, connects a new one while the host is under
+/// its limit, or waits for a connection to be released
+/// </summary>
+class HttpClientPool
+{
+	struct Host;
+	struct Waiter;
+
+public:
+	struct Stats
+	{
+		std::atomic<std::size_t> created = 0;
+		std::atomic<std::size_t> reused = 0;
+		std::atomic<std::size_t> stale = 0;
+		std::atomic<std::size_t> evicted = 0;
+		std::atomic<std::size_t> waited = 0;
+	};
+
+	/// <summary>
+	/// A connection leased from the pool, given back when the lease is destroyed
+	/// A connection that failed or got a Connection: close is dropped instead of being kept idle
+	/// </summary>
+	class Lease
+	{
+	public:
+		Lease(Lease&& other) noexcept
+			: _pool{ std::exchange(other._pool, nullptr) }
+			, _host{ other._host }
+			, _client{ std::move(other._client) }
+		{
+		}
+
+		Lease& operator=(Lease&&) = delete;
+
+		~Lease()
+		{
+			if (_pool)
+				_pool->release(*_host, std::move(_client));
+		}
+
+		HttpClient* operator->() const { return _client.get(); }
+		HttpClient& operator*() const { return *_client; }
+
+	private:
+		friend class HttpClientPool;
+
+		Lease(HttpClientPool* pool, Host* host, std::unique_ptr<HttpClient> client)
+			: _pool{ pool }
+			, _host{ host }
+			, _client{ std::move(client) }
+		{
+		}
+
+		HttpClientPool* _pool;
+		Host* _host;
+		std::unique_ptr<HttpClient> _client;
+	};
+
+	explicit HttpClientPool(boost::asio::any_io_executor exec, PoolConfig config = {})
+		: _exec{ exec }
+		, _strand{ boost::asio::make_strand(exec) }
+		, _evict_timer{ _strand }
+		, _config{ config }
+	{
+	}
+
+	/// <summary>
+	/// Spawn the idle connection evictor
+	/// </summary>
+	void start()
+	{
+		boost::asio::co_spawn(_strand, evict(), boost::asio::detached);
+	}
+
+	/// <summary>
+	/// Stop the evictor, leases still alive keep working
+	/// </summary>
+	void stop()
+	{
+		boost::asio::post(_strand, [this]()
+		{
+			_stopped = true;
+			_evict_timer.cancel();
+		});
+	}
+
+	/// <summary>
+	/// Lease a connected client for url (scheme://host:port, scheme defaults to http)
+	/// </summary>
+	boost::asio::awaitable<Lease> acquire(const std::string_view url, const std::chrono::seconds& timeout = std::chrono::seconds(30))
+	{
+		const uri parsed(url);
+		std::string key = std::string(parsed.scheme().empty() ? "http" : parsed.scheme()) + "://" + std::string(parsed.host()) + ":" + std::to_string(parsed.port());
+
+		std::unique_ptr<HttpClient> client;
+		std::vector<std::unique_ptr<HttpClient>> stale;
+		std::shared_ptr<Waiter> waiter;
+		Host* host;
+		{
+			std::lock_guard lock(_mutex);
+			auto& slot = _hosts[key];
+			if (!slot)
+				slot = std::make_unique<Host>();
+			host = slot.get();
+
+			// most recently used first, it is the least likely to have been closed by the server
+			while (!host->idle.empty() && !client)
+			{
+				auto candidate = std::move(host->idle.back().client);
+				host->idle.pop_back();
+				if (candidate->is_alive())
+					client = std::move(candidate);
+				else
+					stale.push_back(std::move(candidate));
+			}
+			_stats.stale += stale.size();
+
+			if (client)
+			{
+				++host->leased;
+				++_stats.reused;
+				co_return Lease(this, host, std::move(client));
+			}
+
+			if (host->leased < _config.max_per_host)
+			{
+				++host->leased;
+			}
+			else
+			{
+				waiter = std::make_shared<Waiter>(_exec);
+				waiter->timer.expires_after(timeout);
+				host->waiters.push_back(waiter);
+				++_stats.waited;
+			}
+		}
+
+		if (waiter)
+		{
+			// the timer only lives on the waiter strand: release() sets granted then cancels it there
+			co_await boost::asio::co_spawn(waiter->strand, wait(waiter), boost::asio::use_awaitable);
+
+			std::lock_guard lock(_mutex);
+			if (!waiter->granted)
+			{
+				std::erase(host->waiters, waiter);
+				throw std::runtime_error("HttpClientPool: timeout waiting for a connection to " + key);
+			}
+			client = std::move(waiter->client);
+		}
+
+		// a waiter granted without a client got the slot of a dropped connection
+		if (!client)
+		{
+			try
+			{
+				client = std::make_unique<HttpClient>(_exec, url);
+				co_await client->connect(Connection::KEEP_ALIVE, timeout);
+				++_stats.created;
+			}
+			catch (...)
+			{
+				release(*host, nullptr);
+				throw;
+			}
+		}
+
+		co_return Lease(this, host, std::move(client));
+	}
+
+	const Stats& stats() const
+	{
+		return _stats;
+	}
+
+private:
+	struct Idle
+	{
+		std::unique_ptr<HttpClient> client;
+		std::chrono::steady_clock::time_point since;
+	};
+
+	struct Waiter
+	{
+		explicit Waiter(boost::asio::any_io_executor exec)
+			: strand{ boost::asio::make_strand(exec) }
+			, timer{ strand }
+		{
+		}
+
+		boost::asio::strand<boost::asio::any_io_executor> strand;
+		boost::asio::steady_timer timer;
+		std::atomic<bool> granted = false;
+		std::unique_ptr<HttpClient> client;
+	};
+
+	struct Host
+	{
+		std::size_t leased = 0;
+		std::vector<Idle> idle;
+		std::deque<std::shared_ptr<Waiter>> waiters;
+	};
+
+	static boost::asio::awaitable<void> wait(std::shared_ptr<Waiter> waiter)
+	{
+		if (!waiter->granted)
+			co_await waiter->timer.async_wait(boost::asio::as_tuple(boost::asio::use_awaitable));
+	}
+
+	void release(Host& host, std::unique_ptr<HttpClient> client)
+	{
+		std::unique_ptr<HttpClient> dropped;
+		std::lock_guard lock(_mutex);
+
+		if (client && !client->reusable())
+			dropped = std::move(client);
+
+		// hand the connection (or its slot) straight to the oldest waiter, the lease count does not change
+		if (!host.waiters.empty())
+		{
+			auto waiter = std::move(host.waiters.front());
+			host.waiters.pop_front();
+
+			waiter->client = std::move(client);
+			waiter->granted = true;
+			boost::asio::post(waiter->strand, [waiter]() { waiter->timer.cancel(); });
+			return;
+		}
+
+		--host.leased;
+		if (client)
+			host.idle.push_back(Idle{ std::move(client), std::chrono::steady_clock::now() });
+	}
+
+	boost::asio::awaitable<void> evict()
+	{
+		while (!_stopped)
+		{
+			_evict_timer.expires_after(_config.eviction_interval);
+			co_await _evict_timer.async_wait(boost::asio::as_tuple(boost::asio::use_awaitable));
+
+			// closed outside of the lock
+			std::vector<std::unique_ptr<HttpClient>> expired;
+			{
+				std::lock_guard lock(_mutex);
+				const auto deadline = std::chrono::steady_clock::now() - _config.idle_timeout;
+				for (auto& [key, host] : _hosts)
+				{
+					std::erase_if(host->idle, [&](Idle& idle)
+					{
+						if (idle.since > deadline)
+							return false;
+						expired.push_back(std::move(idle.client));
+						return true;
+					});
+				}
+			}
+			_stats.evicted += expired.size();
+		}
+	}
+
+private:
+	boost::asio::any_io_executor _exec;
+	boost::asio::strand<boost::asio::any_io_executor> _strand;
+	boost::asio::steady_timer _evict_timer;
+	PoolConfig _config;
+	bool _stopped = false;
+
+	std::mutex _mutex;
+	std::unordered_map<std::string, std::unique_ptr<Host>> _hosts;
+	Stats _stats;
+};
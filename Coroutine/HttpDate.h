@@ -0,0 +1,236 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+/// <summary>
+/// IMF-fixdate formatting ("Sun, 06 Nov 1994 08:49:37 GMT") without stream or locale
+/// </summary>
+struct HttpDate
+{
+    static constexpr std::size_t Size = 29;
+
+    static void Format(std::time_t time, char* out)
+    {
+        static constexpr std::string_view days = "SunMonTueWedThuFriSat";
+        static constexpr std::string_view months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+        std::tm tm{};
+#if defined(_WIN32)
+        gmtime_s(&tm, &time);
+#else
+        gmtime_r(&time, &tm);
+#endif
+        const auto two = [&out](int value)
+        {
+            *out++ = static_cast<char>('0' + value / 10);
+            *out++ = static_cast<char>('0' + value % 10);
+        };
+        const auto text = [&out](std::string_view value)
+        {
+            for (const char c : value)
+                *out++ = c;
+        };
+
+        const int year = tm.tm_year + 1900;
+        text(days.substr(tm.tm_wday * 3, 3));
+        text(", ");
+        two(tm.tm_mday);
+        *out++ = ' ';
+        text(months.substr(tm.tm_mon * 3, 3));
+        *out++ = ' ';
+        two(year / 100);
+        two(year % 100);
+        *out++ = ' ';
+        two(tm.tm_hour);
+        *out++ = ':';
+        two(tm.tm_min);
+        *out++ = ':';
+        two(tm.tm_sec);
+        text(" GMT");
+    }
+
+    /// <summary>
+    /// Time of an IMF-fixdate as sent back in If-Modified-Since, nullopt for anything else (the obsolete RFC 850 and
+    /// asctime forms included: a conditional request that cannot be read is served in full)
+    /// </summary>
+    static std::optional<std::time_t> Parse(std::string_view text)
+    {
+        static constexpr std::string_view months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+        if (text.size() != Size || text.substr(3, 2) != ", " || text.substr(25) != " GMT")
+            return std::nullopt;
+
+        const auto number = [&text](std::size_t offset, std::size_t digits) -> int
+        {
+            int value = 0;
+            for (std::size_t i = offset; i < offset + digits; ++i)
+            {
+                if (text[i] < '0' || text[i] > '9')
+                    return -1;
+                value = value * 10 + (text[i] - '0');
+            }
+            return value;
+        };
+
+        const auto month = months.find(text.substr(8, 3));
+        const int day = number(5, 2);
+        const int year = number(12, 4);
+        const int hour = number(17, 2);
+        const int minute = number(20, 2);
+        const int second = number(23, 2);
+        if (month == std::string_view::npos || month % 3 != 0 || day < 1 || day > 31 || year < 1970 || hour < 0 || hour > 23
+            || minute < 0 || minute > 59 || second < 0 || second > 60 || text[19] != ':' || text[22] != ':')
+            return std::nullopt;
+
+        // days since the epoch of a proleptic gregorian date, no timegm / _mkgmtime needed
+        const int m = static_cast<int>(month / 3) + 1;
+        const int y = year - (m <= 2);
+        const int era = y / 400;
+        const int yoe = y - era * 400;
+        const int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        const std::int64_t days = static_cast<std::int64_t>(era) * 146097 + doe - 719468;
+        return static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+    }
+};
+
+/// <summary>
+/// Current second shared by every response Date header
+/// A timer stores the time once per second, each thread keeps the formatted date of the last second it saw and
+/// formats again only when it changed: a response copies 29 bytes, without reading the clock
+/// The timer runs on the executor of one of the servers started and not stopped yet and moves to another one when
+/// that server stops; with no server running the clock is read on each call
+/// </summary>
+class DateCache
+{
+public:
+    /// <summary>
+    /// Keep the date refreshed while the server running on exec runs, until Stop(exec)
+    /// </summary>
+    static void Start(boost::asio::any_io_executor exec)
+    {
+        Timer& timer = State();
+        std::lock_guard lock(timer.mutex);
+        timer.executors.push_back(std::move(exec));
+        if (timer.executors.size() == 1)
+            Run(timer);
+    }
+
+    /// <summary>
+    /// The server running on exec stops: the timer moves to the executor of a server still running
+    /// </summary>
+    static void Stop(const boost::asio::any_io_executor& exec)
+    {
+        Timer& timer = State();
+        std::lock_guard lock(timer.mutex);
+        const auto it = std::find(timer.executors.begin(), timer.executors.end(), exec);
+        if (it == timer.executors.end())
+            return;
+        const bool refreshing = it == timer.executors.begin();
+        timer.executors.erase(it);
+        if (refreshing)
+            Run(timer);
+    }
+
+    /// <summary>
+    /// Formatted current date, valid until the calling thread asks again
+    /// </summary>
+    static std::string_view Get()
+    {
+        struct Slot
+        {
+            std::time_t time = -1;
+            std::array<char, HttpDate::Size> text{};
+        };
+        thread_local Slot slot;
+
+        std::time_t now = Now().load(std::memory_order_relaxed);
+        if (!Started().load(std::memory_order_relaxed))
+            now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        if (now != slot.time)
+        {
+            HttpDate::Format(now, slot.text.data());
+            slot.time = now;
+        }
+        return std::string_view(slot.text.data(), slot.text.size());
+    }
+
+private:
+    // executors of the running servers, the first one runs the timer
+    struct Timer
+    {
+        std::mutex mutex;
+        std::vector<boost::asio::any_io_executor> executors;
+    };
+
+    static Timer& State()
+    {
+        static Timer timer;
+        return timer;
+    }
+
+    static std::atomic<std::time_t>& Now()
+    {
+        static std::atomic<std::time_t> now{ 0 };
+        return now;
+    }
+
+    static std::atomic<bool>& Started()
+    {
+        static std::atomic<bool> started{ false };
+        return started;
+    }
+
+    // bumped each time the timer moves, the timer of an older generation exits on its next tick (or never runs
+    // again when its executor stopped)
+    static std::atomic<std::uint64_t>& Generation()
+    {
+        static std::atomic<std::uint64_t> generation{ 0 };
+        return generation;
+    }
+
+    static void Run(Timer& timer)
+    {
+        const std::uint64_t generation = ++Generation();
+        if (timer.executors.empty())
+        {
+            Started().store(false, std::memory_order_relaxed);
+            return;
+        }
+
+        Now().store(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()), std::memory_order_relaxed);
+        Started().store(true, std::memory_order_relaxed);
+        boost::asio::co_spawn(timer.executors.front(), Refresh(generation), boost::asio::detached);
+    }
+
+    static boost::asio::awaitable<void> Refresh(std::uint64_t generation)
+    {
+        boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+        while (Generation().load() == generation)
+        {
+            Now().store(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()), std::memory_order_relaxed);
+
+            // wake up right after the next second starts
+            const auto now = std::chrono::system_clock::now();
+            timer.expires_after(std::chrono::ceil<std::chrono::seconds>(now + std::chrono::milliseconds(1)) - now);
+            co_await timer.async_wait(boost::asio::use_awaitable);
+        }
+    }
+};
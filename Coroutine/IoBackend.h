@@ -0,0 +1,54 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// <summary>
+/// Asio backend running every socket, acceptor and timer of the process, chosen at build time
+/// io_uring replaces epoll when BOOST_ASIO_HAS_IO_URING and BOOST_ASIO_DISABLE_EPOLL are both defined (CMake:
+/// -DHTTP_IO_BACKEND=io_uring, which links liburing): each operation becomes a submission queue entry, the entries
+/// queued by a run of handlers are submitted together by one io_uring_enter and the completions reaped in batches
+/// The backend belongs to the binary, not to an io_context: server and client switch together, their coroutine
+/// apis are the same on both
+/// </summary>
+class IoBackend
+{
+public:
+    static constexpr std::string_view Name =
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+        "io_uring";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+        "iocp";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+        "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+        "kqueue";
+#else
+        "select";
+#endif
+
+    /// <summary>
+    /// Why the backend cannot run in this process, nothing when it can
+    /// A binary built for io_uring may still be refused it: old kernel, kernel.io_uring_disabled, container seccomp
+    /// profile. Checked up front, the failure would otherwise surface from the first socket created
+    /// </summary>
+    static std::optional<std::string> Unavailable()
+    {
+        try
+        {
+            // the ring of a context is set up along with its first I/O object
+            boost::asio::io_context probe(1);
+            boost::asio::ip::tcp::socket socket(probe);
+            return std::nullopt;
+        }
+        catch (const std::exception& e)
+        {
+            return std::string(Name) + " backend unavailable: " + e.what();
+        }
+    }
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <cstring>
+#include <span>
+#include <string>
+#include <vector>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+/// <summary>
+/// Listening sockets passed from a running server to the one replacing it, over a unix domain socket (SCM_RIGHTS)
+/// The new process receives duplicates of the listening descriptors: the sockets never close, connections waiting
+/// in their backlog are accepted by the new process while the old one drains its own
+/// Unix only, Receive() finds nothing and Send() fails elsewhere
+/// </summary>
+struct ListenerHandoff
+{
+    static constexpr std::size_t MaxHandles = 256;
+
+    /// <summary>
+    /// Send the listening handles through a connected unix socket
+    /// </summary>
+    static bool Send(int channel, std::span<const int> handles)
+    {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if (handles.empty() || handles.size() > MaxHandles)
+            return false;
+
+        // one byte of payload carries the descriptors, SCM_RIGHTS cannot be sent alone
+        char tag = 'L';
+        iovec iov{ &tag, 1 };
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * handles.size()));
+
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handles.size());
+        std::memcpy(CMSG_DATA(cmsg), handles.data(), sizeof(int) * handles.size());
+
+#if defined(MSG_NOSIGNAL)
+        return ::sendmsg(channel, &msg, MSG_NOSIGNAL) == 1;
+#else
+        return ::sendmsg(channel, &msg, 0) == 1;
+#endif
+#else
+        (void)channel;
+        (void)handles;
+        return false;
+#endif
+    }
+
+    /// <summary>
+    /// Listening handles of the server answering on path, empty when none answers
+    /// The caller owns the handles
+    /// </summary>
+    static std::vector<int> Receive(boost::asio::any_io_executor exec, const std::string& path)
+    {
+        std::vector<int> handles;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        boost::asio::local::stream_protocol::socket channel(exec);
+        boost::system::error_code ec;
+        channel.connect(boost::asio::local::stream_protocol::endpoint(path), ec);
+        if (ec)
+            return handles;
+
+        char tag = 0;
+        iovec iov{ &tag, 1 };
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * MaxHandles));
+
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+#if defined(MSG_CMSG_CLOEXEC)
+        const int flags = MSG_CMSG_CLOEXEC;
+#else
+        const int flags = 0;
+#endif
+        if (::recvmsg(channel.native_handle(), &msg, flags) != 1)
+            return handles;
+
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            const std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const std::size_t first = handles.size();
+            handles.resize(first + count);
+            std::memcpy(handles.data() + first, CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+#else
+        (void)exec;
+        (void)path;
+#endif
+        return handles;
+    }
+};
@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "Api.h"
+#include "http_server.h"
+#include "HttpClient.h"
+#include "IoBackend.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "SelfSignedCertificate.h"
+#include "TlsClientContext.h"
+
+// loopback load generator: an HttpServer serving Api and HttpClient connections hammering it, in one process
+// usage: LoadTest [--connections 64] [--requests 200000] [--warmup 5000] [--body 0] [--no-keep-alive]
+//                 [--threads N] [--per-core] [--metrics] [--target /] [--url http://host:port] [--file 0] [--tls]
+// a body size above 0 sends POST /toto with that many bytes, otherwise GET target; a file size above 0 serves a file
+// of that many bytes (up to the client's 8MB body limit) on GET /static/file.bin and loads it; with --url the server of the
+// process is not started and the given one is loaded instead; --metrics turns the server metrics on, compare the
+// runs with and without it for their overhead; --tls serves https with a self-signed certificate, the clients share
+// one TLS context so reconnections resume their session: with --no-keep-alive each request pays a handshake and
+// the handshakes per second are printed
+// the I/O backend is the one the binary was built with (LoadTest, LoadTestEpoll with -DHTTP_IO_BACKEND=io_uring): the
+// process cpu time and context switches are printed to compare them, syscalls are counted from outside, e.g.
+//     perf stat -e raw_syscalls:sys_enter,context-switches build/LoadTest ...
+
+namespace
+{
+    struct Options
+    {
+        std::size_t connections = 64;
+        std::size_t requests = 200000;
+        std::size_t warmup = 5000;
+        std::size_t body = 0;
+        std::size_t file = 0;
+        bool keep_alive = true;
+        std::size_t threads = std::max(2u, std::thread::hardware_concurrency());
+        bool per_core = false;
+        bool metrics = false;
+        std::string target = "/";
+        std::string url;
+        bool tls = false;
+    };
+
+    /// <summary>
+    /// Shared by the connections: requests left to send, and the latencies measured once the warmup is done
+    /// </summary>
+    struct Run
+    {
+        std::atomic<std::size_t> sent = 0;
+        std::atomic<std::size_t> errors = 0;
+        std::atomic<std::size_t> active = 0;
+        std::atomic<std::int64_t> measure_start = 0;
+
+        // client TLS context of every connection, its handshake count when the measure started
+        std::shared_ptr<TlsClientContext> tls = std::make_shared<TlsClientContext>();
+        std::atomic<std::size_t> handshakes_start = 0;
+
+        std::mutex mutex;
+        std::vector<std::uint32_t> latencies_us;
+    };
+
+    std::int64_t NowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    boost::asio::awaitable<void> Client(const Options& options, Run& run)
+    {
+        const auto exec = co_await boost::asio::this_coro::executor;
+        const Body body(options.body, 'x');
+        const Status expected = options.body ? Status::created : Status::ok;
+        const Headers headers = { {"Accept-Encoding", "identity"} };
+
+        std::vector<std::uint32_t> latencies;
+        std::optional<HttpClient> client;
+        for (;;)
+        {
+            const std::size_t index = run.sent++;
+            if (index >= options.warmup + options.requests)
+                break;
+            if (index == options.warmup)
+            {
+                run.handshakes_start = run.tls->stats().handshakes.load();
+                run.measure_start = NowNs();
+            }
+
+            const std::int64_t start = NowNs();
+            try
+            {
+                // a new connection per request without keep-alive, its setup is part of the latency
+                if (!client || !client->reusable())
+                {
+                    client.emplace(exec, run.tls, options.url);
+                    co_await client->connect(options.keep_alive ? Connection::KEEP_ALIVE : Connection::CLOSE);
+                }
+
+                // not a conditional expression: gcc 12 destroys the result of a co_await in one twice
+                Status status;
+                if (options.body)
+                    status = (co_await client->post<boost::beast::http::string_body>("/toto", body, "application/json", headers)).result();
+                else
+                    status = (co_await client->get<boost::beast::http::string_body>(options.target, headers)).result();
+                if (status != expected)
+                    ++run.errors;
+            }
+            catch (const std::exception&)
+            {
+                ++run.errors;
+                client.reset();
+            }
+
+            if (!options.keep_alive)
+                client.reset();
+            if (index >= options.warmup)
+                latencies.push_back(static_cast<std::uint32_t>((NowNs() - start) / 1000));
+        }
+
+        std::lock_guard lock(run.mutex);
+        run.latencies_us.insert(run.latencies_us.end(), latencies.begin(), latencies.end());
+    }
+
+    std::optional<std::size_t> Number(std::string_view text)
+    {
+        std::size_t value = 0;
+        const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (error != std::errc{} || end != text.data() + text.size())
+            return std::nullopt;
+        return value;
+    }
+
+    std::optional<Options> Parse(int argc, char** argv)
+    {
+        Options options;
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string_view arg = argv[i];
+            const auto value = [&]() -> std::optional<std::string_view>
+            {
+                if (i + 1 >= argc)
+                    return std::nullopt;
+                return std::string_view(argv[++i]);
+            };
+            const auto number = [&](std::size_t& field)
+            {
+                const auto text = value();
+                const auto parsed = text ? Number(*text) : std::nullopt;
+                if (parsed)
+                    field = *parsed;
+                return parsed.has_value();
+            };
+
+            bool valid = true;
+            if (arg == "--connections")
+                valid = number(options.connections) && options.connections > 0;
+            else if (arg == "--requests")
+                valid = number(options.requests) && options.requests > 0;
+            else if (arg == "--warmup")
+                valid = number(options.warmup);
+            else if (arg == "--body")
+                valid = number(options.body);
+            else if (arg == "--file")
+                valid = number(options.file);
+            else if (arg == "--threads")
+                valid = number(options.threads) && options.threads > 0;
+            else if (arg == "--no-keep-alive")
+                options.keep_alive = false;
+            else if (arg == "--per-core")
+                options.per_core = true;
+            else if (arg == "--metrics")
+                options.metrics = true;
+            else if (arg == "--tls")
+                options.tls = true;
+            else if (const auto text = (arg == "--target" || arg == "--url") ? value() : std::nullopt)
+                (arg == "--target" ? options.target : options.url) = std::string(*text);
+            else
+                valid = false;
+
+            if (!valid)
+            {
+                std::cerr << "Invalid argument: " << arg << "\n";
+                return std::nullopt;
+            }
+        }
+        return options;
+    }
+
+    /// <summary>
+    /// Cpu time and context switches of the whole process (client and server, warmup included) per request: what an
+    /// I/O backend saves shows here
+    /// </summary>
+    void PrintUsage(std::size_t requests)
+    {
+#if !defined(_WIN32)
+        rusage usage{};
+        if (requests == 0 || getrusage(RUSAGE_SELF, &usage) != 0)
+            return;
+        const auto seconds = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+        const double user = seconds(usage.ru_utime);
+        const double sys = seconds(usage.ru_stime);
+        std::printf("Process: user %.2fs  sys %.2fs  (%.1f us cpu per request)  context switches %ld voluntary %ld involuntary\n",
+            user, sys, (user + sys) * 1e6 / requests, usage.ru_nvcsw, usage.ru_nivcsw);
+#else
+        (void)requests;
+#endif
+    }
+
+    std::uint32_t Percentile(const std::vector<std::uint32_t>& sorted, double p)
+    {
+        if (sorted.empty())
+            return 0;
+        const auto rank = static_cast<std::size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+}
+
+int main(int argc, char** argv)
+{
+    auto parsed = Parse(argc, argv);
+    if (!parsed)
+        return 2;
+    Options& options = *parsed;
+
+    if (const auto error = IoBackend::Unavailable())
+    {
+        std::cerr << *error << "\n";
+        return 1;
+    }
+
+    // the client logs each request at Info, it would measure the log instead of the server
+    Log::SetLevel(LogLevel::Warn);
+
+    boost::asio::thread_pool pool{ options.threads };
+    Api api;
+    std::optional<HttpServer> server;
+    if (options.url.empty())
+    {
+        ServerConfig config;
+        config.mode = options.per_core ? ServerMode::PerCore : ServerMode::SharedPool;
+        config.limits.max_connections = 0;
+        if (options.tls)
+        {
+            auto [cert, key] = MakeSelfSignedCertificate();
+            config.tls.emplace();
+            config.tls->certificate_chain = std::move(cert);
+            config.tls->private_key = std::move(key);
+        }
+        const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::make_address("127.0.0.1"), 18080);
+        if (options.metrics)
+            api.EnableMetrics();
+        if (options.file)
+        {
+            const auto root = std::filesystem::temp_directory_path() / "coroutine-loadtest-static";
+            std::filesystem::create_directories(root);
+            std::ofstream(root / "file.bin", std::ios::binary) << std::string(options.file, 'f');
+            api.EnableStaticFiles(root.string());
+            options.target = "/static/file.bin";
+        }
+        server.emplace(pool.get_executor(), endpoint, config);
+        server->AddApi(api);
+        server->Start();
+        options.url = options.tls ? "https://127.0.0.1:18080" : "127.0.0.1:18080";
+    }
+
+    std::printf("%s %s, %zu connections, %s, %zu bytes body, %zu threads%s, %zu requests after %zu warmup, %s\n",
+        options.body ? "POST /toto" : ("GET " + options.target).c_str(), options.url.c_str(), options.connections,
+        options.keep_alive ? "keep-alive" : "one connection per request", options.body, options.threads,
+        options.per_core ? " (server per core)" : "", options.requests, options.warmup, IoBackend::Name.data());
+
+    Run run;
+    run.active = options.connections;
+    run.latencies_us.reserve(options.requests);
+    for (std::size_t i = 0; i < options.connections; ++i)
+    {
+        boost::asio::co_spawn(pool, Client(options, run), [&run, &pool](std::exception_ptr)
+        {
+            if (--run.active == 0)
+                pool.stop();
+        });
+    }
+    pool.join();
+
+    const std::int64_t end = NowNs();
+    if (server)
+    {
+        server->Stop();
+        server->Join();
+    }
+
+    auto& latencies = run.latencies_us;
+    std::sort(latencies.begin(), latencies.end());
+    const double seconds = run.measure_start ? (end - run.measure_start) / 1e9 : 0;
+    std::printf("%zu requests in %.2fs, %zu errors\n", latencies.size(), seconds, run.errors.load());
+    std::printf("Requests/sec: %.0f\n", seconds > 0 ? latencies.size() / seconds : 0.0);
+    std::printf("Latency (us): p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n", Percentile(latencies, 50), Percentile(latencies, 90),
+        Percentile(latencies, 99), Percentile(latencies, 99.9), latencies.empty() ? 0 : latencies.back());
+    if (const std::size_t handshakes = run.tls->stats().handshakes; handshakes > 0)
+    {
+        const std::size_t measured = handshakes - run.handshakes_start;
+        std::printf("TLS handshakes: %zu (%zu resumed), %.0f/sec measured\n", handshakes, run.tls->stats().resumed.load(),
+            seconds > 0 ? measured / seconds : 0.0);
+    }
+    PrintUsage(options.warmup + options.requests);
+
+    // where the server spent its time, warmup included
+    if (options.metrics && server)
+    {
+        static constexpr std::pair<Metrics::Phase, const char*> Phases[] = { { Metrics::Phase::Read, "read" }, { Metrics::Phase::Middleware, "middleware" }, { Metrics::Phase::Handler, "handler" }, { Metrics::Phase::Write, "write" } };
+        for (const auto& [phase, name] : Phases)
+        {
+            const auto snapshot = Metrics::Instance().PhaseLatency(phase);
+            std::printf("Server %-10s (us): p50 %llu  p99 %llu  (%llu)\n", name, static_cast<unsigned long long>(snapshot.Percentile(50)),
+                static_cast<unsigned long long>(snapshot.Percentile(99)), static_cast<unsigned long long>(snapshot.count));
+        }
+    }
+    return run.errors == 0 ? 0 : 1;
+}
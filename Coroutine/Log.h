@@ -0,0 +1,416 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// lowest level compiled in, calls below it are removed at compile time (0 Trace, 1 Debug, 2 Info, 3 Warn, 4 Error)
+#if !defined(LOG_COMPILED_LEVEL)
+#define LOG_COMPILED_LEVEL 0
+#endif
+
+enum class LogLevel : uint8_t
+{
+	Trace,
+	Debug,
+	Info,
+	Warn,
+	Error,
+	Off
+};
+
+inline constexpr LogLevel CompiledLogLevel = static_cast<LogLevel>(LOG_COMPILED_LEVEL);
+
+/// <summary>
+/// Fixed size binary log record, arguments are stored raw and only formatted by the log thread
+/// Text arguments are copied in the record and truncated to what is left of TextSize
+/// </summary>
+struct LogRecord
+{
+	static constexpr std::size_t MaxArgs = 6;
+	static constexpr std::size_t TextSize = 160;
+
+	struct Arg
+	{
+		enum class Type : uint8_t
+		{
+			Signed,
+			Unsigned,
+			Float,
+			Bool,
+			Text
+		};
+
+		Type type;
+		uint16_t offset;
+		uint16_t size;
+		union
+		{
+			int64_t i;
+			uint64_t u;
+			double d;
+		};
+	};
+
+	std::chrono::system_clock::time_point time;
+	const char* format;
+	LogLevel level;
+	uint8_t arg_count;
+	uint16_t text_size;
+	std::array<Arg, MaxArgs> args;
+	std::array<char, TextSize> text;
+};
+
+/// <summary>
+/// Single producer single consumer ring of records, one per logging thread
+/// The producer never waits: a full ring drops the record
+/// </summary>
+class LogRing
+{
+public:
+	static constexpr std::size_t Capacity = 1024;
+
+	explicit LogRing(uint32_t thread)
+		: _thread{ thread }
+	{
+	}
+
+	uint32_t Thread() const { return _thread; }
+
+	/// <summary>
+	/// Producer side: fill the next free slot in place, false when the ring is full
+	/// </summary>
+	template <typename Fill>
+	bool TryPush(Fill&& fill)
+	{
+		const std::size_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head.load(std::memory_order_acquire) == Capacity)
+			return false;
+
+		fill(_records[tail % Capacity]);
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// <summary>
+	/// Consumer side: hand every published record to sink, return how many were consumed
+	/// </summary>
+	template <typename Sink>
+	std::size_t Drain(Sink&& sink)
+	{
+		const std::size_t head = _head.load(std::memory_order_relaxed);
+		const std::size_t tail = _tail.load(std::memory_order_acquire);
+		for (std::size_t i = head; i != tail; ++i)
+			sink(_records[i % Capacity]);
+
+		_head.store(tail, std::memory_order_release);
+		return tail - head;
+	}
+
+	bool Empty() const
+	{
+		return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+	}
+
+private:
+	std::array<LogRecord, Capacity> _records;
+	const uint32_t _thread;
+	alignas(64) std::atomic<std::size_t> _head = 0;
+	alignas(64) std::atomic<std::size_t> _tail = 0;
+};
+
+/// <summary>
+/// Asynchronous structured logger
+/// Log::Info("Connection lost to: {}", ip) stores a record in the calling thread ring, a background thread formats
+/// the records and writes them (Warn and Error to stderr, the others to stdout)
+/// Records of one thread keep their order, records of different threads are only ordered per flush pass
+/// Levels below LOG_COMPILED_LEVEL are compiled out, SetLevel() filters at run time, SetSampling(n) keeps one
+/// Trace/Debug/Info record out of n per thread and Dropped() counts records lost because a ring was full
+/// </summary>
+class Log
+{
+public:
+	template <typename... Args>
+	static void Trace(const char* format, const Args&... args) { Write<LogLevel::Trace>(format, args...); }
+
+	template <typename... Args>
+	static void Debug(const char* format, const Args&... args) { Write<LogLevel::Debug>(format, args...); }
+
+	template <typename... Args>
+	static void Info(const char* format, const Args&... args) { Write<LogLevel::Info>(format, args...); }
+
+	template <typename... Args>
+	static void Warn(const char* format, const Args&... args) { Write<LogLevel::Warn>(format, args...); }
+
+	template <typename... Args>
+	static void Error(const char* format, const Args&... args) { Write<LogLevel::Error>(format, args...); }
+
+	/// <summary>
+	/// format must be a string literal (only its address is stored), each {} is replaced by the next argument
+	/// Arguments are integers, floating points, bools, enums (written as numbers) or anything convertible to std::string_view
+	/// </summary>
+	template <LogLevel Level, typename... Args>
+	static void Write(const char* format, const Args&... args)
+	{
+		static_assert(sizeof...(Args) <= LogRecord::MaxArgs, "Log: too many arguments");
+
+		if constexpr (Level >= CompiledLogLevel)
+		{
+			Log& log = Instance();
+			if (Level < log._level.load(std::memory_order_relaxed))
+				return;
+			if (Level < LogLevel::Warn && !Sample(log))
+				return;
+
+			const bool pushed = Ring().TryPush([&](LogRecord& record)
+			{
+				record.time = std::chrono::system_clock::now();
+				record.format = format;
+				record.level = Level;
+				record.arg_count = 0;
+				record.text_size = 0;
+				(Encode(record, args), ...);
+			});
+			if (!pushed)
+				log._dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	static void SetLevel(LogLevel level)
+	{
+		Instance()._level.store(level, std::memory_order_relaxed);
+	}
+
+	static LogLevel Level()
+	{
+		return Instance()._level.load(std::memory_order_relaxed);
+	}
+
+	/// <summary>
+	/// Keep one Trace/Debug/Info record out of one_in, 0 or 1 keeps them all
+	/// </summary>
+	static void SetSampling(uint32_t one_in)
+	{
+		Instance()._sampling.store(one_in, std::memory_order_relaxed);
+	}
+
+	static std::size_t Dropped()
+	{
+		return Instance()._dropped.load(std::memory_order_relaxed);
+	}
+
+	/// <summary>
+	/// Wait until every record logged before the call is written
+	/// </summary>
+	static void Flush()
+	{
+		Log& log = Instance();
+		const std::size_t target = log._passes.load(std::memory_order_acquire) + 2;
+		while (log._passes.load(std::memory_order_acquire) < target)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	~Log()
+	{
+		_stop = true;
+		_thread.join();
+	}
+
+private:
+	Log()
+		: _thread{ [this]() { Run(); } }
+	{
+	}
+
+	static Log& Instance()
+	{
+		static Log log;
+		return log;
+	}
+
+	static LogRing& Ring()
+	{
+		thread_local const std::shared_ptr<LogRing> ring = Instance().Register();
+		return *ring;
+	}
+
+	static bool Sample(Log& log)
+	{
+		thread_local uint32_t counter = 0;
+		const uint32_t one_in = log._sampling.load(std::memory_order_relaxed);
+		return one_in <= 1 || counter++ % one_in == 0;
+	}
+
+	std::shared_ptr<LogRing> Register()
+	{
+		std::lock_guard lock(_mutex);
+		_rings.push_back(std::make_shared<LogRing>(_next_thread++));
+		return _rings.back();
+	}
+
+	template <typename T>
+	static void Encode(LogRecord& record, const T& value)
+	{
+		if constexpr (std::is_enum_v<T>)
+			Encode(record, static_cast<std::underlying_type_t<T>>(value));
+		else
+			Encode(record, record.args[record.arg_count++], value);
+	}
+
+	template <typename T>
+	static void Encode(LogRecord& record, LogRecord::Arg& arg, const T& value)
+	{
+		if constexpr (std::is_same_v<T, bool>)
+		{
+			arg.type = LogRecord::Arg::Type::Bool;
+			arg.u = value;
+		}
+		else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+		{
+			arg.type = LogRecord::Arg::Type::Signed;
+			arg.i = value;
+		}
+		else if constexpr (std::is_integral_v<T>)
+		{
+			arg.type = LogRecord::Arg::Type::Unsigned;
+			arg.u = value;
+		}
+		else if constexpr (std::is_floating_point_v<T>)
+		{
+			arg.type = LogRecord::Arg::Type::Float;
+			arg.d = value;
+		}
+		else
+		{
+			static_assert(std::is_convertible_v<const T&, std::string_view>, "Log: unsupported argument type");
+			const std::string_view text(value);
+			const std::size_t size = std::min(text.size(), LogRecord::TextSize - record.text_size);
+			std::memcpy(record.text.data() + record.text_size, text.data(), size);
+			arg.type = LogRecord::Arg::Type::Text;
+			arg.offset = record.text_size;
+			arg.size = static_cast<uint16_t>(size);
+			record.text_size += static_cast<uint16_t>(size);
+		}
+	}
+
+	static void Format(std::string& out, const LogRecord& record, uint32_t thread)
+	{
+		static constexpr const char* Names[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+		const auto since_epoch = record.time.time_since_epoch();
+		const std::time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+		const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(since_epoch).count() % 1000000;
+		std::tm tm{};
+#if defined(_WIN32)
+		gmtime_s(&tm, &seconds);
+#else
+		gmtime_r(&seconds, &tm);
+#endif
+		char prefix[64];
+		const int size = std::snprintf(prefix, sizeof(prefix), "%04d-%02d-%02d %02d:%02d:%02d.%06d [%s] [%u] ",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, static_cast<int>(micros),
+			Names[static_cast<std::size_t>(record.level)], thread);
+		out.append(prefix, size);
+
+		std::size_t next = 0;
+		for (const char* p = record.format; *p; ++p)
+		{
+			if (p[0] != '{' || p[1] != '}' || next == record.arg_count)
+			{
+				out.push_back(*p);
+				continue;
+			}
+
+			const auto& arg = record.args[next++];
+			char number[32];
+			switch (arg.type)
+			{
+			case LogRecord::Arg::Type::Signed:
+				out.append(number, std::to_chars(number, number + sizeof(number), arg.i).ptr);
+				break;
+			case LogRecord::Arg::Type::Unsigned:
+				out.append(number, std::to_chars(number, number + sizeof(number), arg.u).ptr);
+				break;
+			case LogRecord::Arg::Type::Float:
+				out.append(number, std::snprintf(number, sizeof(number), "%g", arg.d));
+				break;
+			case LogRecord::Arg::Type::Bool:
+				out += arg.u ? "true" : "false";
+				break;
+			case LogRecord::Arg::Type::Text:
+				out.append(record.text.data() + arg.offset, arg.size);
+				break;
+			}
+			++p;
+		}
+		out.push_back('\n');
+	}
+
+	// background thread: drain every ring, write, sleep when there was nothing to do
+	void Run()
+	{
+		std::string out;
+		std::string err;
+		for (bool stopping = false; !stopping;)
+		{
+			stopping = _stop;
+
+			std::size_t drained = 0;
+			{
+				std::lock_guard lock(_mutex);
+				for (auto& ring : _rings)
+				{
+					drained += ring->Drain([&](const LogRecord& record)
+					{
+						Format(record.level >= LogLevel::Warn ? err : out, record, ring->Thread());
+					});
+				}
+
+				// rings of exited threads are released once empty
+				std::erase_if(_rings, [](const auto& ring) { return ring.use_count() == 1 && ring->Empty(); });
+			}
+
+			if (!out.empty())
+			{
+				std::fwrite(out.data(), 1, out.size(), stdout);
+				std::fflush(stdout);
+				out.clear();
+			}
+			if (!err.empty())
+			{
+				std::fwrite(err.data(), 1, err.size(), stderr);
+				err.clear();
+			}
+
+			_passes.fetch_add(1, std::memory_order_release);
+			if (drained == 0 && !stopping)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+private:
+	std::atomic<LogLevel> _level = LogLevel::Trace;
+	std::atomic<uint32_t> _sampling = 1;
+	std::atomic<std::size_t> _dropped = 0;
+	std::atomic<std::size_t> _passes = 0;
+	std::atomic<bool> _stop = false;
+
+	std::mutex _mutex;
+	std::vector<std::shared_ptr<LogRing>> _rings;
+	uint32_t _next_thread = 0;
+
+	std::thread _thread;
+};
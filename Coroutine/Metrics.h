@@ -0,0 +1,470 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// <summary>
+/// Latency histogram with HDR buckets: linear below 16us, then 16 buckets per power of two, so any value is
+/// counted within 6.25% of its real value from 1us to 19 hours in 528 counters
+/// Written by one thread only (see Metrics), read at any time: the counters are atomics written without a
+/// read-modify-write, a scrape may miss the last few increments but never tears a value
+/// </summary>
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned SubBits = 4;
+    static constexpr std::uint64_t SubBuckets = 1 << SubBits;
+    static constexpr unsigned MaxBits = 36;
+    static constexpr std::size_t Buckets = (MaxBits - SubBits + 1) * SubBuckets;
+
+    /// <param name="ns">duration in nanoseconds</param>
+    void Record(std::int64_t ns)
+    {
+        Increment(_counts[Index(static_cast<std::uint64_t>(std::max<std::int64_t>(ns, 0)) / 1000)]);
+        _sum_ns.store(_sum_ns.load(std::memory_order_relaxed) + static_cast<std::uint64_t>(std::max<std::int64_t>(ns, 0)), std::memory_order_relaxed);
+    }
+
+    static std::size_t Index(std::uint64_t us)
+    {
+        us = std::min<std::uint64_t>(us, (std::uint64_t(1) << MaxBits) - 1);
+        if (us < SubBuckets)
+            return static_cast<std::size_t>(us);
+        const unsigned exponent = static_cast<unsigned>(std::bit_width(us)) - 1;
+        const std::uint64_t sub = (us >> (exponent - SubBits)) & (SubBuckets - 1);
+        return static_cast<std::size_t>((exponent - SubBits + 1) * SubBuckets + sub);
+    }
+
+    // highest value in microseconds counted by bucket i
+    static std::uint64_t UpperBound(std::size_t i)
+    {
+        if (i < SubBuckets)
+            return i;
+        const unsigned shift = static_cast<unsigned>(i / SubBuckets) - 1;
+        return ((SubBuckets + i % SubBuckets + 1) << shift) - 1;
+    }
+
+    /// <summary>
+    /// Plain copy of one or several merged histograms
+    /// </summary>
+    struct Snapshot
+    {
+        std::array<std::uint64_t, Buckets> counts{};
+        std::uint64_t count = 0;
+        std::uint64_t sum_ns = 0;
+
+        /// <summary>
+        /// Value in microseconds under which p percent of the values are, 0 when empty
+        /// </summary>
+        std::uint64_t Percentile(double p) const
+        {
+            if (count == 0)
+                return 0;
+            const auto rank = static_cast<std::uint64_t>(std::max(1.0, p / 100.0 * count + 0.5));
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < Buckets; ++i)
+            {
+                seen += counts[i];
+                if (seen >= rank)
+                    return UpperBound(i);
+            }
+            return UpperBound(Buckets - 1);
+        }
+    };
+
+    void MergeInto(Snapshot& snapshot) const
+    {
+        for (std::size_t i = 0; i < Buckets; ++i)
+        {
+            const std::uint64_t n = _counts[i].load(std::memory_order_relaxed);
+            snapshot.counts[i] += n;
+            snapshot.count += n;
+        }
+        snapshot.sum_ns += _sum_ns.load(std::memory_order_relaxed);
+    }
+
+    static void Increment(std::atomic<std::uint64_t>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, Buckets> _counts{};
+    std::atomic<std::uint64_t> _sum_ns = 0;
+};
+
+/// <summary>
+/// Process wide instrumentation: requests per route and status, latency histograms per route and per phase, and
+/// gauges read when scraped
+/// Every thread records in its own shard, without lock nor contended cache line, the shards are only merged by
+/// Render(); a shard outlives its thread so nothing counted is lost
+/// Recording is skipped unless Enable() was called. Cost measured with MicroBench metrics/*: recording a request
+/// (route histogram, status counter and its four phases) takes about 20ns, the clock reads around the phases
+/// dominate, 260ns per request with them on a VM where steady_clock costs 50ns; compare LoadTest with and
+/// without --metrics for the end to end figure
+/// </summary>
+class Metrics
+{
+public:
+    enum class Phase : std::uint8_t
+    {
+        // header and buffered body read from the socket and parsed
+        Read,
+        Middleware,
+        Handler,
+        // a batch of responses written
+        Write,
+        Count
+    };
+
+    static constexpr std::size_t MaxRoutes = 256;
+    static constexpr std::size_t StatusSlots = 16;
+
+    // route id of the requests no route matched
+    static constexpr std::uint32_t Unmatched = 0;
+
+    static Metrics& Instance()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    static bool Enabled()
+    {
+        return Instance()._enabled.load(std::memory_order_relaxed);
+    }
+
+    static void Enable(bool enabled = true)
+    {
+        Instance()._enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    static std::int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// <summary>
+    /// Id of a route, the same method and pattern registered twice (e.g. by two apis) share it
+    /// Past MaxRoutes the requests of the new routes are counted as unmatched
+    /// </summary>
+    std::uint32_t RouteId(std::string_view method, std::string_view pattern)
+    {
+        std::lock_guard lock(_mutex);
+        for (std::size_t i = 0; i < _routes.size(); ++i)
+        {
+            if (_routes[i].method == method && _routes[i].pattern == pattern)
+                return static_cast<std::uint32_t>(i);
+        }
+        if (_routes.size() >= MaxRoutes)
+            return Unmatched;
+        _routes.push_back({ std::string(method), std::string(pattern) });
+        return static_cast<std::uint32_t>(_routes.size() - 1);
+    }
+
+    /// <summary>
+    /// Count an answered request and the time the api spent on it
+    /// </summary>
+    void RecordRequest(std::uint32_t route, unsigned status, std::int64_t ns)
+    {
+        RouteShard& shard = Local().Route(route < MaxRoutes ? route : Unmatched);
+        shard.latency.Record(ns);
+        if (status == 0)
+        {
+            LatencyHistogram::Increment(shard.other_statuses);
+            return;
+        }
+
+        for (auto& slot : shard.statuses)
+        {
+            const unsigned known = slot.status.load(std::memory_order_relaxed);
+            if (known == status || known == 0)
+            {
+                if (known == 0)
+                    slot.status.store(static_cast<std::uint16_t>(status), std::memory_order_relaxed);
+                LatencyHistogram::Increment(slot.count);
+                return;
+            }
+        }
+        LatencyHistogram::Increment(shard.other_statuses);
+    }
+
+    void RecordPhase(Phase phase, std::int64_t ns)
+    {
+        Local().phases[static_cast<std::size_t>(phase)].Record(ns);
+    }
+
+    /// <summary>
+    /// Value read when scraped, e.g. open connections; type is "gauge" or "counter", labels is the label list
+    /// without braces (name="value",...), the id is given to RemoveGauge once the value is gone
+    /// </summary>
+    std::uint64_t AddGauge(std::string name, std::string help, std::string type, std::string labels, std::function<double()> read)
+    {
+        std::lock_guard lock(_mutex);
+        _gauges.push_back({ ++_next_gauge, std::move(name), std::move(help), std::move(type), std::move(labels), std::move(read) });
+        return _next_gauge;
+    }
+
+    void RemoveGauge(std::uint64_t id)
+    {
+        std::lock_guard lock(_mutex);
+        std::erase_if(_gauges, [id](const Gauge& gauge) { return gauge.id == id; });
+    }
+
+    /// <summary>
+    /// Merged latencies of a route (Unmatched included), e.g. for its percentiles
+    /// </summary>
+    LatencyHistogram::Snapshot RouteLatency(std::uint32_t route) const
+    {
+        LatencyHistogram::Snapshot snapshot;
+        std::lock_guard lock(_mutex);
+        for (const auto& shard : _shards)
+        {
+            if (const RouteShard* routes = shard->routes[route].load(std::memory_order_acquire))
+                routes->latency.MergeInto(snapshot);
+        }
+        return snapshot;
+    }
+
+    LatencyHistogram::Snapshot PhaseLatency(Phase phase) const
+    {
+        LatencyHistogram::Snapshot snapshot;
+        std::lock_guard lock(_mutex);
+        for (const auto& shard : _shards)
+            shard->phases[static_cast<std::size_t>(phase)].MergeInto(snapshot);
+        return snapshot;
+    }
+
+    /// <summary>
+    /// Prometheus text exposition (version 0.0.4) of everything recorded
+    /// </summary>
+    std::string Render() const
+    {
+        // fixed buckets for the exposition, the same on every scrape as Prometheus expects (microseconds)
+        static constexpr std::uint64_t Ladder[] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+        static constexpr std::string_view PhaseNames[] = { "read", "middleware", "handler", "write" };
+
+        std::string out;
+        out.reserve(16 * 1024);
+        std::lock_guard lock(_mutex);
+
+        // counters merged per route and status
+        out += "# HELP http_requests_total Requests answered, by route and status\n# TYPE http_requests_total counter\n";
+        std::vector<LatencyHistogram::Snapshot> latencies(_routes.size());
+        for (std::size_t route = 0; route < _routes.size(); ++route)
+        {
+            std::array<std::pair<unsigned, std::uint64_t>, StatusSlots + 1> statuses{};
+            std::size_t used = 0;
+            std::uint64_t other = 0;
+            for (const auto& shard : _shards)
+            {
+                const RouteShard* routes = shard->routes[route].load(std::memory_order_acquire);
+                if (!routes)
+                    continue;
+                routes->latency.MergeInto(latencies[route]);
+                other += routes->other_statuses.load(std::memory_order_relaxed);
+                for (const auto& slot : routes->statuses)
+                {
+                    const unsigned status = slot.status.load(std::memory_order_relaxed);
+                    if (status == 0)
+                        break;
+                    auto it = std::find_if(statuses.begin(), statuses.begin() + used, [status](const auto& item) { return item.first == status; });
+                    if (it == statuses.begin() + used)
+                    {
+                        if (used == StatusSlots)
+                        {
+                            other += slot.count.load(std::memory_order_relaxed);
+                            continue;
+                        }
+                        *it = { status, 0 };
+                        ++used;
+                    }
+                    it->second += slot.count.load(std::memory_order_relaxed);
+                }
+            }
+
+            const std::string labels = RouteLabels(route);
+            for (std::size_t i = 0; i < used; ++i)
+                Line(out, "http_requests_total", labels + ",status=\"" + std::to_string(statuses[i].first) + "\"", statuses[i].second);
+            if (other)
+                Line(out, "http_requests_total", labels + ",status=\"other\"", other);
+        }
+
+        out += "# HELP http_request_duration_seconds Time spent in the api (middlewares and handler), by route\n# TYPE http_request_duration_seconds histogram\n";
+        for (std::size_t route = 0; route < _routes.size(); ++route)
+        {
+            if (latencies[route].count)
+                Histogram(out, "http_request_duration_seconds", RouteLabels(route), latencies[route], Ladder);
+        }
+
+        out += "# HELP http_phase_duration_seconds Time spent in each phase of a request, read and write per batch of pipelined requests\n# TYPE http_phase_duration_seconds histogram\n";
+        for (std::size_t phase = 0; phase < static_cast<std::size_t>(Phase::Count); ++phase)
+        {
+            LatencyHistogram::Snapshot snapshot;
+            for (const auto& shard : _shards)
+                shard->phases[phase].MergeInto(snapshot);
+            Histogram(out, "http_phase_duration_seconds", "phase=\"" + std::string(PhaseNames[phase]) + "\"", snapshot, Ladder);
+        }
+
+        // gauges grouped by name, HELP and TYPE once each
+        std::vector<const Gauge*> gauges;
+        for (const auto& gauge : _gauges)
+            gauges.push_back(&gauge);
+        std::stable_sort(gauges.begin(), gauges.end(), [](const Gauge* a, const Gauge* b) { return a->name < b->name; });
+        for (std::size_t i = 0; i < gauges.size(); ++i)
+        {
+            if (i == 0 || gauges[i]->name != gauges[i - 1]->name)
+                out += "# HELP " + gauges[i]->name + " " + gauges[i]->help + "\n# TYPE " + gauges[i]->name + " " + gauges[i]->type + "\n";
+            char value[32];
+            std::snprintf(value, sizeof(value), "%.9g", gauges[i]->read());
+            out += gauges[i]->name + (gauges[i]->labels.empty() ? "" : "{" + gauges[i]->labels + "}") + " " + value + "\n";
+        }
+        return out;
+    }
+
+    /// <summary>
+    /// Label value with \ " and new lines escaped
+    /// </summary>
+    static std::string Escape(std::string_view value)
+    {
+        std::string escaped;
+        escaped.reserve(value.size());
+        for (const char c : value)
+        {
+            if (c == '\\')
+                escaped += "\\\\";
+            else if (c == '"')
+                escaped += "\\\"";
+            else if (c == '\n')
+                escaped += "\\n";
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+
+private:
+    struct StatusSlot
+    {
+        std::atomic<std::uint16_t> status = 0;
+        std::atomic<std::uint64_t> count = 0;
+    };
+
+    struct RouteShard
+    {
+        LatencyHistogram latency;
+        std::array<StatusSlot, StatusSlots> statuses;
+        std::atomic<std::uint64_t> other_statuses = 0;
+    };
+
+    // one per thread, only written by it; the route parts are allocated on the first request of the route
+    struct Shard
+    {
+        std::array<std::atomic<RouteShard*>, MaxRoutes> routes{};
+        std::array<LatencyHistogram, static_cast<std::size_t>(Phase::Count)> phases;
+        std::vector<std::unique_ptr<RouteShard>> owned;
+
+        RouteShard& Route(std::uint32_t route)
+        {
+            if (RouteShard* existing = routes[route].load(std::memory_order_relaxed))
+                return *existing;
+            // published with release: a scrape seeing the pointer sees a constructed shard
+            auto& created = owned.emplace_back(std::make_unique<RouteShard>());
+            routes[route].store(created.get(), std::memory_order_release);
+            return *created;
+        }
+    };
+
+    struct RouteName
+    {
+        std::string method;
+        std::string pattern;
+    };
+
+    struct Gauge
+    {
+        std::uint64_t id;
+        std::string name;
+        std::string help;
+        std::string type;
+        std::string labels;
+        std::function<double()> read;
+    };
+
+    Metrics()
+    {
+        _routes.push_back({ "", "" });
+    }
+
+    Shard& Local()
+    {
+        thread_local Shard* shard = nullptr;
+        if (!shard)
+        {
+            // registered once per thread, under the mutex a scrape holds while it walks the shards
+            auto created = std::make_unique<Shard>();
+            shard = created.get();
+            std::lock_guard lock(_mutex);
+            _shards.push_back(std::move(created));
+        }
+        return *shard;
+    }
+
+    std::string RouteLabels(std::size_t route) const
+    {
+        if (route == Unmatched)
+            return "method=\"\",route=\"unmatched\"";
+        return "method=\"" + Escape(_routes[route].method) + "\",route=\"" + Escape(_routes[route].pattern) + "\"";
+    }
+
+    static void Line(std::string& out, std::string_view name, std::string_view labels, std::uint64_t value)
+    {
+        out += name;
+        out += '{';
+        out += labels;
+        out += "} ";
+        out += std::to_string(value);
+        out += '\n';
+    }
+
+    template <std::size_t N>
+    static void Histogram(std::string& out, std::string_view name, const std::string& labels, const LatencyHistogram::Snapshot& snapshot, const std::uint64_t (&ladder)[N])
+    {
+        // an HDR bucket is counted under le once all of its values are, so each le may only under count, by 6.25% at most
+        std::size_t bucket = 0;
+        std::uint64_t cumulative = 0;
+        char le[32];
+        for (const std::uint64_t bound : ladder)
+        {
+            while (bucket < LatencyHistogram::Buckets && LatencyHistogram::UpperBound(bucket) <= bound)
+                cumulative += snapshot.counts[bucket++];
+            std::snprintf(le, sizeof(le), "%g", bound / 1e6);
+            Line(out, std::string(name) + "_bucket", labels + ",le=\"" + le + "\"", cumulative);
+        }
+        Line(out, std::string(name) + "_bucket", labels + ",le=\"+Inf\"", snapshot.count);
+
+        char sum[32];
+        std::snprintf(sum, sizeof(sum), "%.9g", snapshot.sum_ns / 1e9);
+        out += std::string(name) + "_sum{" + labels + "} " + sum + "\n";
+        Line(out, std::string(name) + "_count", labels, snapshot.count);
+    }
+
+private:
+    std::atomic<bool> _enabled = false;
+
+    mutable std::mutex _mutex;
+    std::vector<std::unique_ptr<Shard>> _shards;
+    std::vector<RouteName> _routes;
+    std::vector<Gauge> _gauges;
+    std::uint64_t _next_gauge = 0;
+};
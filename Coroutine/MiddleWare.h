@@ -6,8 +6,14 @@
 #include <boost/beast/http/message.hpp>
 
 #include <concepts>
+#include <functional>
+#include <list>
+#include <optional>
+#include <tuple>
+#include <utility>
 
 #include "Define.h"
+#include "Log.h"
 
 template <typename T>
 concept IMiddleWare = requires(T middleware, const Request& req, Status& code, std::string & err)
@@ -15,6 +21,16 @@ concept IMiddleWare = requires(T middleware, const Request& req, Status& code, s
     { middleware.HandleRequest(req, code, err) } -> std::convertible_to<boost::asio::awaitable<bool>>;
 };
 
+/// <summary>
+/// A middleware that never suspends can also expose its check as a plain function
+/// Pipelines call it inline instead of allocating a coroutine frame for it
+/// </summary>
+template <typename T>
+concept ISyncMiddleWare = IMiddleWare<T> && requires(T middleware, const Request& req, Status& code, std::string & err)
+{
+    { middleware.Check(req, code, err) } -> std::convertible_to<bool>;
+};
+
 /// <summary>
 /// Define a logger middleware
 /// </summary>
@@ -22,49 +38,128 @@ class LoggingMiddleWare
 {
 public:
     boost::asio::awaitable<bool> HandleRequest(const Request& req, Status& code, std::string& err)
+    {
+        co_return Check(req, code, err);
+    }
+
+    bool Check(const Request& req, Status& /*code*/, std::string& /*err*/)
     {
         const Body& body = req.get().body();
 
-        std::cout << "Received request on:\n" << req.get().method() << " " << req.get().target() << "\n";
+        Log::Info("Received request on: {} {}", req.get().method_string(), req.get().target());
+
+        // headers and body only at trace level, they are not even walked otherwise
+        if (Log::Level() > LogLevel::Trace)
+            return true;
 
         for (auto& header : req.get())
         {
-            std::cout << header.name_string() << " : " << header.value() << "\n";
+            Log::Trace("{} : {}", header.name_string(), header.value());
         }
         if (!body.empty())
-            std::cout << "Body:\n" << std::string(body.begin(), body.end()) << "\n";
+            Log::Trace("Body: {}", std::string_view(body.data(), body.size()));
 
-        co_return true;
+        return true;
     }
 };
 
 /// <summary>
-/// Define a token like middleware (Bearer)
+/// Middlewares registered at runtime, each one is type erased and awaited in order
 /// </summary>
-class TokenAuthMiddleWare
+class MiddleWareList
 {
+    using StoredMiddleware = std::function<boost::asio::awaitable<bool>(const Request& req, Status& code, std::string& err)>;
 public:
+    template <IMiddleWare T>
+    void Add(T& middleware)
+    {
+        _middleware.push_back([&middleware](const Request& req, Status& code, std::string& err) {
+            return middleware.HandleRequest(req, code, err);
+        });
+    }
+
     boost::asio::awaitable<bool> HandleRequest(const Request& req, Status& code, std::string& err)
     {
-        // up to you to handle tokens or whatever as you wish to (database etc)
-        std::list<std::string> tokens = {
-            "Bearer toto"
-        };
+        for (auto& middleware : _middleware)
+        {
+            if (!co_await middleware(req, code, err))
+                co_return false;
+        }
+        co_return true;
+    }
+
+private:
+    std::list<StoredMiddleware> _middleware;
+};
+
+/// <summary>
+/// Middlewares composed at compile time, run in declaration order until the first failure
+/// Synchronous middlewares are called inline, only the asynchronous ones are co_awaited
+/// When every middleware is synchronous the pipeline is synchronous too and costs no coroutine frame
+/// </summary>
+template <IMiddleWare... Ts>
+class Pipeline
+{
+public:
+    Pipeline() = default;
+
+    explicit Pipeline(Ts... middlewares)
+        : _middlewares{ std::forward<Ts>(middlewares)... }
+    {
+    }
 
-        code = Status::unauthorized;
-        err = "\"Invalid authentification\"";
+    template <typename T>
+    T& Get()
+    {
+        return std::get<T>(_middlewares);
+    }
 
-        const auto& auth = req.get().find("Authorization");
-        if (auth != req.get().end())
+    boost::asio::awaitable<bool> HandleRequest(const Request& req, Status& code, std::string& err)
+    {
+        if constexpr ((ISyncMiddleWare<Ts> && ...))
+        {
+            co_return Check(req, code, err);
+        }
+        else
         {
-            if (tokens.end() == std::find(tokens.begin(), tokens.end(), auth->value()))
+            for (std::size_t i = 0; i < sizeof...(Ts); ++i)
             {
-                co_return false;
+                bool success = true;
+                std::optional<boost::asio::awaitable<bool>> pending;
+                Step(std::index_sequence_for<Ts...>{}, i, req, code, err, success, pending);
+
+                if (pending)
+                    success = co_await std::move(*pending);
+                if (!success)
+                    co_return false;
             }
+            co_return true;
         }
-        else
-            co_return false;
+    }
 
-        co_return true;
+    bool Check(const Request& req, Status& code, std::string& err) requires (ISyncMiddleWare<Ts> && ...)
+    {
+        return std::apply([&](auto&... middleware) { return (middleware.Check(req, code, err) && ...); }, _middlewares);
+    }
+
+private:
+    // run the synchronous middleware at index i inline or hand back the awaitable of an asynchronous one
+    template <std::size_t... Is>
+    void Step(std::index_sequence<Is...>, std::size_t i, const Request& req, Status& code, std::string& err, bool& success, std::optional<boost::asio::awaitable<bool>>& pending)
+    {
+        ((i == Is ? (StepAt<Is>(req, code, err, success, pending), 0) : 0), ...);
+    }
+
+    template <std::size_t I>
+    void StepAt(const Request& req, Status& code, std::string& err, bool& success, std::optional<boost::asio::awaitable<bool>>& pending)
+    {
+        auto& middleware = std::get<I>(_middlewares);
+        if constexpr (ISyncMiddleWare<std::tuple_element_t<I, std::tuple<Ts...>>>)
+            success = middleware.Check(req, code, err);
+        else
+            pending.emplace(middleware.HandleRequest(req, code, err));
     }
+
+private:
+    std::tuple<Ts...> _middlewares;
 };
\ No newline at end of file
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <array>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Define.h"
+#include "Uri.h"
+
+/// <summary>
+/// Query string parameters of a request target
+/// Nothing is done until a parameter is read: the query is then split once into a flat array of key/value views
+/// into the target, kept inline for the first InlineParams pairs
+/// Values are percent-decoded when read through Get(), and only those holding an escape are copied (once) into a
+/// buffer drawn from the given memory resource, Raw() gives the undecoded view
+/// Views returned stay valid as long as the target and the QueryParams
+/// </summary>
+class QueryParams
+{
+public:
+    static constexpr std::size_t InlineParams = 16;
+
+    explicit QueryParams(std::string_view target, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : _overflow{ resource }
+        , _decoded{ resource }
+    {
+        // a target starting with "//" is read as an authority and may hold an invalid port, its query is then ignored
+        try
+        {
+            _query = uri(target).query();
+        }
+        catch (const std::exception&)
+        {
+        }
+        if (!_query.empty())
+            _query.remove_prefix(1);
+    }
+
+    explicit QueryParams(const Request& req, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : QueryParams(std::string_view(req.get().target()), resource)
+    {
+    }
+
+    QueryParams(const QueryParams&) = delete;
+    QueryParams& operator=(const QueryParams&) = delete;
+
+    /// <summary>
+    /// Decoded value of the first parameter named name, nullopt if there is none
+    /// </summary>
+    std::optional<std::string_view> Get(std::string_view name) const
+    {
+        Entry* entry = Find(name);
+        if (!entry)
+            return std::nullopt;
+
+        if (!entry->decoded)
+        {
+            entry->value = Decode(entry->value);
+            entry->decoded = true;
+        }
+        return entry->value;
+    }
+
+    /// <summary>
+    /// Value of the first parameter named name as sent, nullopt if there is none
+    /// </summary>
+    std::optional<std::string_view> Raw(std::string_view name) const
+    {
+        if (const Entry* entry = Find(name))
+            return entry->raw;
+        return std::nullopt;
+    }
+
+    bool Has(std::string_view name) const
+    {
+        return Find(name) != nullptr;
+    }
+
+    /// <summary>
+    /// Number of parameters, splits the query
+    /// </summary>
+    std::size_t Size() const
+    {
+        Split();
+        return _size;
+    }
+
+    std::string_view Query() const { return _query; }
+
+private:
+    struct Entry
+    {
+        std::string_view key;
+        std::string_view raw;
+        std::string_view value;
+        bool decoded = false;
+    };
+
+    Entry& At(std::size_t i) const
+    {
+        return i < InlineParams ? _inline[i] : _overflow[i - InlineParams];
+    }
+
+    Entry* Find(std::string_view name) const
+    {
+        Split();
+        for (std::size_t i = 0; i < _size; ++i)
+        {
+            Entry& entry = At(i);
+            if (entry.key == name)
+                return &entry;
+        }
+        return nullptr;
+    }
+
+    std::string_view Decode(std::string_view value) const
+    {
+        if (!uri::needs_decode(value))
+            return value;
+
+        // every key and value is decoded at most once and never grows, reserving the query size on the first
+        // copy keeps the views already handed out valid
+        if (_decoded.capacity() < _query.size())
+            _decoded.reserve(_query.size());
+        return uri::decode(value, _decoded);
+    }
+
+    void Split() const
+    {
+        if (_split)
+            return;
+        _split = true;
+
+        for (std::string_view rest = _query; !rest.empty();)
+        {
+            const auto amp = rest.find('&');
+            const std::string_view pair = rest.substr(0, amp);
+            rest = amp == std::string_view::npos ? std::string_view{} : rest.substr(amp + 1);
+            if (pair.empty())
+                continue;
+
+            const auto eq = pair.find('=');
+            Entry entry;
+            entry.key = Decode(pair.substr(0, eq));
+            entry.raw = entry.value = eq == std::string_view::npos ? std::string_view{} : pair.substr(eq + 1);
+
+            if (_size < InlineParams)
+                _inline[_size] = entry;
+            else
+                _overflow.push_back(entry);
+            ++_size;
+        }
+    }
+
+private:
+    std::string_view _query;
+    mutable std::array<Entry, InlineParams> _inline{};
+    mutable std::pmr::vector<Entry> _overflow;
+    mutable std::pmr::string _decoded;
+    mutable std::size_t _size = 0;
+    mutable bool _split = false;
+};
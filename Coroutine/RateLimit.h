@@ -0,0 +1,260 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/beast.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "Define.h"
+
+/// <summary>
+/// How fast a client may send requests
+/// </summary>
+struct RateLimitPolicy
+{
+    enum class Key
+    {
+        // the address of the connection, or the first X-Forwarded-For entry when trust_forwarded is set
+        ClientIp,
+        // the Authorization header, the client ip when missing
+        Token
+    };
+
+    Key key = Key::ClientIp;
+
+    // requests per second refilled in each bucket
+    double rate = 1000;
+
+    // requests a client may send at once after an idle period
+    std::size_t burst = 2000;
+
+    // only behind a proxy that sets the header, otherwise any client chooses its own key
+    bool trust_forwarded = false;
+
+    // buckets kept, a key that does not find a slot is let through (and counted) rather than refused
+    std::size_t max_keys = 1 << 16;
+};
+
+/// <summary>
+/// Token buckets keyed by client, without any lock
+/// A bucket is one atomic word: the time at which it will be full again (generic cell rate algorithm), each
+/// request pushes it one interval further, which is the token bucket refill and take done by a single CAS. A
+/// bucket whose time is past is full, so idle keys need no sweep: their slot is taken over by the next new key
+/// probing it (lazy expiry)
+/// The keys are stored as 64 bits hashes in open addressing shards, a lookup neither locks nor allocates
+/// </summary>
+class RateLimiter
+{
+public:
+    static constexpr std::size_t ShardCount = 16;
+    static constexpr std::size_t Probes = 8;
+
+    struct Stats
+    {
+        std::atomic<std::size_t> admitted = 0;
+        std::atomic<std::size_t> limited = 0;
+        std::atomic<std::size_t> overflow = 0;
+    };
+
+    explicit RateLimiter(RateLimitPolicy policy = {})
+        : _policy{ policy }
+        , _interval{ static_cast<std::int64_t>(1e9 / std::max(policy.rate, 1e-3)) }
+        , _tolerance{ _interval * static_cast<std::int64_t>(std::max<std::size_t>(policy.burst, 1) - 1) }
+        , _state{ std::make_unique<State>() }
+    {
+        std::size_t slots = Probes;
+        while (slots * ShardCount < policy.max_keys)
+            slots *= 2;
+        _mask = slots - 1;
+        for (auto& shard : _state->shards)
+            shard.slots = std::make_unique<Slot[]>(slots);
+    }
+
+    RateLimiter(RateLimiter&&) = default;
+    RateLimiter& operator=(RateLimiter&&) = default;
+
+    /// <summary>
+    /// Take one token from the bucket of key, 0 when admitted, otherwise the seconds to wait for the next one
+    /// </summary>
+    std::uint32_t Acquire(std::string_view key)
+    {
+        return Acquire(key, Now());
+    }
+
+    /// <param name="now">nanoseconds on a monotonic clock</param>
+    std::uint32_t Acquire(std::string_view key, std::int64_t now)
+    {
+        Slot* slot = Find(std::hash<std::string_view>{}(key), now);
+        if (!slot)
+        {
+            ++_state->stats.overflow;
+            return 0;
+        }
+
+        std::int64_t full = slot->full.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            const std::int64_t next = std::max(full, now) + _interval;
+            if (next - now > _tolerance + _interval)
+            {
+                ++_state->stats.limited;
+                const std::int64_t wait = next - now - _tolerance - _interval;
+                return static_cast<std::uint32_t>(std::max<std::int64_t>(1, (wait + 999'999'999) / 1'000'000'000));
+            }
+            if (slot->full.compare_exchange_weak(full, next, std::memory_order_relaxed))
+                break;
+        }
+        ++_state->stats.admitted;
+        return 0;
+    }
+
+    const RateLimitPolicy& GetPolicy() const
+    {
+        return _policy;
+    }
+
+    const Stats& GetStats() const
+    {
+        return _state->stats;
+    }
+
+    static std::int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    // 0 marks a free slot, a key hashing to 0 is stored as 1
+    struct Slot
+    {
+        std::atomic<std::uint64_t> key = 0;
+        std::atomic<std::int64_t> full = 0;
+    };
+
+    // each shard is its own allocation, threads hitting different shards do not share cache lines
+    struct alignas(64) Shard
+    {
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    struct State
+    {
+        std::array<Shard, ShardCount> shards;
+        Stats stats;
+    };
+
+    Slot* Find(std::uint64_t hash, std::int64_t now)
+    {
+        hash = hash ? hash : 1;
+        Shard& shard = _state->shards[(hash >> 56) % ShardCount];
+
+        // a bucket full again holds nothing worth keeping: its slot can be reused
+        const std::int64_t idle = now;
+        Slot* reusable = nullptr;
+        for (std::size_t i = 0; i < Probes; ++i)
+        {
+            Slot& slot = shard.slots[(hash + i) & _mask];
+            std::uint64_t key = slot.key.load(std::memory_order_acquire);
+            if (key == hash)
+                return &slot;
+            if (key == 0)
+            {
+                if (slot.key.compare_exchange_strong(key, hash, std::memory_order_acq_rel) || key == hash)
+                    return &slot;
+                continue;
+            }
+            if (!reusable && slot.full.load(std::memory_order_relaxed) <= idle)
+                reusable = &slot;
+        }
+
+        // the time of an expired bucket is in the past, the new key starts with a full bucket without resetting it
+        if (reusable)
+        {
+            std::uint64_t key = reusable->key.load(std::memory_order_relaxed);
+            if (reusable->full.load(std::memory_order_relaxed) <= idle && reusable->key.compare_exchange_strong(key, hash, std::memory_order_acq_rel))
+                return reusable;
+            if (key == hash)
+                return reusable;
+        }
+        return nullptr;
+    }
+
+private:
+    RateLimitPolicy _policy;
+    std::int64_t _interval;
+    std::int64_t _tolerance;
+    std::size_t _mask = 0;
+    std::unique_ptr<State> _state;
+};
+
+/// <summary>
+/// Admission control: a client over its rate is answered 429 with Retry-After before any route runs
+/// Never suspends, a sync middleware called inline by Pipeline
+/// </summary>
+class RateLimitMiddleWare
+{
+public:
+    RateLimitMiddleWare() = default;
+
+    explicit RateLimitMiddleWare(RateLimitPolicy policy)
+        : _limiter{ policy }
+    {
+    }
+
+    bool Check(const Request& req, Status& code, std::string& err)
+    {
+        const std::uint32_t wait = _limiter.Acquire(KeyOf(req));
+        if (wait == 0)
+            return true;
+
+        Context(req).retry_after = wait;
+        code = Status::too_many_requests;
+        err = "\"Too many requests\"";
+        return false;
+    }
+
+    boost::asio::awaitable<bool> HandleRequest(const Request& req, Status& code, std::string& err)
+    {
+        co_return Check(req, code, err);
+    }
+
+    RateLimiter& Limiter()
+    {
+        return _limiter;
+    }
+
+    std::string_view KeyOf(const Request& req) const
+    {
+        const auto& header = req.get();
+        if (_limiter.GetPolicy().key == RateLimitPolicy::Key::Token)
+        {
+            if (const auto auth = header.find(boost::beast::http::field::authorization); auth != header.end())
+                return std::string_view(auth->value().data(), auth->value().size());
+        }
+
+        if (_limiter.GetPolicy().trust_forwarded)
+        {
+            if (const auto forwarded = header.find("X-Forwarded-For"); forwarded != header.end())
+            {
+                std::string_view value(forwarded->value().data(), forwarded->value().size());
+                value = value.substr(0, value.find(','));
+                while (!value.empty() && value.back() == ' ')
+                    value.remove_suffix(1);
+                if (!value.empty())
+                    return value;
+            }
+        }
+        return Context(req).peer;
+    }
+
+private:
+    RateLimiter _limiter;
+};
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <boost/beast.hpp>
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "Define.h"
+#include "HttpDate.h"
+
+/// <summary>
+/// Header lines sent as they are, formatted once at compile time
+/// </summary>
+namespace HeaderLines
+{
+    inline constexpr std::string_view Server = "Server: " BOOST_BEAST_VERSION_STRING "\r\n";
+    inline constexpr std::string_view ContentTypeJson = "Content-Type: application/json\r\n";
+    inline constexpr std::string_view ContentTypeText = "Content-Type: text/plain\r\n";
+    inline constexpr std::string_view ContentTypeHtml = "Content-Type: text/html\r\n";
+    inline constexpr std::string_view ConnectionClose = "Connection: close\r\n";
+    inline constexpr std::string_view ConnectionKeepAlive = "Connection: keep-alive\r\n";
+}
+
+/// <summary>
+/// Common part of the Fields types holding a response already serialized (header and body)
+/// The beast serializer only asks the writer of the derived type for the bytes, the setters are no-ops
+/// </summary>
+class SerializedFieldsBase
+{
+protected:
+    boost::beast::string_view get_method_impl() const { return {}; }
+    boost::beast::string_view get_target_impl() const { return {}; }
+    boost::beast::string_view get_reason_impl() const { return {}; }
+    bool get_chunked_impl() const { return false; }
+    bool get_keep_alive_impl(unsigned /*version*/) const { return _keep_alive; }
+    bool has_content_length_impl() const { return true; }
+
+    void set_method_impl(boost::beast::string_view) {}
+    void set_target_impl(boost::beast::string_view) {}
+    void set_reason_impl(boost::beast::string_view) {}
+    void set_chunked_impl(bool) {}
+    void set_content_length_impl(const boost::optional<std::uint64_t>&) {}
+    void set_keep_alive_impl(unsigned, bool) {}
+
+    bool _keep_alive = true;
+};
+
+/// <summary>
+/// Fields owning the bytes of a response built by ResponseBuilder, allocated from the arena of its request when
+/// the builder was given it
+/// </summary>
+class SerializedFields : public SerializedFieldsBase
+{
+public:
+    SerializedFields() = default;
+
+    SerializedFields(std::pmr::string bytes, bool keep_alive)
+        : _bytes{ std::move(bytes) }
+    {
+        _keep_alive = keep_alive;
+    }
+
+    class writer
+    {
+    public:
+        using const_buffers_type = boost::asio::const_buffer;
+
+        writer(const SerializedFields& fields, unsigned /*version*/, unsigned /*code*/)
+            : _buffer{ boost::asio::buffer(fields._bytes) }
+        {
+        }
+
+        const_buffers_type get() const
+        {
+            return _buffer;
+        }
+
+    private:
+        boost::asio::const_buffer _buffer;
+    };
+
+private:
+    std::pmr::string _bytes;
+};
+
+/// <summary>
+/// Fields of a response whose body is not copied: the header is owned, the body is a view on bytes kept alive by
+/// owner (a mapped file, see StaticFiles) and both are handed to the write as they are
+/// </summary>
+class SharedBodyFields : public SerializedFieldsBase
+{
+public:
+    SharedBodyFields() = default;
+
+    SharedBodyFields(std::pmr::string header, std::string_view body, std::shared_ptr<const void> owner, bool keep_alive)
+        : _header{ std::move(header) }
+        , _body{ body }
+        , _owner{ std::move(owner) }
+    {
+        _keep_alive = keep_alive;
+    }
+
+    class writer
+    {
+    public:
+        using const_buffers_type = std::array<boost::asio::const_buffer, 2>;
+
+        writer(const SharedBodyFields& fields, unsigned /*version*/, unsigned /*code*/)
+            : _buffers{ boost::asio::buffer(fields._header), boost::asio::buffer(fields._body.data(), fields._body.size()) }
+        {
+        }
+
+        const_buffers_type get() const
+        {
+            return _buffers;
+        }
+
+    private:
+        const_buffers_type _buffers;
+    };
+
+private:
+    std::pmr::string _header;
+    std::string_view _body;
+    std::shared_ptr<const void> _owner;
+};
+
+/// <summary>
+/// Append the wire form of response to out (a std::string or std::pmr::string), consuming it
+/// </summary>
+template <typename String>
+bool SerializeResponse(Response& response, String& out)
+{
+    while (!response.is_done())
+    {
+        boost::beast::error_code ec;
+        const auto chunk = response.prepare(ec);
+        if (ec)
+            return false;
+
+        std::size_t size = 0;
+        for (const auto& b : chunk)
+        {
+            out.append(static_cast<const char*>(b.data()), b.size());
+            size += b.size();
+        }
+        response.consume(size);
+    }
+    return true;
+}
+
+template <typename String>
+bool SerializeResponse(Response&& response, String& out)
+{
+    return SerializeResponse(response, out);
+}
+
+/// <summary>
+/// Status code of response read from its status line, 0 if it cannot be read
+/// The first buffers are prepared without being consumed: the response is still written whole afterwards
+/// </summary>
+inline unsigned PeekStatus(Response& response)
+{
+    boost::beast::error_code ec;
+    const auto chunk = response.prepare(ec);
+    if (ec)
+        return 0;
+
+    // "HTTP/1.1 200 ", the status line comes first in one buffer
+    for (const auto& b : chunk)
+    {
+        const std::string_view line(static_cast<const char*>(b.data()), b.size());
+        if (line.size() < 12 || line.substr(0, 5) != "HTTP/")
+            return 0;
+        unsigned status = 0;
+        for (const char c : line.substr(9, 3))
+        {
+            if (c < '0' || c > '9')
+                return 0;
+            status = status * 10 + (c - '0');
+        }
+        return status;
+    }
+    return 0;
+}
+
+/// <summary>
+/// Append the header of response to out, status line to the blank line included, false if it cannot be read
+/// Like PeekStatus the first buffers are prepared without being consumed, the body is neither copied nor serialized
+/// </summary>
+template <typename String>
+bool PeekHeader(Response& response, String& out)
+{
+    boost::beast::error_code ec;
+    const auto chunk = response.prepare(ec);
+    if (ec)
+        return false;
+
+    // the header comes whole in the first buffers, stop at the "\r\n\r\n" closing it even across two of them
+    constexpr std::string_view end = "\r\n\r\n";
+    std::size_t matched = 0;
+    for (const auto& b : chunk)
+    {
+        const std::string_view data(static_cast<const char*>(b.data()), b.size());
+        for (std::size_t i = 0; i < data.size(); ++i)
+        {
+            matched = data[i] == end[matched] ? matched + 1 : (data[i] == end[0] ? 1 : 0);
+            if (matched == end.size())
+            {
+                out.append(data.substr(0, i + 1));
+                return true;
+            }
+        }
+        out.append(data);
+    }
+    return false;
+}
+
+/// <summary>
+/// Response serialized straight to its wire form
+/// The status line and header lines are appended to a fixed buffer on the stack, Body() then allocates the
+/// response once at its final size and copies header and body in it: no field container, no allocation per field
+/// Server and Date are always sent, Date comes from the DateCache, Connection follows keep_alive and the version
+/// Given the allocator of the request (req.get().get_allocator()), the bytes come from its arena: they are released
+/// with it once the response is written and a keep-alive request does not reach the global heap for them
+/// </summary>
+class ResponseBuilder
+{
+public:
+    static constexpr std::size_t MaxHeaderSize = 2048;
+
+    ResponseBuilder(Status status, unsigned version, bool keep_alive, Allocator allocator = {})
+        : _status{ status }
+        , _keep_alive{ keep_alive }
+        , _allocator{ allocator }
+    {
+        Append(version == 10 ? "HTTP/1.0 " : "HTTP/1.1 ");
+        Number(static_cast<unsigned>(status));
+        Append(" ");
+        const auto reason = boost::beast::http::obsolete_reason(status);
+        Append(std::string_view(reason.data(), reason.size()));
+        Append("\r\n");
+
+        Append(HeaderLines::Server);
+        Append("Date: ");
+        Append(DateCache::Get());
+        Append("\r\n");
+
+        if (version == 10 && keep_alive)
+            Append(HeaderLines::ConnectionKeepAlive);
+        else if (version != 10 && !keep_alive)
+            Append(HeaderLines::ConnectionClose);
+    }
+
+    /// <summary>
+    /// Append a complete header line, see HeaderLines
+    /// </summary>
+    ResponseBuilder& Line(std::string_view line)
+    {
+        Append(line);
+        return *this;
+    }
+
+    ResponseBuilder& Field(std::string_view name, std::string_view value)
+    {
+        Append(name);
+        Append(": ");
+        Append(value);
+        Append("\r\n");
+        return *this;
+    }
+
+    ResponseBuilder& Field(boost::beast::http::field name, std::string_view value)
+    {
+        const auto text = boost::beast::http::to_string(name);
+        return Field(std::string_view(text.data(), text.size()), value);
+    }
+
+    /// <summary>
+    /// Finish the header with Content-Length (unless the status has no body) and append the body
+    /// </summary>
+    Response Body(std::string_view body)
+    {
+        if (!Finish(body.size()))
+            body = {};
+
+        std::pmr::string bytes(_allocator);
+        bytes.reserve(_size + body.size());
+        bytes.append(_header.data(), _size);
+        bytes.append(body);
+        return boost::beast::http::message<false, boost::beast::http::empty_body, SerializedFields>{ std::piecewise_construct, std::make_tuple(), std::make_tuple(std::move(bytes), _keep_alive) };
+    }
+
+    /// <summary>
+    /// Finish the header and send body without copying it, owner keeps the bytes alive until they are written
+    /// </summary>
+    Response Body(std::string_view body, std::shared_ptr<const void> owner)
+    {
+        if (!Finish(body.size()))
+            body = {};
+        return boost::beast::http::message<false, boost::beast::http::empty_body, SharedBodyFields>{ std::piecewise_construct, std::make_tuple(), std::make_tuple(std::pmr::string(_header.data(), _size, _allocator), body, std::move(owner), _keep_alive) };
+    }
+
+    /// <summary>
+    /// Finish the header with Content-Length content_length and send it alone, the body goes apart: answer to a
+    /// HEAD request, or a file the server sends itself (see FileRange)
+    /// </summary>
+    Response Header(std::uint64_t content_length)
+    {
+        Finish(content_length);
+        return boost::beast::http::message<false, boost::beast::http::empty_body, SerializedFields>{ std::piecewise_construct, std::make_tuple(), std::make_tuple(std::pmr::string(_header.data(), _size, _allocator), _keep_alive) };
+    }
+
+    /// <summary>
+    /// Finish the header of a body whose length is not known yet and send it alone, the body is written after it
+    /// by the server (see ResponseStream): chunked, or up to the connection close when chunked is false (HTTP/1.0)
+    /// </summary>
+    Response Streamed(bool chunked)
+    {
+        if (chunked)
+            Append("Transfer-Encoding: chunked\r\n");
+        Append("\r\n");
+        return boost::beast::http::message<false, boost::beast::http::empty_body, SerializedFields>{ std::piecewise_construct, std::make_tuple(), std::make_tuple(std::pmr::string(_header.data(), _size, _allocator), _keep_alive) };
+    }
+
+private:
+    // Content-Length unless the status has no body, then the blank line; false when the status has no body
+    bool Finish(std::uint64_t content_length)
+    {
+        const auto code = static_cast<unsigned>(_status);
+        const bool body = code >= 200 && code != 204 && code != 304;
+        if (body)
+        {
+            Append("Content-Length: ");
+            Number(content_length);
+            Append("\r\n");
+        }
+        Append("\r\n");
+        return body;
+    }
+
+    void Append(std::string_view text)
+    {
+        if (text.size() > _header.size() - _size)
+            throw std::length_error("ResponseBuilder: header larger than MaxHeaderSize");
+        std::memcpy(_header.data() + _size, text.data(), text.size());
+        _size += text.size();
+    }
+
+    void Number(std::uint64_t value)
+    {
+        char digits[20];
+        const auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        Append(std::string_view(digits, static_cast<std::size_t>(result.ptr - digits)));
+    }
+
+private:
+    Status _status;
+    bool _keep_alive;
+    Allocator _allocator;
+    std::array<char, MaxHeaderSize> _header;
+    std::size_t _size = 0;
+};
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <boost/beast.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "Define.h"
+#include "Compression.h"
+#include "HttpDate.h"
+#include "ResponseBuilder.h"
+
+/// <summary>
+/// How a route caches its GET responses
+/// </summary>
+struct CachePolicy
+{
+    // a stored response is served for ttl, zero means the route is not cached
+    std::chrono::steady_clock::duration ttl{};
+};
+
+/// <summary>
+/// A response serialized once, header and body, shared with the writes still sending it
+/// The Date value is left as it was when stored, the current one is written over it each time the bytes are sent
+/// </summary>
+struct CachedResponse
+{
+    struct Variant
+    {
+        // 200 response carrying its ETag
+        std::string bytes;
+        // 304 sent instead when If-None-Match holds the ETag
+        std::string not_modified;
+        std::string etag;
+        // offsets of the Date values in bytes and not_modified, npos when there is none
+        std::size_t date = std::string::npos;
+        std::size_t not_modified_date = std::string::npos;
+    };
+
+    // one variant per content encoding, identity is built when the response is stored and the compressed ones
+    // once, on the first request accepting them (left empty when the body does not qualify)
+    mutable std::array<Variant, ContentEncodingCount> variants;
+    mutable std::array<std::once_flag, ContentEncodingCount> built;
+
+    bool keep_alive = true;
+    std::chrono::steady_clock::time_point expires;
+    std::uint64_t version = 0;
+
+    const Variant& Identity() const
+    {
+        return variants[static_cast<std::size_t>(ContentEncoding::Identity)];
+    }
+};
+
+/// <summary>
+/// Fields of a response served from the cache, the writer hands out bytes of the shared entry
+/// </summary>
+class CachedFields : public SerializedFieldsBase
+{
+public:
+    CachedFields() = default;
+
+    CachedFields(std::shared_ptr<const CachedResponse> response, std::string_view bytes, std::size_t date)
+        : _response{ std::move(response) }
+        , _bytes{ bytes }
+        , _date_offset{ date }
+    {
+        _keep_alive = _response->keep_alive;
+        if (_date_offset != std::string::npos)
+        {
+            const auto now = DateCache::Get();
+            std::copy(now.begin(), now.end(), _date.begin());
+        }
+    }
+
+    class writer
+    {
+    public:
+        using const_buffers_type = std::array<boost::asio::const_buffer, 3>;
+
+        // the stored bytes around their Date value, and the current date in between
+        writer(const CachedFields& fields, unsigned /*version*/, unsigned /*code*/)
+        {
+            const std::string_view bytes = fields._bytes;
+            if (fields._date_offset == std::string::npos)
+            {
+                _buffers[0] = boost::asio::buffer(bytes.data(), bytes.size());
+                return;
+            }
+            const std::string_view after = bytes.substr(fields._date_offset + HttpDate::Size);
+            _buffers[0] = boost::asio::buffer(bytes.data(), fields._date_offset);
+            _buffers[1] = boost::asio::buffer(fields._date);
+            _buffers[2] = boost::asio::buffer(after.data(), after.size());
+        }
+
+        const_buffers_type get() const
+        {
+            return _buffers;
+        }
+
+    private:
+        const_buffers_type _buffers;
+    };
+
+private:
+    std::shared_ptr<const CachedResponse> _response;
+    std::string_view _bytes;
+    std::size_t _date_offset = std::string::npos;
+    std::array<char, HttpDate::Size> _date{};
+};
+
+/// <summary>
+/// Serialized responses of the cached routes keyed by request target
+/// A hit is answered from bytes built once: no field is formatted and no body is copied into a message
+/// Entries expire after their route ttl, Invalidate() drops one target or, by bumping the version, all of them
+/// at once; compressed variants are built once per entry and encoding; the total size is bounded and the least recently used entries are evicted first
+/// Thread safe: the table is guarded by a mutex, entries are immutable and shared with the writes in flight
+/// </summary>
+class ResponseCache
+{
+public:
+    struct Stats
+    {
+        std::atomic<std::size_t> hits = 0;
+        std::atomic<std::size_t> misses = 0;
+        std::atomic<std::size_t> not_modified = 0;
+        std::atomic<std::size_t> evicted = 0;
+    };
+
+    explicit ResponseCache(std::size_t max_bytes = 16 * 1024 * 1024)
+        : _max_bytes{ max_bytes }
+    {
+    }
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    /// <summary>
+    /// Response stored for target, null when missing, expired or invalidated
+    /// </summary>
+    std::shared_ptr<const CachedResponse> Find(std::string_view target)
+    {
+        std::lock_guard lock(_mutex);
+        const auto it = _index.find(target);
+        if (it == _index.end())
+        {
+            ++_stats.misses;
+            return nullptr;
+        }
+
+        const auto& entry = *it->second;
+        if (entry.response->version != _version || entry.response->expires <= std::chrono::steady_clock::now())
+        {
+            Erase(it->second);
+            ++_stats.misses;
+            return nullptr;
+        }
+
+        _lru.splice(_lru.begin(), _lru, it->second);
+        ++_stats.hits;
+        return entry.response;
+    }
+
+    /// <summary>
+    /// Serialize response and keep it for target when it is a keep-alive 200 that fits the bound
+    /// version is the Version() read before the response was produced, so a response racing with an
+    /// invalidation is never stored
+    /// The returned entry is the one to send, stored or not: response is consumed
+    /// </summary>
+    std::shared_ptr<const CachedResponse> Store(std::string_view target, boost::beast::http::message_generator& response, std::chrono::steady_clock::duration ttl, std::uint64_t version)
+    {
+        auto cached = std::make_shared<CachedResponse>();
+        auto& identity = cached->variants[static_cast<std::size_t>(ContentEncoding::Identity)];
+        cached->keep_alive = response.keep_alive();
+        if (!SerializeResponse(response, identity.bytes))
+            throw std::runtime_error("ResponseCache: unable to serialize the response");
+
+        const auto header_end = identity.bytes.find("\r\n\r\n");
+        if (!cached->keep_alive || header_end == std::string::npos || !identity.bytes.starts_with("HTTP/1.1 200 "))
+            return cached;
+
+        // the ETag is derived from the body and inserted as the last field
+        char etag[24];
+        std::snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(Hash(std::string_view(identity.bytes).substr(header_end + 4))));
+        identity.etag = etag;
+        identity.bytes.insert(header_end + 2, "ETag: " + identity.etag + "\r\n");
+        identity.not_modified = NotModified(identity.etag);
+        identity.date = DateOffset(identity.bytes);
+        identity.not_modified_date = DateOffset(identity.not_modified);
+        cached->expires = std::chrono::steady_clock::now() + ttl;
+        cached->version = version;
+
+        const std::size_t size = Size(target, *cached);
+        if (size > _max_bytes)
+            return cached;
+
+        std::lock_guard lock(_mutex);
+        if (version != _version)
+            return cached;
+
+        if (const auto it = _index.find(target); it != _index.end())
+            Erase(it->second);
+
+        _lru.push_front(Entry{ std::string(target), cached, size });
+        _index.emplace(_lru.front().target, _lru.begin());
+        _bytes += size;
+
+        while (_bytes > _max_bytes)
+        {
+            Erase(std::prev(_lru.end()));
+            ++_stats.evicted;
+        }
+        return cached;
+    }
+
+    /// <summary>
+    /// Response to send for a cached entry, a 304 when the request If-None-Match holds its ETag
+    /// With a compressor, the variant of the encoding the request accepts is sent, compressed on its first use
+    /// </summary>
+    Response Serve(std::shared_ptr<const CachedResponse> cached, const Request& req, const ResponseCompressor* compressor = nullptr)
+    {
+        const CachedResponse::Variant* variant = &cached->Identity();
+        if (compressor && !variant->etag.empty())
+        {
+            const ContentEncoding encoding = ResponseCompressor::Negotiate(req);
+            const auto index = static_cast<std::size_t>(encoding);
+            if (encoding != ContentEncoding::Identity)
+            {
+                std::call_once(cached->built[index], [&]()
+                {
+                    auto& encoded = cached->variants[index];
+                    if (auto bytes = compressor->Compress(variant->bytes, encoding))
+                    {
+                        encoded.bytes = std::move(*bytes);
+                        encoded.etag = ResponseCompressor::VariantETag(variant->etag, encoding);
+                        encoded.not_modified = NotModified(encoded.etag);
+                        encoded.date = DateOffset(encoded.bytes);
+                        encoded.not_modified_date = DateOffset(encoded.not_modified);
+                    }
+                });
+                if (!cached->variants[index].bytes.empty())
+                    variant = &cached->variants[index];
+            }
+        }
+
+        bool not_modified = false;
+        if (!variant->etag.empty())
+        {
+            const auto if_none_match = req.get()[boost::beast::http::field::if_none_match];
+            not_modified = if_none_match == "*" || if_none_match.find(variant->etag) != boost::beast::string_view::npos;
+        }
+        if (not_modified)
+            ++_stats.not_modified;
+
+        const std::string_view bytes = not_modified ? variant->not_modified : variant->bytes;
+        const std::size_t date = not_modified ? variant->not_modified_date : variant->date;
+        return boost::beast::http::message<false, boost::beast::http::empty_body, CachedFields>{ std::piecewise_construct, std::make_tuple(), std::make_tuple(std::move(cached), bytes, date) };
+    }
+
+    /// <summary>
+    /// Current version, to give back to Store()
+    /// </summary>
+    std::uint64_t Version() const
+    {
+        std::lock_guard lock(_mutex);
+        return _version;
+    }
+
+    /// <summary>
+    /// Drop the response stored for target
+    /// </summary>
+    void Invalidate(std::string_view target)
+    {
+        std::lock_guard lock(_mutex);
+        if (const auto it = _index.find(target); it != _index.end())
+            Erase(it->second);
+    }
+
+    /// <summary>
+    /// Drop every stored response, and the ones being produced with the former version
+    /// </summary>
+    void Invalidate()
+    {
+        std::lock_guard lock(_mutex);
+        ++_version;
+        _index.clear();
+        _lru.clear();
+        _bytes = 0;
+    }
+
+    std::size_t Bytes() const
+    {
+        std::lock_guard lock(_mutex);
+        return _bytes;
+    }
+
+    const Stats& GetStats() const
+    {
+        return _stats;
+    }
+
+private:
+    struct Entry
+    {
+        std::string target;
+        std::shared_ptr<const CachedResponse> response;
+        std::size_t size = 0;
+    };
+
+    using Lru = std::list<Entry>;
+
+    void Erase(Lru::iterator it)
+    {
+        _bytes -= it->size;
+        _index.erase(it->target);
+        _lru.erase(it);
+    }
+
+    // compressed variants are not accounted, they are smaller than the identity one they are built from
+    static std::size_t Size(std::string_view target, const CachedResponse& cached)
+    {
+        const auto& identity = cached.Identity();
+        return target.size() + identity.bytes.size() + identity.not_modified.size() + identity.etag.size() + sizeof(CachedResponse);
+    }
+
+    static std::string NotModified(std::string_view etag)
+    {
+        return "HTTP/1.1 304 Not Modified\r\n" + std::string(HeaderLines::Server) + "Date: " + std::string(DateCache::Get()) + "\r\nETag: " + std::string(etag) + "\r\n\r\n";
+    }
+
+    // offset of the Date value in the header of a serialized response
+    static std::size_t DateOffset(std::string_view bytes)
+    {
+        const auto header_end = bytes.find("\r\n\r\n");
+        const auto line = bytes.substr(0, header_end).find("\r\nDate: ");
+        if (line == std::string_view::npos || line + 8 + HttpDate::Size > header_end)
+            return std::string::npos;
+        return line + 8;
+    }
+
+    // FNV-1a
+    static std::uint64_t Hash(std::string_view data)
+    {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (const char c : data)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+private:
+    const std::size_t _max_bytes;
+
+    mutable std::mutex _mutex;
+    Lru _lru;
+    // keys are views on the targets held by the list nodes
+    std::unordered_map<std::string_view, Lru::iterator> _index;
+    std::size_t _bytes = 0;
+    std::uint64_t _version = 0;
+    Stats _stats;
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/beast.hpp>
+
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+
+#include "Define.h"
+#include "ResponseBuilder.h"
+
+/// <summary>
+/// Push based writer of a streamed response body, the counterpart of BodyStream
+/// A route answers with the header alone (Start, or Events for Server-Sent Events) and leaves a producer in the
+/// request context; the connection coroutine sends the header, then runs the producer which writes the body
+/// through this stream as it is produced: the first bytes leave as soon as they exist instead of once the whole
+/// body is built
+/// Write() gathers small pieces in one window and sends it as a chunk when it is full, Flush() sends it right away.
+/// Each send returns once the socket took the bytes: a client reading slowly suspends the producer (TCP
+/// backpressure) and the memory of a response is the window whatever its size
+/// A write error (client gone, timeout) is thrown out of the producer as boost::system::system_error
+/// </summary>
+class ResponseStream
+{
+public:
+    static constexpr std::size_t WindowSize = 16 * 1024;
+
+    /// <summary>
+    /// Header of a streamed response of content_type, the body is produced by producer once it is sent
+    /// HTTP/1.1 bodies are chunked, HTTP/1.0 ones end with the connection. A HEAD request gets the header only
+    /// </summary>
+    static Response Start(const Request& req, std::string_view content_type, StreamProducer producer)
+    {
+        ResponseBuilder builder(Status::ok, req.get().version(), Chunked(req) && req.get().keep_alive(), req.get().get_allocator());
+        builder.Field(boost::beast::http::field::content_type, content_type);
+        return Begin(req, builder, std::move(producer));
+    }
+
+    /// <summary>
+    /// Header of a Server-Sent Events stream (text/event-stream), the producer sends them with Event()
+    /// </summary>
+    static Response Events(const Request& req, StreamProducer producer)
+    {
+        ResponseBuilder builder(Status::ok, req.get().version(), Chunked(req) && req.get().keep_alive(), req.get().get_allocator());
+        builder.Line("Content-Type: text/event-stream\r\n")
+            .Line("Cache-Control: no-cache\r\n");
+        return Begin(req, builder, std::move(producer));
+    }
+
+    /// <summary>
+    /// Whether the body of the response to req is chunked, otherwise it is delimited by the connection close
+    /// </summary>
+    static bool Chunked(const Request& req)
+    {
+        return req.get().version() != 10;
+    }
+
+    template <typename Stream>
+    ResponseStream(Stream& stream, bool chunked, std::span<char> window, std::chrono::milliseconds write_timeout)
+        : _stream{ &stream }
+        , _write{ &ResponseStream::WriteSome<Stream> }
+        , _chunked{ chunked }
+        , _window{ window }
+        , _write_timeout{ write_timeout }
+    {
+    }
+
+    ResponseStream(const ResponseStream&) = delete;
+    ResponseStream& operator=(const ResponseStream&) = delete;
+
+    /// <summary>
+    /// Append data to the body, sent once the window is full; data larger than the window goes out in its own chunk
+    /// without being copied
+    /// </summary>
+    boost::asio::awaitable<void> Write(std::string_view data)
+    {
+        if (data.size() > _window.size() - _used)
+        {
+            co_await Flush();
+            if (data.size() >= _window.size())
+            {
+                co_await Send(data);
+                co_return;
+            }
+        }
+        std::memcpy(_window.data() + _used, data.data(), data.size());
+        _used += data.size();
+    }
+
+    /// <summary>
+    /// Send what Write() gathered
+    /// </summary>
+    boost::asio::awaitable<void> Flush()
+    {
+        if (_used == 0)
+            co_return;
+        const std::size_t used = _used;
+        _used = 0;
+        co_await Send(std::string_view(_window.data(), used));
+    }
+
+    /// <summary>
+    /// Send one event and flush it: every line of data becomes a data field, event and id are only sent when given
+    /// </summary>
+    boost::asio::awaitable<void> Event(std::string_view data, std::string_view event = {}, std::string_view id = {})
+    {
+        if (!event.empty())
+            co_await Field("event", event);
+        if (!id.empty())
+            co_await Field("id", id);
+        for (std::size_t start = 0;;)
+        {
+            const auto end = data.find('\n', start);
+            std::string_view line = data.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            co_await Field("data", line);
+            if (end == std::string_view::npos)
+                break;
+            start = end + 1;
+        }
+        co_await Write("\n");
+        co_await Flush();
+    }
+
+    /// <summary>
+    /// Send a comment line, ignored by the clients: keeps an idle event stream alive through proxies and finds out
+    /// a client that went away
+    /// </summary>
+    boost::asio::awaitable<void> Comment(std::string_view text)
+    {
+        co_await Write(": ");
+        co_await Write(text);
+        co_await Write("\n\n");
+        co_await Flush();
+    }
+
+    /// <summary>
+    /// Flush and end the body, called by the server once the producer returned
+    /// </summary>
+    boost::asio::awaitable<void> Finish()
+    {
+        co_await Flush();
+        if (_chunked)
+        {
+            static constexpr std::string_view last = "0\r\n\r\n";
+            const std::array<boost::asio::const_buffer, 1> buffers{ boost::asio::buffer(last.data(), last.size()) };
+            co_await _write(_stream, buffers, _write_timeout);
+        }
+    }
+
+    /// <summary>
+    /// Body bytes sent so far, framing excluded
+    /// </summary>
+    std::uint64_t Sent() const
+    {
+        return _sent;
+    }
+
+private:
+    static Response Begin(const Request& req, ResponseBuilder& builder, StreamProducer producer)
+    {
+        if (req.get().method() != Verb::head)
+            Context(req).stream = std::move(producer);
+        return builder.Streamed(Chunked(req));
+    }
+
+    boost::asio::awaitable<void> Field(std::string_view name, std::string_view value)
+    {
+        co_await Write(name);
+        co_await Write(": ");
+        co_await Write(value);
+        co_await Write("\n");
+    }
+
+    // one chunk: size line, data and CRLF in one gather write, data alone when the body is not chunked
+    boost::asio::awaitable<void> Send(std::string_view data)
+    {
+        char size[20];
+        char* end = std::to_chars(size, size + sizeof(size) - 2, data.size(), 16).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+
+        static constexpr std::string_view crlf = "\r\n";
+        const std::array<boost::asio::const_buffer, 3> chunk{ boost::asio::buffer(size, end - size), boost::asio::buffer(data.data(), data.size()), boost::asio::buffer(crlf.data(), crlf.size()) };
+        if (_chunked)
+            co_await _write(_stream, chunk, _write_timeout);
+        else
+            co_await _write(_stream, std::span(chunk).subspan(1, 1), _write_timeout);
+        _sent += data.size();
+    }
+
+    template <typename Stream>
+    static boost::asio::awaitable<void> WriteSome(void* stream, std::span<const boost::asio::const_buffer> buffers, std::chrono::milliseconds timeout)
+    {
+        auto& s = *static_cast<Stream*>(stream);
+
+        // the deadline covers each write, not the pauses of the producer between them (a live feed waits for its
+        // events): the stream deadline would otherwise close the socket while nothing is pending
+        boost::beast::get_lowest_layer(s).expires_after(timeout);
+        co_await boost::asio::async_write(s, buffers, boost::asio::use_awaitable);
+        boost::beast::get_lowest_layer(s).expires_never();
+    }
+
+    void* _stream;
+    boost::asio::awaitable<void>(*_write)(void* stream, std::span<const boost::asio::const_buffer> buffers, std::chrono::milliseconds timeout);
+    bool _chunked;
+    std::span<char> _window;
+    std::size_t _used = 0;
+    std::chrono::milliseconds _write_timeout;
+    std::uint64_t _sent = 0;
+};
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Define.h"
+#include "Uri.h"
+
+/// <summary>
+/// Route table, a prefix tree over path segments with per verb roots
+/// Patterns are made of static segments, {name} parameters and a trailing * or *name wildcard (rest of the path)
+/// Routes are registered first then Freeze() flattens the tree into one contiguous node array, lookups only read it
+/// Matching is done on the path only, query string and fragment are ignored
+/// </summary>
+template <typename Handler>
+class Router
+{
+public:
+    struct Route
+    {
+        Verb verb;
+        std::string pattern;
+        Handler handler;
+    };
+
+    /// <summary>
+    /// Register a route, throw if the router is frozen or the route already exists
+    /// </summary>
+    void Add(Verb verb, std::string_view pattern, Handler handler)
+    {
+        if (Frozen())
+            throw std::logic_error("Router: cannot add a route after Freeze()");
+        if (pattern.empty() || pattern.front() != '/')
+            throw std::invalid_argument("Router: pattern must start with '/': " + std::string(pattern));
+
+        auto& root = _build[static_cast<std::size_t>(verb)];
+        if (!root)
+            root = std::make_unique<BuildNode>();
+
+        BuildNode* node = root.get();
+        std::size_t params = 0;
+        std::string_view rest = pattern.substr(1);
+        for (bool more = true; more;)
+        {
+            const auto slash = rest.find('/');
+            const std::string_view segment = rest.substr(0, slash);
+            more = slash != std::string_view::npos;
+            rest = more ? rest.substr(slash + 1) : std::string_view{};
+
+            if (!segment.empty() && segment.front() == '*')
+            {
+                if (more)
+                    throw std::invalid_argument("Router: wildcard must be the last segment: " + std::string(pattern));
+                node = Child(node, Kind::Wildcard, segment.size() > 1 ? segment.substr(1) : segment, pattern);
+                ++params;
+            }
+            else if (segment.size() > 2 && segment.front() == '{' && segment.back() == '}')
+            {
+                node = Child(node, Kind::Param, segment.substr(1, segment.size() - 2), pattern);
+                ++params;
+            }
+            else
+            {
+                node = Child(node, Kind::Static, segment, pattern);
+            }
+        }
+
+        if (params > RouteParams::MaxParams)
+            throw std::invalid_argument("Router: too many parameters in " + std::string(pattern));
+        if (node->route >= 0)
+            throw std::invalid_argument("Router: duplicate route " + std::string(pattern));
+
+        node->route = static_cast<int32_t>(_routes.size());
+        _routes.push_back(Route{ verb, std::string(pattern), std::move(handler) });
+    }
+
+    /// <summary>
+    /// Flatten the registered routes, no route can be added afterward
+    /// </summary>
+    void Freeze()
+    {
+        if (Frozen())
+            return;
+
+        _roots.fill(NoNode);
+        for (std::size_t verb = 0; verb < VerbCount; ++verb)
+        {
+            if (!_build[verb])
+                continue;
+
+            Compress(*_build[verb]);
+            _roots[verb] = static_cast<uint32_t>(_nodes.size());
+            _nodes.emplace_back();
+            Flatten(*_build[verb], _roots[verb]);
+        }
+        _build = {};
+        _frozen = true;
+    }
+
+    bool Frozen() const { return _frozen; }
+
+    /// <summary>
+    /// Find the route for verb and target, fill params with the captured segments
+    /// Static segments win over parameters which win over wildcards
+    /// </summary>
+    const Route* Match(Verb verb, std::string_view target, RouteParams& params) const
+    {
+        if (!Frozen())
+            throw std::logic_error("Router: Match() called before Freeze()");
+
+        const auto index = static_cast<std::size_t>(verb);
+        if (index >= VerbCount || _roots[index] == NoNode)
+            return nullptr;
+
+        target = target.substr(0, target.find_first_of("?#"));
+        if (target.empty() || target.front() != '/')
+            return nullptr;
+
+        params._size = 0;
+        const int32_t route = MatchNode(_nodes[_roots[index]], target.substr(1), params);
+        return route >= 0 ? &_routes[route] : nullptr;
+    }
+
+    const std::vector<Route>& Routes() const { return _routes; }
+
+private:
+    enum class Kind : uint8_t
+    {
+        Static,
+        Param,
+        Wildcard
+    };
+
+    // registration time tree, thrown away by Freeze()
+    struct BuildNode
+    {
+        Kind kind = Kind::Static;
+        std::string label;
+        int32_t route = -1;
+        std::vector<std::unique_ptr<BuildNode>> statics{};
+        std::unique_ptr<BuildNode> param{};
+        std::unique_ptr<BuildNode> wildcard{};
+    };
+
+    // frozen node, children of a node are contiguous: sorted statics, then param, then wildcard
+    struct Node
+    {
+        uint32_t label_offset = 0;
+        uint32_t label_size = 0;
+        uint32_t first_child = 0;
+        uint16_t static_count = 0;
+        bool has_param = false;
+        bool has_wildcard = false;
+        int32_t route = -1;
+    };
+
+    static constexpr std::size_t VerbCount = static_cast<std::size_t>(Verb::unlink) + 1;
+    static constexpr uint32_t NoNode = UINT32_MAX;
+
+    static BuildNode* Child(BuildNode* node, Kind kind, std::string_view label, std::string_view pattern)
+    {
+        if (kind == Kind::Static)
+        {
+            for (auto& child : node->statics)
+            {
+                if (child->label == label)
+                    return child.get();
+            }
+            node->statics.push_back(std::make_unique<BuildNode>(BuildNode{ kind, std::string(label) }));
+            return node->statics.back().get();
+        }
+
+        auto& slot = kind == Kind::Param ? node->param : node->wildcard;
+        if (!slot)
+            slot = std::make_unique<BuildNode>(BuildNode{ kind, std::string(label) });
+        else if (slot->label != label)
+            throw std::invalid_argument("Router: conflicting parameter name in " + std::string(pattern));
+        return slot.get();
+    }
+
+    // merge chains of static segments ("a" -> "b" -> "c" becomes "a/b/c") so they are matched with one compare
+    static void Compress(BuildNode& node)
+    {
+        for (auto& child : node.statics)
+        {
+            while (child->route < 0 && child->statics.size() == 1 && !child->param && !child->wildcard)
+            {
+                auto next = std::move(child->statics.front());
+                next->label = child->label + "/" + next->label;
+                child = std::move(next);
+            }
+            Compress(*child);
+        }
+        if (node.param)
+            Compress(*node.param);
+    }
+
+    static std::string_view FirstSegment(std::string_view label)
+    {
+        return label.substr(0, label.find('/'));
+    }
+
+    void Flatten(BuildNode& node, uint32_t index)
+    {
+        std::sort(node.statics.begin(), node.statics.end(), [](const auto& a, const auto& b) { return FirstSegment(a->label) < FirstSegment(b->label); });
+
+        Node flat;
+        flat.label_offset = static_cast<uint32_t>(_labels.size());
+        flat.label_size = static_cast<uint32_t>(node.label.size());
+        flat.route = node.route;
+        flat.first_child = static_cast<uint32_t>(_nodes.size());
+        flat.static_count = static_cast<uint16_t>(node.statics.size());
+        flat.has_param = node.param != nullptr;
+        flat.has_wildcard = node.wildcard != nullptr;
+        _labels += node.label;
+        _nodes[index] = flat;
+
+        std::vector<BuildNode*> children;
+        for (auto& child : node.statics)
+            children.push_back(child.get());
+        if (node.param)
+            children.push_back(node.param.get());
+        if (node.wildcard)
+            children.push_back(node.wildcard.get());
+
+        // reserve the sibling block first so children stay contiguous, then recurse
+        _nodes.resize(_nodes.size() + children.size());
+        for (std::size_t i = 0; i < children.size(); ++i)
+            Flatten(*children[i], flat.first_child + static_cast<uint32_t>(i));
+    }
+
+    std::string_view Label(const Node& node) const
+    {
+        return std::string_view(_labels).substr(node.label_offset, node.label_size);
+    }
+
+    // rest is the part of the path after the segments consumed by node, without the leading '/'
+    int32_t MatchNode(const Node& node, std::string_view rest, RouteParams& params) const
+    {
+        const auto slash = rest.find('/');
+        const std::string_view segment = rest.substr(0, slash);
+
+        // static children, binary search on the first segment of their label
+        const Node* first = &_nodes[node.first_child];
+        const Node* last = first + node.static_count;
+        const Node* it = std::lower_bound(first, last, segment, [this](const Node& n, std::string_view s) { return FirstSegment(Label(n)) < s; });
+        if (it != last && FirstSegment(Label(*it)) == segment)
+        {
+            const std::string_view label = Label(*it);
+            if (rest.size() == label.size() && rest == label)
+            {
+                if (it->route >= 0)
+                    return it->route;
+            }
+            else if (rest.size() > label.size() && rest[label.size()] == '/' && rest.starts_with(label))
+            {
+                const int32_t route = MatchNode(*it, rest.substr(label.size() + 1), params);
+                if (route >= 0)
+                    return route;
+            }
+        }
+
+        const Node* child = last;
+        if (node.has_param)
+        {
+            if (!segment.empty())
+            {
+                const std::size_t mark = params._size;
+                params._params[params._size++] = { Label(*child), segment };
+
+                const int32_t route = slash == std::string_view::npos ? child->route : MatchNode(*child, rest.substr(slash + 1), params);
+                if (route >= 0)
+                    return route;
+                params._size = mark;
+            }
+            ++child;
+        }
+
+        if (node.has_wildcard)
+        {
+            params._params[params._size++] = { Label(*child), rest };
+            return child->route;
+        }
+
+        return -1;
+    }
+
+private:
+    std::array<std::unique_ptr<BuildNode>, VerbCount> _build;
+    std::vector<Route> _routes;
+
+    std::array<uint32_t, VerbCount> _roots{};
+    std::vector<Node> _nodes;
+    std::string _labels;
+    bool _frozen = false;
+};
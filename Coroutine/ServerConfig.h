@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Define how the server schedules its connections
+/// </summary>
+enum class ServerMode
+{
+	// one acceptor, every connection is spawned on the executor given to HttpServer
+	SharedPool,
+	// one acceptor per thread, each thread runs its own single threaded io_context and
+	// keeps every connection it accepted for the whole connection life
+	PerCore
+};
+
+/// <summary>
+/// Define the HttpServer TLS termination
+/// Certificate and key are read from the files when the PEM contents are not given directly
+/// </summary>
+struct TlsConfig
+{
+	std::string certificate_chain_file{};
+	std::string private_key_file{};
+
+	// PEM contents, take precedence over the files
+	std::string certificate_chain{};
+	std::string private_key{};
+
+	// protocols accepted through ALPN in server preference order, a client offering none of them is served without ALPN
+	std::vector<std::string> alpn = { "http/1.1" };
+
+	// a connection that has not completed its handshake in time is dropped
+	std::chrono::seconds handshake_timeout{ 10 };
+};
+
+/// <summary>
+/// Define the HttpServer connection governor: how many connections are served and how long each step may take
+/// Every timeout is a deadline for the whole step, not reset by each byte received, so trickling bytes does not
+/// keep a connection alive
+/// </summary>
+struct ConnectionLimits
+{
+	// connections served at once, the accept loops stop accepting at the limit and leave the next ones in the
+	// listen backlog, 0 means no limit
+	std::size_t max_connections = 10000;
+
+	// from the first byte of a request to the end of its header
+	std::chrono::milliseconds header_timeout{ 10000 };
+
+	// keep-alive wait for the first byte of the next request, idle connections are closed after it
+	std::chrono::milliseconds idle_timeout{ 30000 };
+
+	// reading a buffered request body
+	std::chrono::milliseconds body_timeout{ 30000 };
+
+	// writing the responses of a batch
+	std::chrono::milliseconds write_timeout{ 30000 };
+
+	// a buffered body received slower than this (bytes per second) once min_rate_grace has passed is dropped,
+	// 0 disables the check
+	std::size_t min_rate = 1024;
+	std::chrono::milliseconds min_rate_grace{ 5000 };
+};
+
+/// <summary>
+/// Define the HttpServer runtime configuration
+/// </summary>
+struct ServerConfig
+{
+	ServerMode mode = ServerMode::SharedPool;
+
+	// PerCore only: number of io_context / acceptor pairs, 0 means std::thread::hardware_concurrency()
+	std::size_t threads = 0;
+
+	// PerCore only: thread i is pinned on cpu_affinity[i % size], empty means thread i on cpu i
+	std::vector<int> cpu_affinity;
+
+	// accepts kept pending on each listening socket, a burst of connections is then accepted in one wakeup rather
+	// than one per turn of the accept loop (io_uring: that many accept entries in flight, in place of a multishot
+	// accept asio does not offer); near max_connections only as many stay pending as there are slots left
+	std::size_t accept_depth = 4;
+
+	// maximum number of pipelined requests parsed from one read and answered with one write
+	std::size_t max_pipeline = 16;
+
+	// serve https instead of plain http
+	std::optional<TlsConfig> tls;
+
+	ConnectionLimits limits;
+
+	// Drain() waits this long for the requests in flight
+	std::chrono::milliseconds drain_timeout{ 10000 };
+
+	// unix domain socket used to hand the listening sockets over to the next instance (unix only, empty disables it):
+	// Start() inherits them from the instance listening on the path, if any, then listens on it for its successor
+	std::string handoff_path;
+};
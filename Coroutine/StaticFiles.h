@@ -0,0 +1,551 @@
+#pragma once
+
+#include <boost/beast.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "Compression.h"
+#include "Define.h"
+#include "HttpDate.h"
+#include "ResponseBuilder.h"
+#include "Uri.h"
+
+/// <summary>
+/// Define how StaticFiles serves its directory
+/// </summary>
+struct StaticFilesPolicy
+{
+    // files up to this size are mapped on their first request and served from memory, larger ones are sent from
+    // the file each time
+    std::size_t map_max_file = 256 * 1024;
+
+    // total size of the mapped files, the least recently used are unmapped first
+    std::size_t map_max_bytes = 64 * 1024 * 1024;
+
+    // files whose metadata (size, date, ETag, mapping) is kept, missing files included
+    std::size_t max_entries = 4096;
+
+    // a kept file is checked again (stat) at most this often, a file changed since is reloaded
+    std::chrono::milliseconds revalidate{ 1000 };
+
+    // Cache-Control: public, max-age
+    std::chrono::seconds max_age{ 3600 };
+
+    // served for a path naming a directory
+    std::string index = "index.html";
+
+    // file.br and file.gz are sent instead of file to the clients accepting br or gzip, when they exist
+    bool precompressed = true;
+};
+
+/// <summary>
+/// Serve the files under a root directory: GET and HEAD, Range (one range), If-None-Match / If-Modified-Since,
+/// precompressed .br / .gz siblings
+/// Small files are mapped read-only once and their bytes handed to the write without a copy; larger ones are
+/// opened for each request and the response only carries the header, the server sends the file itself
+/// (FileRange: sendfile on plain connections) so a download costs no user space copy and no memory for its size
+/// The metadata of the files is kept and checked against the disk every policy.revalidate: files are expected to
+/// be replaced (rename) rather than rewritten in place, a mapped file truncated under a response would fault
+/// Thread safe: the table is guarded by a mutex, entries are immutable and shared with the writes in flight
+/// </summary>
+class StaticFiles
+{
+public:
+    struct Stats
+    {
+        // responses served from a mapped file
+        std::atomic<std::size_t> mapped = 0;
+        // responses sent from the file by the server
+        std::atomic<std::size_t> sent = 0;
+        std::atomic<std::size_t> not_modified = 0;
+        std::atomic<std::size_t> partial = 0;
+        std::atomic<std::size_t> precompressed = 0;
+    };
+
+    explicit StaticFiles(std::string root, StaticFilesPolicy policy = {})
+        : _root{ std::move(root) }
+        , _policy{ std::move(policy) }
+        , _cache_control{ "public, max-age=" + std::to_string(_policy.max_age.count()) }
+    {
+        while (_root.size() > 1 && (_root.back() == '/' || _root.back() == '\\'))
+            _root.pop_back();
+    }
+
+    StaticFiles(const StaticFiles&) = delete;
+    StaticFiles& operator=(const StaticFiles&) = delete;
+
+    /// <summary>
+    /// Response to a GET or HEAD of the file at relative (percent-encoded, as captured by the route) under the root
+    /// A file sent by the server is set in Context(req).file, the response returned is then its header
+    /// </summary>
+    Response Serve(const Request& req, std::string_view relative)
+    {
+        const auto& header = req.get();
+
+        std::string decoded;
+        const std::string_view name = uri::decode(relative, decoded, false);
+        if (!Contained(name))
+            return NotFound(req);
+
+        std::string path = _root;
+        path += '/';
+        path += name;
+        if (name.empty() || name.back() == '/')
+            path += _policy.index;
+
+        auto file = Lookup(path);
+        if (file->info.directory)
+        {
+            path += '/';
+            path += _policy.index;
+            file = Lookup(path);
+        }
+        if (!file->info.regular)
+            return NotFound(req);
+
+        // the siblings are looked up whatever the request accepts: when one exists the response varies
+        ContentEncoding encoding = ContentEncoding::Identity;
+        bool vary = false;
+        if (_policy.precompressed)
+        {
+            const auto accept = header[boost::beast::http::field::accept_encoding];
+            const auto q = ResponseCompressor::Qualities(std::string_view(accept.data(), accept.size()));
+            int best = 0;
+            std::shared_ptr<const File> chosen;
+            for (const auto& [candidate, suffix] : { std::pair{ ContentEncoding::Brotli, ".br" }, std::pair{ ContentEncoding::Gzip, ".gz" } })
+            {
+                auto sibling = Lookup(path + suffix);
+                if (!sibling->info.regular)
+                    continue;
+                vary = true;
+                if (q[static_cast<std::size_t>(candidate)] > best)
+                {
+                    best = q[static_cast<std::size_t>(candidate)];
+                    encoding = candidate;
+                    chosen = std::move(sibling);
+                }
+            }
+            if (chosen)
+            {
+                file = std::move(chosen);
+                ++_stats.precompressed;
+            }
+        }
+
+        const std::string etag = encoding == ContentEncoding::Identity ? file->etag : ResponseCompressor::VariantETag(file->etag, encoding);
+        const std::string_view last_modified(file->last_modified.data(), file->last_modified.size());
+        const unsigned version = header.version();
+        const bool keep_alive = header.keep_alive();
+
+        if (NotModified(req, etag, file->info.modified))
+        {
+            ++_stats.not_modified;
+            ResponseBuilder builder(Status::not_modified, version, keep_alive, header.get_allocator());
+            builder.Field(boost::beast::http::field::etag, etag).Field(boost::beast::http::field::last_modified, last_modified);
+            if (vary)
+                builder.Line(VaryLine);
+            return builder.Body({});
+        }
+
+        const std::uint64_t size = file->info.size;
+        std::uint64_t first = 0;
+        std::uint64_t length = size;
+        const RangeResult range = Range(req, etag, last_modified, size, first, length);
+        if (range == RangeResult::Unsatisfiable)
+        {
+            char value[32] = "bytes */";
+            const auto end = std::to_chars(value + 8, value + sizeof(value), size).ptr;
+            return ResponseBuilder(Status::range_not_satisfiable, version, keep_alive, header.get_allocator())
+                .Field(boost::beast::http::field::content_range, std::string_view(value, end - value))
+                .Body({});
+        }
+
+        ResponseBuilder builder(range == RangeResult::Partial ? Status::partial_content : Status::ok, version, keep_alive, header.get_allocator());
+        builder.Field(boost::beast::http::field::content_type, ContentType(path))
+            .Field(boost::beast::http::field::etag, etag)
+            .Field(boost::beast::http::field::last_modified, last_modified)
+            .Field(boost::beast::http::field::cache_control, _cache_control)
+            .Line("Accept-Ranges: bytes\r\n");
+        if (encoding != ContentEncoding::Identity)
+            builder.Field(boost::beast::http::field::content_encoding, ResponseCompressor::Name(encoding));
+        if (vary)
+            builder.Line(VaryLine);
+        if (range == RangeResult::Partial)
+        {
+            ++_stats.partial;
+            char value[72] = "bytes ";
+            char* end = std::to_chars(value + 6, value + sizeof(value), first).ptr;
+            *end++ = '-';
+            end = std::to_chars(end, value + sizeof(value), first + length - 1).ptr;
+            *end++ = '/';
+            end = std::to_chars(end, value + sizeof(value), size).ptr;
+            builder.Field(boost::beast::http::field::content_range, std::string_view(value, end - value));
+        }
+
+        if (header.method() == Verb::head)
+            return builder.Header(length);
+
+        if (file->mapped)
+        {
+            ++_stats.mapped;
+            const std::string_view bytes = file->mapping.View().substr(static_cast<std::size_t>(first), static_cast<std::size_t>(length));
+            return builder.Body(bytes, file);
+        }
+
+        // opened for this response only: its position is its own and the descriptor is closed once it is sent
+        auto opened = std::make_shared<boost::beast::file>();
+        boost::beast::error_code ec;
+        opened->open(file->path.c_str(), boost::beast::file_mode::scan, ec);
+        if (ec)
+            return NotFound(req);
+
+        ++_stats.sent;
+        Context(req).file = FileRange{ std::move(opened), first, length };
+        return builder.Header(length);
+    }
+
+    /// <summary>
+    /// Total size of the files mapped in memory
+    /// </summary>
+    std::size_t MappedBytes() const
+    {
+        std::lock_guard lock(_mutex);
+        return _mapped_bytes;
+    }
+
+    const Stats& GetStats() const
+    {
+        return _stats;
+    }
+
+private:
+    static constexpr std::string_view VaryLine = "Vary: Accept-Encoding\r\n";
+
+    enum class RangeResult
+    {
+        Full,
+        Partial,
+        Unsatisfiable
+    };
+
+    struct Info
+    {
+        bool regular = false;
+        bool directory = false;
+        std::uint64_t size = 0;
+        std::time_t modified = 0;
+
+        bool operator==(const Info&) const = default;
+    };
+
+    /// <summary>
+    /// Read-only image of a whole file, unmapped once the last response using it is written
+    /// </summary>
+    class Mapping
+    {
+    public:
+        Mapping() = default;
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        ~Mapping()
+        {
+#if !defined(_WIN32)
+            if (_data)
+                ::munmap(_data, _size);
+#endif
+        }
+
+        bool Map(const std::string& path, std::size_t size)
+        {
+            if (size == 0)
+                return true;
+#if defined(_WIN32)
+            // no mapping here, the bytes are read once instead
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file)
+                return false;
+            _bytes.resize(size);
+            const bool read = std::fread(_bytes.data(), 1, size, file) == size;
+            std::fclose(file);
+            return read;
+#else
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+            void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (data == MAP_FAILED)
+                return false;
+            _data = data;
+            _size = size;
+            return true;
+#endif
+        }
+
+        std::string_view View() const
+        {
+#if defined(_WIN32)
+            return _bytes;
+#else
+            return std::string_view(static_cast<const char*>(_data), _size);
+#endif
+        }
+
+    private:
+#if defined(_WIN32)
+        std::string _bytes;
+#else
+        void* _data = nullptr;
+        std::size_t _size = 0;
+#endif
+    };
+
+    struct File
+    {
+        std::string path;
+        Info info;
+        std::string etag;
+        std::array<char, HttpDate::Size> last_modified{};
+        Mapping mapping;
+        bool mapped = false;
+
+        // steady clock (ns) of the last stat, entries are shared so only this changes after the load
+        mutable std::atomic<std::int64_t> checked = 0;
+    };
+
+    using Lru = std::list<std::shared_ptr<File>>;
+
+    /// <summary>
+    /// Kept entry of path, checked against the disk when it is older than revalidate, loaded when missing or changed
+    /// A missing path gets an entry too so the siblings absent for most files cost no stat
+    /// </summary>
+    std::shared_ptr<const File> Lookup(const std::string& path)
+    {
+        const std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        const std::int64_t revalidate = std::chrono::duration_cast<std::chrono::nanoseconds>(_policy.revalidate).count();
+
+        std::shared_ptr<File> kept;
+        {
+            std::lock_guard lock(_mutex);
+            if (const auto it = _index.find(path); it != _index.end())
+            {
+                _lru.splice(_lru.begin(), _lru, it->second);
+                kept = *it->second;
+                if (now - kept->checked.load(std::memory_order_relaxed) < revalidate)
+                    return kept;
+            }
+        }
+
+        // disk accesses outside of the lock, two threads loading the same file keep the last one
+        const Info info = Stat(path);
+        if (kept && kept->info == info)
+        {
+            kept->checked.store(now, std::memory_order_relaxed);
+            return kept;
+        }
+
+        auto file = std::make_shared<File>();
+        file->path = path;
+        file->info = info;
+        file->checked.store(now, std::memory_order_relaxed);
+        if (info.regular)
+        {
+            char etag[40];
+            std::snprintf(etag, sizeof(etag), "\"%llx-%llx\"", static_cast<unsigned long long>(info.size), static_cast<unsigned long long>(info.modified));
+            file->etag = etag;
+            HttpDate::Format(info.modified, file->last_modified.data());
+            if (info.size <= _policy.map_max_file && info.size <= _policy.map_max_bytes)
+                file->mapped = file->mapping.Map(path, static_cast<std::size_t>(info.size));
+        }
+
+        std::lock_guard lock(_mutex);
+        if (const auto it = _index.find(path); it != _index.end())
+            Erase(it->second);
+        _lru.push_front(file);
+        _index.emplace(file->path, _lru.begin());
+        _mapped_bytes += file->mapped ? file->info.size : 0;
+
+        while (_lru.size() > 1 && (_lru.size() > _policy.max_entries || _mapped_bytes > _policy.map_max_bytes))
+            Erase(std::prev(_lru.end()));
+        return file;
+    }
+
+    void Erase(Lru::iterator it)
+    {
+        _mapped_bytes -= (*it)->mapped ? (*it)->info.size : 0;
+        _index.erase((*it)->path);
+        _lru.erase(it);
+    }
+
+    static Info Stat(const std::string& path)
+    {
+#if defined(_WIN32)
+        struct _stat64 st;
+        if (::_stat64(path.c_str(), &st) != 0)
+            return {};
+        return { (st.st_mode & _S_IFREG) != 0, (st.st_mode & _S_IFDIR) != 0, static_cast<std::uint64_t>(st.st_size), static_cast<std::time_t>(st.st_mtime) };
+#else
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+            return {};
+        return { S_ISREG(st.st_mode), S_ISDIR(st.st_mode), static_cast<std::uint64_t>(st.st_size), st.st_mtime };
+#endif
+    }
+
+    /// <summary>
+    /// A decoded relative path that cannot leave the root: no .. segment, not absolute, no backslash or NUL
+    /// </summary>
+    static bool Contained(std::string_view name)
+    {
+        if (!name.empty() && name.front() == '/')
+            return false;
+        if (name.find('\0') != std::string_view::npos || name.find('\\') != std::string_view::npos)
+            return false;
+#if defined(_WIN32)
+        if (name.find(':') != std::string_view::npos)
+            return false;
+#endif
+        while (!name.empty())
+        {
+            const auto slash = name.find('/');
+            if (name.substr(0, slash) == "..")
+                return false;
+            name = slash == std::string_view::npos ? std::string_view{} : name.substr(slash + 1);
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// A 304 answers If-None-Match holding the ETag, or without it If-Modified-Since not older than the file
+    /// </summary>
+    static bool NotModified(const Request& req, std::string_view etag, std::time_t modified)
+    {
+        const auto if_none_match = req.get()[boost::beast::http::field::if_none_match];
+        if (!if_none_match.empty())
+            return if_none_match == "*" || std::string_view(if_none_match.data(), if_none_match.size()).find(etag) != std::string_view::npos;
+
+        const auto if_modified_since = req.get()[boost::beast::http::field::if_modified_since];
+        const auto since = HttpDate::Parse(std::string_view(if_modified_since.data(), if_modified_since.size()));
+        return since && modified <= *since;
+    }
+
+    /// <summary>
+    /// The one range of a Range header ("bytes=first-last", "bytes=first-" or "bytes=-suffix"), Full when there is
+    /// none, it cannot be read, it holds several ranges or If-Range names another version of the file
+    /// </summary>
+    static RangeResult Range(const Request& req, std::string_view etag, std::string_view last_modified, std::uint64_t size, std::uint64_t& first, std::uint64_t& length)
+    {
+        const auto header = req.get()[boost::beast::http::field::range];
+        std::string_view range(header.data(), header.size());
+        if (!range.starts_with("bytes=") || range.find(',') != std::string_view::npos)
+            return RangeResult::Full;
+
+        const auto if_range = req.get()[boost::beast::http::field::if_range];
+        if (!if_range.empty() && std::string_view(if_range.data(), if_range.size()) != etag && std::string_view(if_range.data(), if_range.size()) != last_modified)
+            return RangeResult::Full;
+
+        range.remove_prefix(6);
+        const auto dash = range.find('-');
+        if (dash == std::string_view::npos)
+            return RangeResult::Full;
+
+        const auto number = [](std::string_view text, std::uint64_t& value)
+        {
+            const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+            return !text.empty() && error == std::errc{} && end == text.data() + text.size();
+        };
+
+        std::uint64_t start = 0;
+        std::uint64_t last = 0;
+        if (dash == 0)
+        {
+            // the last bytes of the file
+            if (!number(range.substr(1), last))
+                return RangeResult::Full;
+            if (last == 0 || size == 0)
+                return RangeResult::Unsatisfiable;
+            length = std::min(last, size);
+            first = size - length;
+            return RangeResult::Partial;
+        }
+
+        if (!number(range.substr(0, dash), start))
+            return RangeResult::Full;
+        // open ended: up to the end of the file
+        last = std::numeric_limits<std::uint64_t>::max();
+        if (dash + 1 < range.size() && !number(range.substr(dash + 1), last))
+            return RangeResult::Full;
+        if (last < start)
+            return RangeResult::Full;
+        if (start >= size)
+            return RangeResult::Unsatisfiable;
+
+        first = start;
+        length = std::min(last, size - 1) - start + 1;
+        return RangeResult::Partial;
+    }
+
+    static std::string_view ContentType(std::string_view path)
+    {
+        static constexpr std::pair<std::string_view, std::string_view> Types[] = {
+            { ".html", "text/html; charset=utf-8" }, { ".htm", "text/html; charset=utf-8" }, { ".css", "text/css; charset=utf-8" },
+            { ".js", "application/javascript" }, { ".mjs", "application/javascript" }, { ".json", "application/json" },
+            { ".txt", "text/plain; charset=utf-8" }, { ".xml", "application/xml" }, { ".svg", "image/svg+xml" },
+            { ".png", "image/png" }, { ".jpg", "image/jpeg" }, { ".jpeg", "image/jpeg" }, { ".gif", "image/gif" },
+            { ".webp", "image/webp" }, { ".ico", "image/x-icon" }, { ".woff", "font/woff" }, { ".woff2", "font/woff2" },
+            { ".wasm", "application/wasm" }, { ".pdf", "application/pdf" }, { ".mp4", "video/mp4" }
+        };
+
+        const auto dot = path.rfind('.');
+        if (dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos)
+        {
+            const std::string_view extension = path.substr(dot);
+            for (const auto& [suffix, type] : Types)
+            {
+                if (extension.size() == suffix.size() && std::equal(extension.begin(), extension.end(), suffix.begin(), [](char a, char b) { return (a >= 'A' && a <= 'Z' ? a + 32 : a) == b; }))
+                    return type;
+            }
+        }
+        return "application/octet-stream";
+    }
+
+    static Response NotFound(const Request& req)
+    {
+        return ResponseBuilder(Status::not_found, req.get().version(), req.get().keep_alive(), req.get().get_allocator()).Body({});
+    }
+
+private:
+    std::string _root;
+    const StaticFilesPolicy _policy;
+    const std::string _cache_control;
+
+    mutable std::mutex _mutex;
+    Lru _lru;
+    // keys are views on the paths held by the entries
+    std::unordered_map<std::string_view, Lru::iterator> _index;
+    std::size_t _mapped_bytes = 0;
+    Stats _stats;
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <boost/asio/ssl.hpp>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/// <summary>
+/// Client TLS context shared by every HttpClient connecting over https
+/// Keeps the last session ticket received for each SNI host so the next handshake to that host is resumed
+/// instead of doing a full key exchange and certificate check
+/// Thread safe: the SSL_CTX is only read after construction and the session cache is guarded by a mutex
+/// </summary>
+class TlsClientContext
+{
+public:
+	struct Stats
+	{
+		std::atomic<std::size_t> handshakes = 0;
+		std::atomic<std::size_t> resumed = 0;
+	};
+
+	explicit TlsClientContext(boost::asio::ssl::context::method method = boost::asio::ssl::context::tlsv13_client)
+		: TlsClientContext(boost::asio::ssl::context{ method })
+	{
+	}
+
+	explicit TlsClientContext(boost::asio::ssl::context&& context)
+		: _context{ std::move(context) }
+	{
+		SSL_CTX* ctx = _context.native_handle();
+
+		// the client cache is ours, OpenSSL only reports new sessions through the callback
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, &TlsClientContext::on_new_session);
+		SSL_CTX_set_ex_data(ctx, index(), this);
+	}
+
+	~TlsClientContext()
+	{
+		for (auto& [host, session] : _sessions)
+			SSL_SESSION_free(session);
+	}
+
+	TlsClientContext(const TlsClientContext&) = delete;
+	TlsClientContext& operator=(const TlsClientContext&) = delete;
+
+	/// <summary>
+	/// Context used by HttpClient when none is given
+	/// </summary>
+	static const std::shared_ptr<TlsClientContext>& shared()
+	{
+		static const std::shared_ptr<TlsClientContext> context = std::make_shared<TlsClientContext>();
+		return context;
+	}
+
+	boost::asio::ssl::context& context()
+	{
+		return _context;
+	}
+
+	/// <summary>
+	/// Set SNI on a new connection and offer the cached session for host when there is one
+	/// </summary>
+	bool prepare(SSL* ssl, std::string_view host)
+	{
+		const std::string name(host);
+		if (!SSL_set_tlsext_host_name(ssl, name.c_str()))
+			return false;
+
+		std::lock_guard lock(_mutex);
+		if (auto it = _sessions.find(name); it != _sessions.end() && SSL_SESSION_is_resumable(it->second))
+			SSL_set_session(ssl, it->second);
+		return true;
+	}
+
+	/// <summary>
+	/// Account a completed handshake
+	/// </summary>
+	void handshake_done(SSL* ssl)
+	{
+		++_stats.handshakes;
+		if (SSL_session_reused(ssl))
+			++_stats.resumed;
+	}
+
+	const Stats& stats() const
+	{
+		return _stats;
+	}
+
+private:
+	static int index()
+	{
+		static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+
+	// TLS 1.3 tickets arrive after the handshake, with the first application data read
+	static int on_new_session(SSL* ssl, SSL_SESSION* session)
+	{
+		auto* self = static_cast<TlsClientContext*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), index()));
+		const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+		if (!self || !host)
+			return 0;
+
+		std::lock_guard lock(self->_mutex);
+		auto& slot = self->_sessions[host];
+		if (slot)
+			SSL_SESSION_free(slot);
+		slot = session;
+
+		// ownership of session is taken
+		return 1;
+	}
+
+private:
+	boost::asio::ssl::context _context;
+	std::mutex _mutex;
+	std::unordered_map<std::string, SSL_SESSION*> _sessions;
+	Stats _stats;
+};
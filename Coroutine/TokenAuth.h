@@ -0,0 +1,411 @@
+#pragma once
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/beast.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <concepts>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Define.h"
+#include "HttpClientPool.h"
+#include "Log.h"
+#include "MiddleWare.h"
+
+/// <summary>
+/// Equality of two tokens in a time that only depends on their length, not on the position of the first difference
+/// </summary>
+inline bool ConstantTimeEquals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    unsigned char diff = 0;
+    for (std::size_t i = 0; i < a.size(); ++i)
+        diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+/// <summary>
+/// Tell whether a bearer token is valid, the answer is cached by the middleware
+/// Throwing means the validator could not decide (backend down...), nothing is cached then
+/// </summary>
+template <typename T>
+concept ITokenValidator = requires(T validator, std::string_view token)
+{
+    { validator.Validate(token) } -> std::convertible_to<boost::asio::awaitable<bool>>;
+};
+
+/// <summary>
+/// How long the validation results are kept
+/// </summary>
+struct AuthPolicy
+{
+    // a valid token is trusted for ttl without asking the validator again
+    std::chrono::steady_clock::duration ttl = std::chrono::minutes(5);
+
+    // an invalid token is refused for negative_ttl, so a client retrying a bad token does not reach the validator
+    std::chrono::steady_clock::duration negative_ttl = std::chrono::seconds(30);
+
+    // bound of the cache, expired entries are dropped first when a shard is full
+    std::size_t max_entries = 100000;
+};
+
+/// <summary>
+/// Validation results keyed by token
+/// Split in shards, each behind its own shared mutex: lookups only take a shared lock and a store only locks
+/// one shard, so threads validating different tokens do not wait for each other
+/// A lookup takes a string_view and allocates nothing, keys are compared in constant time
+/// Movable (the shards live in one heap block) so the middleware holding it can be moved into its Api
+/// </summary>
+class TokenCache
+{
+public:
+    static constexpr std::size_t ShardCount = 16;
+
+    struct Stats
+    {
+        std::atomic<std::size_t> hits = 0;
+        std::atomic<std::size_t> misses = 0;
+        std::atomic<std::size_t> evicted = 0;
+    };
+
+    explicit TokenCache(AuthPolicy policy = {})
+        : _policy{ policy }
+        , _state{ std::make_unique<State>() }
+    {
+    }
+
+    TokenCache(TokenCache&&) = default;
+    TokenCache& operator=(TokenCache&&) = default;
+
+    /// <summary>
+    /// Cached validity of token, nullopt when unknown or expired
+    /// </summary>
+    std::optional<bool> Find(std::string_view token) const
+    {
+        const std::size_t hash = Hash{}(token);
+        const Shard& shard = ShardOf(hash);
+        {
+            std::shared_lock lock(shard.mutex);
+            const auto it = shard.entries.find(token);
+            if (it != shard.entries.end() && it->second.expires > std::chrono::steady_clock::now())
+            {
+                ++_state->stats.hits;
+                return it->second.valid;
+            }
+        }
+        ++_state->stats.misses;
+        return std::nullopt;
+    }
+
+    void Store(std::string_view token, bool valid)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const Entry entry{ valid, now + (valid ? _policy.ttl : _policy.negative_ttl) };
+
+        Shard& shard = ShardOf(Hash{}(token));
+        std::unique_lock lock(shard.mutex);
+        if (const auto it = shard.entries.find(token); it != shard.entries.end())
+        {
+            it->second = entry;
+            return;
+        }
+
+        if (shard.entries.size() >= std::max<std::size_t>(1, _policy.max_entries / ShardCount))
+        {
+            std::erase_if(shard.entries, [now](const auto& item) { return item.second.expires <= now; });
+            if (shard.entries.size() >= std::max<std::size_t>(1, _policy.max_entries / ShardCount))
+                shard.entries.erase(shard.entries.begin());
+            ++_state->stats.evicted;
+        }
+        shard.entries.emplace(std::string(token), entry);
+    }
+
+    /// <summary>
+    /// Forget a token, e.g. once revoked
+    /// </summary>
+    void Invalidate(std::string_view token)
+    {
+        Shard& shard = ShardOf(Hash{}(token));
+        std::unique_lock lock(shard.mutex);
+        if (const auto it = shard.entries.find(token); it != shard.entries.end())
+            shard.entries.erase(it);
+    }
+
+    void Clear()
+    {
+        for (auto& shard : _state->shards)
+        {
+            std::unique_lock lock(shard.mutex);
+            shard.entries.clear();
+        }
+    }
+
+    const Stats& GetStats() const
+    {
+        return _state->stats;
+    }
+
+private:
+    struct Entry
+    {
+        bool valid = false;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    // transparent: std::string keys looked up with a string_view
+    struct Hash
+    {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view token) const
+        {
+            return std::hash<std::string_view>{}(token);
+        }
+    };
+
+    struct Equal
+    {
+        using is_transparent = void;
+
+        bool operator()(std::string_view a, std::string_view b) const
+        {
+            return ConstantTimeEquals(a, b);
+        }
+    };
+
+    // one cache line each, the shards locked by different threads do not share one
+    struct alignas(64) Shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, Entry, Hash, Equal> entries;
+    };
+
+    struct State
+    {
+        std::array<Shard, ShardCount> shards;
+        Stats stats;
+    };
+
+    Shard& ShardOf(std::size_t hash) const
+    {
+        return _state->shards[(hash >> 8) % ShardCount];
+    }
+
+private:
+    AuthPolicy _policy;
+    std::unique_ptr<State> _state;
+};
+
+/// <summary>
+/// Validator over a fixed set of tokens, given or read from a file (one token per line, # starts a comment)
+/// Every token is compared, in constant time, so the time taken does not tell which one almost matched
+/// </summary>
+class StaticTokenValidator
+{
+public:
+    // up to you to load the tokens from wherever you wish to (file, database etc), "toto" is the demo token
+    StaticTokenValidator()
+        : _tokens{ "toto" }
+    {
+    }
+
+    explicit StaticTokenValidator(std::vector<std::string> tokens)
+        : _tokens{ std::move(tokens) }
+    {
+    }
+
+    static StaticTokenValidator FromFile(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            throw std::runtime_error("StaticTokenValidator: unable to read " + path);
+
+        std::vector<std::string> tokens;
+        for (std::string line; std::getline(file, line);)
+        {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+                line.pop_back();
+            if (!line.empty() && line.front() != '#')
+                tokens.push_back(std::move(line));
+        }
+        return StaticTokenValidator(std::move(tokens));
+    }
+
+    boost::asio::awaitable<bool> Validate(std::string_view token) const
+    {
+        co_return Contains(token);
+    }
+
+    bool Contains(std::string_view token) const
+    {
+        bool found = false;
+        for (const auto& known : _tokens)
+            found |= ConstantTimeEquals(known, token);
+        return found;
+    }
+
+private:
+    std::vector<std::string> _tokens;
+};
+
+/// <summary>
+/// Validator asking an OAuth 2.0 token introspection endpoint (RFC 7662) through an HttpClientPool
+/// The token is valid when the endpoint answers 200 with "active":true
+/// </summary>
+class IntrospectionValidator
+{
+public:
+    /// <param name="url">scheme://host:port of the endpoint</param>
+    /// <param name="target">its path, e.g. /oauth2/introspect</param>
+    /// <param name="headers">sent with each call, e.g. the credentials of this server</param>
+    IntrospectionValidator(HttpClientPool& pool, std::string url, std::string target, Headers headers = {})
+        : _pool{ pool }
+        , _url{ std::move(url) }
+        , _target{ std::move(target) }
+        , _headers{ std::move(headers) }
+    {
+    }
+
+    boost::asio::awaitable<bool> Validate(std::string_view token) const
+    {
+        static constexpr char Hex[] = "0123456789ABCDEF";
+
+        // form encoded: a base64 token may hold + / =
+        std::string form = "token=";
+        for (const char c : token)
+        {
+            if (std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' || c == '_' || c == '~')
+            {
+                form += c;
+                continue;
+            }
+            form += '%';
+            form += Hex[static_cast<unsigned char>(c) >> 4];
+            form += Hex[static_cast<unsigned char>(c) & 0xF];
+        }
+
+        const Body body(form.begin(), form.end());
+        auto lease = co_await _pool.acquire(_url);
+        auto res = co_await lease->post<boost::beast::http::string_body>(_target, body, "application/x-www-form-urlencoded", _headers);
+        if (res.result() != Status::ok)
+            throw std::runtime_error("IntrospectionValidator: endpoint answered " + std::to_string(res.result_int()));
+
+        const auto& json = res.body();
+        co_return json.find("\"active\":true") != std::string::npos || json.find("\"active\": true") != std::string::npos;
+    }
+
+private:
+    HttpClientPool& _pool;
+    std::string _url;
+    std::string _target;
+    Headers _headers;
+};
+
+/// <summary>
+/// Bearer token authentication, Authorization: Bearer <token>
+/// The token is a view on the request header, a cached answer costs one shared lock and no allocation; the
+/// validator is only awaited for tokens unknown to the cache or expired, and its answer, valid or not, is cached
+/// The error is only filled when the request is refused
+/// </summary>
+template <ITokenValidator Validator = StaticTokenValidator>
+class BasicTokenAuth
+{
+public:
+    BasicTokenAuth() = default;
+
+    explicit BasicTokenAuth(Validator validator, AuthPolicy policy = {})
+        : _validator{ std::move(validator) }
+        , _cache{ policy }
+    {
+    }
+
+    boost::asio::awaitable<bool> HandleRequest(const Request& req, Status& code, std::string& err)
+    {
+        const std::string_view token = BearerToken(req);
+        if (token.empty())
+            co_return Refuse(code, err);
+
+        std::optional<bool> valid = _cache.Find(token);
+        if (!valid)
+        {
+            try
+            {
+                valid = co_await _validator.Validate(token);
+            }
+            catch (const std::exception& e)
+            {
+                Log::Warn("Token validation failed: {}", e.what());
+                code = Status::service_unavailable;
+                err = "\"Authentification unavailable\"";
+                co_return false;
+            }
+            _cache.Store(token, *valid);
+        }
+
+        if (!*valid)
+            co_return Refuse(code, err);
+        co_return true;
+    }
+
+    Validator& GetValidator()
+    {
+        return _validator;
+    }
+
+    TokenCache& Cache()
+    {
+        return _cache;
+    }
+
+    /// <summary>
+    /// Token of an Authorization: Bearer header, empty when missing or of another scheme
+    /// </summary>
+    static std::string_view BearerToken(const Request& req)
+    {
+        static constexpr std::string_view Scheme = "Bearer ";
+
+        const auto auth = req.get().find(boost::beast::http::field::authorization);
+        if (auth == req.get().end())
+            return {};
+
+        const std::string_view value(auth->value().data(), auth->value().size());
+        if (value.size() <= Scheme.size() || !boost::beast::iequals(boost::beast::string_view(value.data(), Scheme.size()), boost::beast::string_view(Scheme.data(), Scheme.size())))
+            return {};
+
+        std::string_view token = value.substr(Scheme.size());
+        while (!token.empty() && token.front() == ' ')
+            token.remove_prefix(1);
+        return token;
+    }
+
+private:
+    static bool Refuse(Status& code, std::string& err)
+    {
+        code = Status::unauthorized;
+        err = "\"Invalid authentification\"";
+        return false;
+    }
+
+private:
+    Validator _validator;
+    TokenCache _cache;
+};
+
+using TokenAuthMiddleWare = BasicTokenAuth<>;
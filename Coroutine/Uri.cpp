@@ -1,285 +1,372 @@
-#include <regex>
-#include <charconv>
-#include <iostream>
-#include <optional>
+#include <algorithm>
+#include <bit>
 #include <charconv>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define URI_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "Uri.h"
 
 //---- private impl ----------------------------------------------------
 
-static std::regex url_rx = std::regex{ "^(?:([a-z]+):)*(?://)*([^/?#]+)*([^?#]*)([^#]*)(.*)$", std::regex_constants::ECMAScript | std::regex_constants::icase };
-static std::regex authority_rx = std::regex{ "^(?:([^:@]*)(?::([^@]*))*@)*([^:]*)(?::(\\d+))*$", std::regex_constants::ECMAScript | std::regex_constants::icase };
+//single pass parser giving the components the former regex pair gave:
+//  url:       ^(?:([a-z]+):)*(?://)*([^/?#]+)*([^?#]*)([^#]*)(.*)$
+//  authority: ^(?:([^:@]*)(?::([^@]*))*@)*([^:]*)(?::(\d+))*$
+//each component is found by scanning forward once, delimiters are searched 16 bytes at a time with SSE2
+
 static std::string_view default_http_scheme = "http";
 static std::string_view default_path = "/";
 
-struct uri::impl
-{
-    //data view only accessor
-    std::string_view data_view;
-
-    //store complete url if needed (when modifying datas)
-    std::optional<std::string> data;
-
-    //url parts
-    std::string_view scheme;
-    std::string_view authority;
-    std::string_view user;
-    std::string_view pass;
-    std::string_view host;
-    uint16_t port = 0;
-    std::string_view path;
-    std::string_view query;
-    std::string_view fragment;
-    std::string_view target;
-
-    //constructor
-    impl(std::string_view str, bool makeCopy)
-        : data_view{ str }
-    {
-        if (makeCopy) make_copy();
-        parse_url(data_view);
-    }
+//first position in [first, last) holding one of the characters of set, last if none
+template <std::size_t N>
+static const char* find_first_of(const char* first, const char* last, const char (&set)[N])
+{
+    constexpr std::size_t count = N - 1;
+#if defined(URI_SSE2)
+    __m128i needles[count];
+    for (std::size_t k = 0; k < count; ++k)
+        needles[k] = _mm_set1_epi8(set[k]);
 
-    void make_copy()
+    while (last - first >= 16)
     {
-        data = std::string{ data_view };
-        data_view = std::string_view{ data.value() };
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+        for (std::size_t k = 1; k < count; ++k)
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[k]));
+
+        if (const int mask = _mm_movemask_epi8(hits))
+            return first + std::countr_zero(static_cast<unsigned>(mask));
+        first += 16;
     }
-
-        //parse full url
-        void parse_url(std::string_view str)
+#endif
+    for (; first != last; ++first)
+    {
+        for (std::size_t k = 0; k < count; ++k)
         {
-            //std::cout << "uri: parsing url " << str << "\n";
-            auto matches = std::match_results<std::string_view::const_iterator>{};
-
-            if (std::regex_match(str.cbegin(), str.cend(), matches, url_rx))
-            {
-                for (size_t i = 1; i < matches.size(); i++)
-                {
-                    auto first = matches[i].first;
-                    auto last = matches[i].second;
-
-                    switch (i)
-                    {
-                    case 1: //scheme
-                        scheme = std::string_view{ first, last };
-                        break;
-                    case 2: //authority
-                        authority = std::string_view{ first, last };
-                        parse_authority(authority);
-                        break;
-                    case 3: //path + target
-                        path = std::string_view{ first, last };
-                        target = std::string_view{ first, str.cend() };
-                        break;
-                    case 4: //query
-                        query = std::string_view{ first, last };
-                        break;
-                    case 5: //fragments
-                        fragment = std::string_view{ first, last };
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                auto msg = std::string{ "unable to parse uri: " };
-                msg += str;
-                throw std::invalid_argument(msg);
-            }
+            if (*first == set[k])
+                return first;
         }
+    }
+    return last;
+}
 
-        //parse authority part only
-        void parse_authority(std::string_view str)
-        {
-            auto matches = std::match_results<std::string_view::const_iterator>{};
-
-            if (std::regex_match(str.cbegin(), str.cend(), matches, authority_rx))
-            {
-                for (size_t i = 1; i < matches.size(); i++)
-                {
-                    auto first = matches[i].first;
-                    auto last = matches[i].second;
-
-                    //std::cout << "parse_authority: match " << i << ": " << std::string_view{first, last} << std::endl;
-
-                    switch (i) {
-                    case 1: //user
-                        user = std::string_view{ first, last };
-                        break;
-                    case 2: //pass
-                        pass = std::string_view{ first, last };
-                        break;
-                    case 3: //hostname
-                        host = std::string_view{ first, last };
-                        break;
-                    case 4: //port
-                        std::string_view port_(first, last);
-                        if (port_.empty()) continue;
-
-                        auto result = std::from_chars(port_.data(), port_.data() + port_.size(), this->port);
-                        if (result.ec == std::errc::invalid_argument || result.ec == std::errc::result_out_of_range)
-                        {
-                            throw std::runtime_error("Invalid port specified");
-                        }
-                        break;
-                    }
-                }
-
-                //auto set port based on scheme if not set
-                if (port == 0)
-                {
-                    if (scheme.empty()) port = 80;
-                    else if (scheme == "http") port = 80;
-                    else if (scheme == "https") port = 443;
-                    else if (scheme == "ftp") port = 21;
-                    else if (scheme == "ssh") port = 22;
-                }
-            }
-            else
-            {
-                auto msg = std::string{ "unable to parse authority: " };
-                msg += str;
-                throw std::invalid_argument(msg);
-            }
-        }
+static bool is_alpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
 
-        void update_value(std::string_view& dst, std::string_view src)
-        {
-            //get positions for replacement
-            auto dst_start = std::string::size_type(dst.data() - data_view.data());
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
 
-            //copy if we are not owning the string
-            if (!data.has_value()) make_copy();
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+const char* uri::find_escape(const char* first, const char* last, bool plusAsSpace)
+{
+    return plusAsSpace ? find_first_of(first, last, "%+") : find_first_of(first, last, "%");
+}
 
-            //replace data in string
-            data->replace(dst_start, dst.length(), src);
+bool uri::needs_decode(std::string_view src, bool plusAsSpace/*=true*/)
+{
+    return find_escape(src.data(), src.data() + src.size(), plusAsSpace) != src.data() + src.size();
+}
+
+//runs between escapes are located with the SIMD scan and copied in one go
+std::size_t uri::decode_to(const char* first, const char* last, char* out, bool plusAsSpace)
+{
+    char* const begin = out;
+    while (first != last)
+    {
+        const char* escape = find_escape(first, last, plusAsSpace);
+        out = std::copy(first, escape, out);
+        if (escape == last)
+            break;
 
-            //update views
-            data_view = std::string_view{ data.value() };
-            parse_url(data_view);
+        if (*escape == '+')
+        {
+            *out++ = ' ';
+            first = escape + 1;
+            continue;
         }
 
-    };
+        const int high = last - escape > 2 ? hex_value(escape[1]) : -1;
+        const int low = high >= 0 ? hex_value(escape[2]) : -1;
+        if (low < 0)
+        {
+            *out++ = '%';
+            first = escape + 1;
+            continue;
+        }
+        *out++ = static_cast<char>(high * 16 + low);
+        first = escape + 3;
+    }
+    return static_cast<std::size_t>(out - begin);
+}
 
+void uri::make_copy()
+{
+    _data = std::string{ _view };
+    _owned = true;
+}
 
-    //---- public interface ----------------------------------------------------
+const char* uri::base() const
+{
+    return _owned ? _data.data() : _view.data();
+}
 
-    uri::uri(std::string_view str, bool makeCopy/*=false*/)
-        : _impl{ std::make_unique<uri::impl>(str, makeCopy) }
+std::string_view uri::view(part p) const
+{
+    return std::string_view{ base() + p.offset, p.size };
+}
+
+//parse full url
+void uri::parse_url()
+{
+    const std::string_view str = _owned ? std::string_view{ _data } : _view;
+    const char* const first = str.data();
+    const char* const last = first + str.size();
+    const auto at = [first](const char* p) { return static_cast<uint32_t>(p - first); };
+    const auto make = [&](const char* b, const char* e) { return part{ at(b), at(e) - at(b) }; };
+
+    _scheme = _authority = _user = _pass = _host = _path = _query = _fragment = _target = part{};
+    _port = 0;
+
+    //scheme: as many "letters:" as possible, the last one wins
+    const char* p = first;
+    for (;;)
     {
+        const char* q = p;
+        while (q != last && is_alpha(*q))
+            ++q;
+        if (q == p || q == last || *q != ':')
+            break;
+        _scheme = make(p, q);
+        p = q + 1;
     }
-    uri::~uri() = default;
 
-    //getters
+    //any number of "//"
+    while (last - p >= 2 && p[0] == '/' && p[1] == '/')
+        p += 2;
 
-    std::string_view uri::str() const
-    {
-        return _impl->data_view;
-    }
+    const char* authority_end = find_first_of(p, last, "/?#");
+    const char* path_end = find_first_of(authority_end, last, "?#");
+    const char* query_end = find_first_of(path_end, last, "#");
 
-    std::string_view uri::scheme() const
+    //the fragment is matched by '.', which stops on line terminators
+    if (find_first_of(query_end, last, "\r\n") != last)
     {
-        if (_impl->scheme.empty()) return default_http_scheme;
-        else return _impl->scheme;
+        auto msg = std::string{ "unable to parse uri: " };
+        msg += str;
+        throw std::invalid_argument(msg);
     }
 
-    std::string_view uri::authority() const
-    {
-        return _impl->authority;
-    }
+    _authority = make(p, authority_end);
+    _path = make(authority_end, path_end);
+    _target = make(authority_end, last);
+    _query = make(path_end, query_end);
+    _fragment = make(query_end, last);
 
-    std::string_view uri::user() const
-    {
-        return _impl->user;
-    }
+    parse_authority();
+}
 
-    std::string_view uri::pass() const
-    {
-        return _impl->pass;
-    }
+//parse authority part only
+void uri::parse_authority()
+{
+    const char* const first = base();
+    const char* p = first + _authority.offset;
+    const char* const last = p + _authority.size;
+    const auto make = [first](const char* b, const char* e) { return part{ static_cast<uint32_t>(b - first), static_cast<uint32_t>(e - b) }; };
 
-    std::string_view uri::host() const
+    //userinfo: one "user[:pass]@" segment per '@', user comes from the last segment and pass from the last segment having one
+    for (const char* at = find_first_of(p, last, "@"); at != last; at = find_first_of(p, last, "@"))
     {
-        return _impl->host;
+        const char* colon = find_first_of(p, at, ":");
+        _user = make(p, colon);
+        if (colon != at)
+            _pass = make(colon + 1, at);
+        p = at + 1;
     }
 
-    uint16_t uri::port() const
-    {
-        return _impl->port;
-    }
+    const char* host_end = find_first_of(p, last, ":");
+    _host = make(p, host_end);
 
-    std::string_view uri::path() const
+    //any number of ":digits", the last one is the port
+    const char* port_first = nullptr;
+    const char* port_last = nullptr;
+    for (p = host_end; p != last;)
     {
-        if (_impl->path.empty()) return default_path;
-        else return _impl->path;
+        const char* digits = ++p;
+        while (p != last && is_digit(*p))
+            ++p;
+        if (p == digits || (p != last && *p != ':'))
+        {
+            auto msg = std::string{ "unable to parse authority: " };
+            msg += view(_authority);
+            throw std::invalid_argument(msg);
+        }
+        port_first = digits;
+        port_last = p;
     }
 
-    std::string_view uri::query() const
+    if (port_first)
     {
-        return _impl->query;
+        auto result = std::from_chars(port_first, port_last, _port);
+        if (result.ec == std::errc::invalid_argument || result.ec == std::errc::result_out_of_range)
+        {
+            throw std::runtime_error("Invalid port specified");
+        }
     }
 
-    std::string_view uri::fragment() const
+    //auto set port based on scheme if not set
+    if (_port == 0)
     {
-        return _impl->fragment;
+        const std::string_view scheme = view(_scheme);
+        if (scheme.empty()) _port = 80;
+        else if (scheme == "http") _port = 80;
+        else if (scheme == "https") _port = 443;
+        else if (scheme == "ftp") _port = 21;
+        else if (scheme == "ssh") _port = 22;
     }
+}
 
-    std::string_view uri::target() const
-    {
-        if (_impl->target.empty()) return default_path;
-        else return _impl->target;
-    }
+void uri::update_value(part& dst, std::string_view src)
+{
+    //copy if we are not owning the string
+    if (!_owned) make_copy();
 
-    //setters
+    //replace data in string and parse it again
+    _data.replace(dst.offset, dst.size, src);
+    parse_url();
+}
 
-    void uri::scheme(std::string_view scheme)
-    {
-        _impl->update_value(_impl->scheme, scheme);
-    }
 
-    void uri::authority(std::string_view authority)
-    {
-        _impl->update_value(_impl->authority, authority);
-    }
+//---- public interface ----------------------------------------------------
 
-    void uri::user(std::string_view user)
-    {
-        _impl->update_value(_impl->user, user);
-    }
+uri::uri(std::string_view str, bool makeCopy/*=false*/)
+    : _view{ str }
+{
+    if (makeCopy) make_copy();
+    parse_url();
+}
 
-    void uri::pass(std::string_view pass)
-    {
-        _impl->update_value(_impl->pass, pass);
-    }
+//getters
 
-    void uri::host(std::string_view host)
-    {
-        _impl->update_value(_impl->host, host);
-    }
+std::string_view uri::str() const
+{
+    return _owned ? std::string_view{ _data } : _view;
+}
 
-    void uri::port(uint16_t /*port*/)
-    {
-        //TODO: NOT IMPLEMENTED YET
-    }
+std::string_view uri::scheme() const
+{
+    if (_scheme.size == 0) return default_http_scheme;
+    else return view(_scheme);
+}
 
-    void uri::path(std::string_view path)
-    {
-        _impl->update_value(_impl->path, path);
-    }
+std::string_view uri::authority() const
+{
+    return view(_authority);
+}
 
-    void uri::query(std::string_view query)
-    {
-        _impl->update_value(_impl->query, query);
-    }
+std::string_view uri::user() const
+{
+    return view(_user);
+}
 
-    void uri::fragment(std::string_view fragment)
-    {
-        _impl->update_value(_impl->fragment, fragment);
-    }
+std::string_view uri::pass() const
+{
+    return view(_pass);
+}
 
-    void uri::target(std::string_view target)
-    {
-        _impl->update_value(_impl->target, target);
-    }
\ No newline at end of file
+std::string_view uri::host() const
+{
+    return view(_host);
+}
+
+uint16_t uri::port() const
+{
+    return _port;
+}
+
+std::string_view uri::path() const
+{
+    if (_path.size == 0) return default_path;
+    else return view(_path);
+}
+
+std::string_view uri::query() const
+{
+    return view(_query);
+}
+
+std::string_view uri::fragment() const
+{
+    return view(_fragment);
+}
+
+std::string_view uri::target() const
+{
+    if (_target.size == 0) return default_path;
+    else return view(_target);
+}
+
+//setters
+
+void uri::scheme(std::string_view scheme)
+{
+    update_value(_scheme, scheme);
+}
+
+void uri::authority(std::string_view authority)
+{
+    update_value(_authority, authority);
+}
+
+void uri::user(std::string_view user)
+{
+    update_value(_user, user);
+}
+
+void uri::pass(std::string_view pass)
+{
+    update_value(_pass, pass);
+}
+
+void uri::host(std::string_view host)
+{
+    update_value(_host, host);
+}
+
+void uri::port(uint16_t /*port*/)
+{
+    //TODO: NOT IMPLEMENTED YET
+}
+
+void uri::path(std::string_view path)
+{
+    update_value(_path, path);
+}
+
+void uri::query(std::string_view query)
+{
+    update_value(_query, query);
+}
+
+void uri::fragment(std::string_view fragment)
+{
+    update_value(_fragment, fragment);
+}
+
+void uri::target(std::string_view target)
+{
+    update_value(_target, target);
+}
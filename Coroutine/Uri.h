@@ -1,12 +1,12 @@
 #pragma once
-#include <memory>
+#include <cstdint>
+#include <string>
 #include <string_view>
 
 class uri
 {
     public:
     uri(std::string_view str, bool makeCopy = false);
-    ~uri();
 
     //getters
     std::string_view str() const;
@@ -33,7 +33,61 @@ class uri
     void fragment(std::string_view);
     void target(std::string_view);
 
+    //percent-decode src, '+' is decoded to a space when plusAsSpace (query strings)
+    //src is returned as is when it holds nothing to decode, otherwise the decoded bytes are appended to out and a view on them is returned
+    //invalid escapes are kept verbatim, the decoded size is never more than src.size()
+    template <typename String>
+    static std::string_view decode(std::string_view src, String& out, bool plusAsSpace = true);
+    static bool needs_decode(std::string_view src, bool plusAsSpace = true);
+
 private:
-    struct impl;
-    std::unique_ptr<impl> _impl;
-};
\ No newline at end of file
+    static const char* find_escape(const char* first, const char* last, bool plusAsSpace);
+    static std::size_t decode_to(const char* first, const char* last, char* out, bool plusAsSpace);
+
+    //component position in the url, kept as offsets so an owned copy stays valid when the uri is copied or moved
+    struct part
+    {
+        uint32_t offset = 0;
+        uint32_t size = 0;
+    };
+
+    void make_copy();
+    void parse_url();
+    void parse_authority();
+    void update_value(part& dst, std::string_view src);
+
+    const char* base() const;
+    std::string_view view(part p) const;
+
+    //data view only accessor, or the owned copy when _owned
+    std::string_view _view;
+    std::string _data;
+    bool _owned = false;
+
+    //url parts
+    part _scheme;
+    part _authority;
+    part _user;
+    part _pass;
+    part _host;
+    uint16_t _port = 0;
+    part _path;
+    part _query;
+    part _fragment;
+    part _target;
+};
+
+template <typename String>
+std::string_view uri::decode(std::string_view src, String& out, bool plusAsSpace/*=true*/)
+{
+    if (!needs_decode(src, plusAsSpace))
+        return src;
+
+    const char* first = src.data();
+    const char* last = first + src.size();
+
+    const std::size_t offset = out.size();
+    out.resize(offset + src.size());
+    out.resize(offset + decode_to(first, last, out.data() + offset, plusAsSpace));
+    return std::string_view{ out.data() + offset, out.size() - offset };
+}
@@ -5,22 +5,126 @@
 #include <boost/beast/version.hpp>
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/config.hpp>
 #include <boost/function.hpp>
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/bind_allocator.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/experimental/awaitable_operators.hpp>
 
 #include "Api.h"
+#include "Arena.h"
+#include "HttpDate.h"
+#include "IoBackend.h"
+#include "ListenerHandoff.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "ResponseBuilder.h"
+#include "ResponseStream.h"
+#include "ServerConfig.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <list>
 #include <mutex>
 #include <map>
+#include <memory>
+#include <optional>
+#include <span>
 #include <iostream>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 
 class HttpServer
 {
-	using StoredApi = std::function<boost::asio::awaitable<boost::beast::http::message_generator>(const Request& req)>;
+	// non owning delegate: no allocation at registration and a single indirect call per request
+	struct StoredApi
+	{
+		void* api;
+		boost::asio::awaitable<boost::beast::http::message_generator>(*handle)(void* api, const Request& req, BodyStream* body);
+		std::optional<BodyPolicy>(*policy)(void* api, const Request& req);
+
+		boost::asio::awaitable<boost::beast::http::message_generator> operator()(const Request& req, BodyStream* body = nullptr) const
+		{
+			return handle(api, req, body);
+		}
+	};
+
+	// api a request is dispatched to (null when no api has a route for it) and the body policy of its route
+	struct Claim
+	{
+		const StoredApi* api = nullptr;
+		BodyPolicy policy;
+	};
+
+	// holds one unit of a Stats gauge, an accepted connection is counted in open until the coroutine serving it ends
+	class ScopedGauge
+	{
+	public:
+		explicit ScopedGauge(std::atomic<std::size_t>& gauge)
+			: _gauge{ &gauge }
+		{
+			++*_gauge;
+		}
+
+		ScopedGauge(ScopedGauge&& other) noexcept
+			: _gauge{ std::exchange(other._gauge, nullptr) }
+		{
+		}
+
+		ScopedGauge(const ScopedGauge&) = delete;
+		ScopedGauge& operator=(const ScopedGauge&) = delete;
+		ScopedGauge& operator=(ScopedGauge&&) = delete;
+
+		~ScopedGauge()
+		{
+			if (_gauge)
+				--*_gauge;
+		}
+
+	private:
+		std::atomic<std::size_t>* _gauge;
+	};
+public:
+	/// <summary>
+	/// Connection gauges (open, idle) and counters of the connections closed by the governor, see ConnectionLimits
+	/// </summary>
+	struct Stats
+	{
+		// connections accepted and not closed yet
+		std::atomic<std::size_t> open = 0;
+		// keep-alive connections waiting for their next request
+		std::atomic<std::size_t> idle = 0;
+		// accepts delayed because max_connections was reached
+		std::atomic<std::size_t> deferred = 0;
+		// connections closed by a deadline or the minimum rate
+		std::atomic<std::size_t> timed_out = 0;
+		// among them, the ones sending their body slower than min_rate
+		std::atomic<std::size_t> too_slow = 0;
+	};
 private:
 	// Report a failure
 	void fail(boost::system::error_code ec, std::string what)
@@ -30,112 +134,1105 @@ private:
 public:
 	~HttpServer()
 	{
+		for (const auto id : _gauges)
+			Metrics::Instance().RemoveGauge(id);
+		Stop();
+		Join();
 	}
-	HttpServer(boost::asio::any_io_executor exec, boost::asio::ip::tcp::endpoint endpoint)
+	HttpServer(boost::asio::any_io_executor exec, boost::asio::ip::tcp::endpoint endpoint, ServerConfig config = {})
 		: _exec{ exec }
 		, _ep{ endpoint }
+		, _config{ std::move(config) }
 	{
+		if (_config.tls)
+			_ssl = MakeSslContext(*_config.tls, _alpn);
 	}
 
+	/// <summary>
+	/// Register an api, each request is handled by the first api registered with a route for it
+	/// </summary>
 	template<IApi T>
 	void AddApi(T& api)
 	{
-		_apis.push_back([&api](const Request& req) {
-			return api.HandleRequest(req);
-		});
+		_apis.push_back(StoredApi{ &api, [](void* api, const Request& req, BodyStream* body) {
+			return static_cast<T*>(api)->HandleRequest(req, body);
+		}, [](void* api, const Request& req) {
+			return static_cast<T*>(api)->Policy(req);
+		} });
 	}
 
-	boost::asio::awaitable<void> DoAccept()
+	/// <summary>
+	/// Start accepting connections according to the server mode
+	/// SharedPool spawns DoAccept on the executor given to the constructor
+	/// PerCore creates one single threaded io_context per thread and blocks nothing, use Join to wait for them
+	/// With a handoff path, the listening sockets of the instance answering on it are taken over first
+	/// </summary>
+	void Start()
 	{
+		RegisterGauges();
 
-		auto acceptor = boost::asio::use_awaitable.as_default_on(boost::asio::ip::tcp::acceptor(co_await boost::asio::this_coro::executor));
-		acceptor.open(_ep.protocol());
+		if (!_config.handoff_path.empty())
+		{
+			_inherited = ListenerHandoff::Receive(_exec, _config.handoff_path);
+			if (!_inherited.empty())
+				Log::Info("Http server inherited {} listening socket(s) through {}", _inherited.size(), _config.handoff_path);
+		}
+
+		if (_config.mode == ServerMode::SharedPool)
+		{
+			StartDateCache(_exec);
+			// the acceptors live on a strand so Drain() can close them from any thread
+			boost::asio::co_spawn(boost::asio::make_strand(_exec), DoAccept(ScopedGauge(_accepting)), &HttpServer::OnSessionEnd);
+			SpawnHandoff(boost::asio::make_strand(_exec));
+			SpawnQueueProbe(_exec, "pool");
+			return;
+		}
 
-		acceptor.set_option(boost::asio::socket_base::reuse_address(true));
-		acceptor.bind(_ep);
+		std::size_t threads = _config.threads;
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
 
-		acceptor.listen(boost::asio::socket_base::max_listen_connections);
-		std::cout << "Http server running at: " << _ep.address().to_string() << ":" << _ep.port() << "\n";
-		std::cout << "Awaiting connection...\n";
+		for (std::size_t i = 0; i < threads; ++i)
+			_contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+		StartDateCache(_contexts.front()->get_executor());
 
-		for (;;)
+#if defined(SO_REUSEPORT)
+		if (InheritedReusePort())
 		{
-			boost::asio::co_spawn(_exec, OnAccept(boost::beast::tcp_stream(co_await acceptor.async_accept())), [](std::exception_ptr e)
+			// every context owns its acceptor, the kernel balances the connections between them
+			for (auto& context : _contexts)
 			{
-				if (e)
-				try
-				{
-					std::rethrow_exception(e);
-				}
-				catch (const std::exception& e)
-				{
-					std::cerr << "Error in session: " << e.what() << "\n";
-				}
+				SpawnAcceptLoops(context->get_executor(), Listen(context->get_executor(), true), { context->get_executor() }, AcceptDepth());
+			}
+
+			// a predecessor running more threads handed off more sockets, each one keeps being accepted
+			for (std::size_t i = 0; !_inherited.empty(); ++i)
+			{
+				auto& context = _contexts[i % _contexts.size()];
+				SpawnAcceptLoops(context->get_executor(), Listen(context->get_executor(), true), { context->get_executor() }, AcceptDepth());
+			}
+		}
+		else
+		{
+			// the predecessor (SharedPool) did not set SO_REUSEPORT, no socket can be bound next to the inherited one
+			Log::Info("Http server inherited socket(s) without SO_REUSEPORT, accepted by the first context only");
+			SpawnFirstContextAccept();
+		}
+#else
+		// no SO_REUSEPORT: the first context accepts and hands each socket to the next context
+		SpawnFirstContextAccept();
+#endif
+		SpawnHandoff(_contexts.front()->get_executor());
+		for (std::size_t i = 0; i < _contexts.size(); ++i)
+			SpawnQueueProbe(_contexts[i]->get_executor(), std::to_string(i));
+		Log::Info("Http server running at: {}:{} on {} cores ({})", _ep.address().to_string(), _ep.port(), threads, IoBackend::Name);
+
+		for (std::size_t i = 0; i < _contexts.size(); ++i)
+		{
+			const int cpu = _config.cpu_affinity.empty() ? static_cast<int>(i % std::max(1u, std::thread::hardware_concurrency())) : _config.cpu_affinity[i % _config.cpu_affinity.size()];
+			_threads.emplace_back([this, i, cpu]()
+			{
+				PinThread(cpu);
+				_contexts[i]->run();
 			});
 		}
 	}
 
-	boost::asio::awaitable<void> OnAccept(boost::beast::tcp_stream stream)
+	/// <summary>
+	/// Stop accepting (the handoff socket included), every connection then answers its next request with
+	/// Connection: close and is closed after it
+	/// Idle keep-alive connections hold no request, they are left to the idle timeout or to Stop()
+	/// </summary>
+	void BeginDrain()
+	{
+		if (_draining.exchange(true))
+			return;
+
+		Log::Info("Http server draining: {}:{}", _ep.address().to_string(), _ep.port());
+		std::lock_guard lock(_listeners_mutex);
+		for (auto& acceptor : _acceptors)
+			boost::asio::post(acceptor->get_executor(), [acceptor]() { CloseAcceptor(*acceptor); });
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		if (_handoff)
+			boost::asio::post(_handoff->get_executor(), [handoff = _handoff]() { boost::system::error_code ec; handoff->close(ec); });
+#endif
+	}
+
+	/// <summary>
+	/// BeginDrain() then wait, up to drain_timeout, for the accept loops to exit and the requests in flight to be
+	/// answered, true when none was left
+	/// </summary>
+	boost::asio::awaitable<bool> Drain()
+	{
+		BeginDrain();
+
+		boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+		const auto deadline = std::chrono::steady_clock::now() + _config.drain_timeout;
+		while ((_accepting.load() > 0 || InFlight() > 0) && std::chrono::steady_clock::now() < deadline)
+		{
+			timer.expires_after(std::chrono::milliseconds(10));
+			co_await timer.async_wait(boost::asio::use_awaitable);
+		}
+
+		const std::size_t left = InFlight();
+		Log::Info("Http server drained: {}:{}, {} connection(s) still busy", _ep.address().to_string(), _ep.port(), left);
+		co_return _accepting.load() == 0 && left == 0;
+	}
+
+	bool Draining() const
+	{
+		return _draining;
+	}
+
+	/// <summary>
+	/// Called once the listening sockets have been handed to the next instance, instead of BeginDrain(): typically
+	/// drains every server of the process then stops it
+	/// </summary>
+	void OnHandoff(std::function<void()> handler)
+	{
+		_on_handoff = std::move(handler);
+	}
+
+	/// <summary>
+	/// Stop every PerCore io_context, SharedPool is stopped by the owner of the executor
+	/// </summary>
+	void Stop()
+	{
+		// the date refresh moves to a server still running
+		if (_date_executor)
+		{
+			DateCache::Stop(*_date_executor);
+			_date_executor.reset();
+		}
+		for (auto& context : _contexts)
+			context->stop();
+	}
+
+	/// <summary>
+	/// Wait for the PerCore threads to exit
+	/// </summary>
+	void Join()
+	{
+		for (auto& thread : _threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+	}
+
+	boost::asio::awaitable<void> DoAccept(ScopedGauge accepting)
+	{
+		auto acceptor = Listen(co_await boost::asio::this_coro::executor, false);
+
+		Log::Info("Http server running at: {}:{} ({})", _ep.address().to_string(), _ep.port(), IoBackend::Name);
+		Log::Info("Awaiting connection...");
+
+		std::vector<boost::asio::any_io_executor> targets{ _exec };
+
+		// a PerCore predecessor handed off one socket per core, each one keeps being accepted
+		while (!_inherited.empty())
+		{
+			auto strand = boost::asio::make_strand(_exec);
+			SpawnAcceptLoops(strand, Listen(strand, false), targets, AcceptDepth());
+		}
+
+		// this coroutine is the last of the loops of its acceptor
+		SpawnAcceptLoops(co_await boost::asio::this_coro::executor, acceptor, targets, AcceptDepth() - 1);
+		co_await AcceptLoop(std::move(acceptor), std::move(targets), std::move(accepting));
+	}
+
+	const Stats& GetStats() const
+	{
+		return _stats;
+	}
+
+	boost::asio::awaitable<void> OnAccept(boost::beast::tcp_stream stream, ScopedGauge /*open*/)
 	{
 		const std::string stream_ip = stream.socket().remote_endpoint().address().to_string();
-		std::cout << "New connection accepted from: " << stream_ip << "\n";
+		Log::Debug("New connection accepted from: {}", stream_ip);
 
-		for (;;)
+		if (!_ssl)
+		{
+			co_await Serve(stream, stream_ip);
+			co_return;
+		}
+
+		// the handshake runs here, in the connection coroutine, so a slow client never holds the accept loop
+		boost::asio::ssl::stream<boost::beast::tcp_stream> tls_stream(std::move(stream), *_ssl);
+		boost::beast::get_lowest_layer(tls_stream).expires_after(_config.tls->handshake_timeout);
+		auto [error_handshake] = co_await tls_stream.async_handshake(boost::asio::ssl::stream_base::server, boost::asio::as_tuple(boost::asio::use_awaitable));
+		if (error_handshake)
+		{
+			Log::Warn("TLS handshake failed with {}: {}", stream_ip, error_handshake.message());
+			co_return;
+		}
+
+		co_await Serve(tls_stream, stream_ip);
+	}
+
+private:
+	/// <summary>
+	/// Read, dispatch and answer the requests of a connection until it is closed, plain or TLS
+	/// </summary>
+	template <typename Stream>
+	boost::asio::awaitable<void> Serve(Stream& stream, const std::string& stream_ip)
+	{
+		// the read buffer lives as long as the connection so pipelined bytes are never lost, the parsers, fields,
+		// bodies and asio/beast operation states of a request are drawn from the arena which is recycled between
+		// batches, as are the response bytes ResponseBuilder writes. Coroutine frames come from the thread caches of
+		// asio (BOOST_ASIO_RECYCLING_ALLOCATOR_CACHE_SIZE), what is left on the heap is the message and serializer
+		// message_generator allocates itself (KeepAliveAllocationUnitTests counts it)
+		boost::beast::flat_buffer buffer;
+		boost::beast::flat_buffer output;
+		RequestArena arena;
+		const auto token = boost::asio::bind_allocator(Allocator(&arena), boost::asio::use_awaitable);
+		const ConnectionLimits& limits = _config.limits;
+
+		for (bool keep_alive = true, first_request = true; keep_alive; first_request = false)
 		{
 			try
 			{
-				Request req;
-				boost::beast::flat_buffer buffer;
+				arena.Reset();
 
-				// set expiration timer
-				stream.expires_after(std::chrono::seconds(30));
+				// requests of this batch: the first one comes from the socket, the next ones from the bytes already buffered
+				std::pmr::list<Request> batch(&arena);
+				Request& first = batch.emplace_back(std::piecewise_construct, std::make_tuple(Allocator(&arena)), std::make_tuple(Allocator(&arena)));
+				std::pmr::vector<boost::beast::http::message_generator> responses(&arena);
 
-				auto [error_read, readed_bytes] = co_await boost::beast::http::async_read(stream, buffer, req, boost::asio::as_tuple(boost::asio::use_awaitable));
+				// keep-alive: wait for the first byte of the next request, the connection is idle until then
+				// (a new connection goes straight to the header deadline)
+				if (!first_request && buffer.size() == 0)
+				{
+					boost::beast::get_lowest_layer(stream).expires_after(limits.idle_timeout);
+					boost::beast::error_code error_idle;
+					std::size_t idle_bytes = 0;
+					{
+						const ScopedGauge idle(_stats.idle);
+						std::tie(error_idle, idle_bytes) = co_await stream.async_read_some(buffer.prepare(boost::beast::read_size(buffer, 64 * 1024)), boost::asio::as_tuple(token));
+					}
+					if (error_idle == boost::asio::error::eof || error_idle == boost::asio::ssl::error::stream_truncated)
+					{
+						Log::Debug("Connection lost to: {}", stream_ip);
+						co_return;
+					}
+					if (error_idle)
+						throw boost::system::system_error(error_idle);
+					buffer.commit(idle_bytes);
+				}
+
+				// the whole header must arrive before the deadline, however the bytes are spread
+				boost::beast::get_lowest_layer(stream).expires_after(limits.header_timeout);
+				const std::int64_t read_start = Metrics::Enabled() ? Metrics::Now() : 0;
+
+				// header first: the body is only read once its route told how (buffered or streamed) and how much
+				first.body_limit(std::numeric_limits<std::uint64_t>::max());
+				auto [error_read, readed_bytes] = co_await boost::beast::http::async_read_header(stream, buffer, first, boost::asio::as_tuple(token));
 				// handle socket timeout or connection lost ?
-				if (error_read && error_read.value() == (int)boost::beast::http::error::end_of_stream)
+				if (error_read && (error_read == boost::beast::http::error::end_of_stream || error_read == boost::asio::ssl::error::stream_truncated))
 				{
-					std::cout << "Connection lost to: " << stream_ip << "\n";
+					Log::Debug("Connection lost to: {}", stream_ip);
 					co_return;
 				}
+				if (error_read)
+					throw boost::system::system_error(error_read);
+				Context(first).peer = stream_ip;
 
-				// this code is temporary till i manage collection of request by api object (POST /v1/create_resources) etc
-				for (auto& api : _apis)
+				const Claim claim = Route(first);
+				const BodyPolicy& policy = claim.policy;
+				if (first.content_length() && *first.content_length() > policy.limit)
 				{
-					// need to give api() a res to fill and return a boolean if the request has been processed or not in order to give it to the next api or to return a default 404
-					boost::beast::http::message_generator msg = co_await api(req);
-					auto [error_write, sent_bytes] =  co_await boost::beast::async_write(stream, std::move(msg), boost::asio::as_tuple(boost::asio::use_awaitable));
-					if (error_write && error_write.value() == boost::asio::error::connection_aborted)
-					{
-						std::cout << "Connection lost to: " << stream_ip << "\n";
-						co_return;
-					}
+					// refused before reading the body, which is left unread: the connection is closed after the answer
+					responses.push_back(PayloadTooLarge(first));
+					co_await WriteBatch(stream, output, batch, responses, arena, token);
+					break;
+				}
+
+				if (policy.streaming)
+				{
+					// the body is read by the handler, in its own phase
+					RecordPhase(Metrics::Phase::Read, read_start);
+					if (_draining)
+						first.get().keep_alive(false);
+
+					// the handler reads at its own pace, BodyStream bounds each read and the client rate, the parser
+					// the size of a chunked body
+					first.body_limit(policy.limit);
+					boost::beast::get_lowest_layer(stream).expires_after(limits.body_timeout);
+					std::span<char> window(static_cast<char*>(arena.allocate(BodyStream::WindowSize, 1)), BodyStream::WindowSize);
+					BodyStream body(stream, buffer, first, window, limits, &_stats.too_slow);
+					responses.push_back(co_await Dispatch(claim.api, first, &body));
+
+					co_await WriteBatch(stream, output, batch, responses, arena, token);
+
+					// what the handler left of the body is still in the socket
+					keep_alive = body.Done() && first.get().keep_alive();
+					continue;
 				}
 
-				if (!req.keep_alive())
+				first.body_limit(policy.limit);
+				boost::beast::get_lowest_layer(stream).expires_after(limits.body_timeout);
+				const auto error_body = co_await ReadBody(stream, buffer, first, token);
+				if (error_body == boost::beast::http::error::body_limit)
 				{
+					responses.push_back(PayloadTooLarge(first));
+					co_await WriteBatch(stream, output, batch, responses, arena, token);
 					break;
 				}
+				if (error_body)
+					throw boost::system::system_error(error_body);
+				RecordPhase(Metrics::Phase::Read, read_start);
+
+				// api claiming each request of the batch, its route is only matched once
+				std::pmr::vector<const StoredApi*> claims(&arena);
+				claims.push_back(claim.api);
+				while (batch.size() < _config.max_pipeline && buffer.size() > 0 && batch.back().keep_alive())
+				{
+					const StoredApi* api = nullptr;
+					if (!ParseBuffered(buffer, batch.emplace_back(std::piecewise_construct, std::make_tuple(Allocator(&arena)), std::make_tuple(Allocator(&arena))), api))
+					{
+						batch.pop_back();
+						break;
+					}
+					Context(batch.back()).peer = stream_ip;
+					claims.push_back(api);
+				}
+
+				// draining: the batch is answered, its last response tells the client to go elsewhere
+				if (_draining)
+					batch.back().get().keep_alive(false);
+
+				// responses are produced in request order then flushed together, one per request
+				auto api = claims.begin();
+				for (auto& req : batch)
+					responses.push_back(co_await Dispatch(*api++, req));
+
+				co_await WriteBatch(stream, output, batch, responses, arena, token);
+
+				// the connection follows what its last response told the client: one that announced keep-alive before a
+				// drain began stays open, its next request is answered with Connection: close
+				keep_alive = batch.back().get().keep_alive();
 			}
 			catch (boost::system::system_error& se)
 			{
+				if (se.code() == boost::beast::error::timeout)
+				{
+					++_stats.timed_out;
+					Log::Debug("Connection timed out: {}", stream_ip);
+				}
 				if (se.code() != boost::beast::http::error::end_of_stream)
 				{
-					if (se.code() != boost::beast::errc::connection_aborted && se.code() != boost::beast::errc::connection_reset && se.code() != boost::beast::errc::operation_canceled)
+					if (se.code() != boost::beast::errc::connection_aborted && se.code() != boost::beast::errc::connection_reset && se.code() != boost::beast::errc::broken_pipe && se.code() != boost::beast::errc::operation_canceled && se.code() != boost::beast::error::timeout && se.code() != boost::asio::ssl::error::stream_truncated)
 					{
-						std::cerr << "Error in OnAccept: " << se.code() << " " << se.what() << "\n";
+						Log::Error("Error in OnAccept: {} {}", se.code().value(), se.what());
 						throw;
 					}
 				}
+				break;
 			}
 		}
 
-		std::cout << "Connection closed: " << stream_ip << "\n";
+		Log::Debug("Connection closed: {}", stream_ip);
+		if constexpr (!std::is_same_v<Stream, boost::beast::tcp_stream>)
+		{
+			// send close_notify, bounded in case the peer never answers it
+			boost::beast::get_lowest_layer(stream).expires_after(_config.tls->handshake_timeout);
+			co_await stream.async_shutdown(boost::asio::as_tuple(boost::asio::use_awaitable));
+		}
+
 		boost::system::error_code ec;
-		stream.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+		boost::beast::get_lowest_layer(stream).socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+	}
+
+	/// <summary>
+	/// Build the server SSL context: certificate chain, private key and ALPN selection
+	/// </summary>
+	static std::unique_ptr<boost::asio::ssl::context> MakeSslContext(const TlsConfig& tls, std::string& alpn)
+	{
+		auto ssl = std::make_unique<boost::asio::ssl::context>(boost::asio::ssl::context::tls_server);
+		ssl->set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::no_sslv3 | boost::asio::ssl::context::no_tlsv1 | boost::asio::ssl::context::no_tlsv1_1);
+
+		if (!tls.certificate_chain.empty())
+			ssl->use_certificate_chain(boost::asio::buffer(tls.certificate_chain));
+		else
+			ssl->use_certificate_chain_file(tls.certificate_chain_file);
+
+		if (!tls.private_key.empty())
+			ssl->use_private_key(boost::asio::buffer(tls.private_key), boost::asio::ssl::context::pem);
+		else
+			ssl->use_private_key_file(tls.private_key_file, boost::asio::ssl::context::pem);
+
+		// ALPN wire format: each protocol prefixed by its length
+		for (const auto& protocol : tls.alpn)
+		{
+			alpn.push_back(static_cast<char>(protocol.size()));
+			alpn += protocol;
+		}
+		SSL_CTX_set_alpn_select_cb(ssl->native_handle(), &HttpServer::SelectAlpn, &alpn);
+		return ssl;
+	}
+
+	static int SelectAlpn(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg)
+	{
+		const auto* alpn = static_cast<const std::string*>(arg);
+		unsigned char* selected = nullptr;
+		if (SSL_select_next_proto(&selected, outlen, reinterpret_cast<const unsigned char*>(alpn->data()), static_cast<unsigned int>(alpn->size()), in, inlen) != OPENSSL_NPN_NEGOTIATED)
+			return SSL_TLSEXT_ERR_NOACK;
+
+		*out = selected;
+		return SSL_TLSEXT_ERR_OK;
+	}
+
+	/// <summary>
+	/// Acceptor on a socket inherited from the previous instance, or on a new one bound to the endpoint
+	/// Every acceptor is kept so that Drain() can close it and the handoff can pass it on
+	/// </summary>
+	std::shared_ptr<boost::asio::ip::tcp::acceptor> Listen(boost::asio::any_io_executor exec, bool reuse_port)
+	{
+		auto acceptor = std::make_shared<boost::asio::ip::tcp::acceptor>(exec);
+		if (!_inherited.empty())
+		{
+			// already bound and listening, its backlog is kept
+			acceptor->assign(_ep.protocol(), _inherited.back());
+			_inherited.pop_back();
+		}
+		else
+		{
+			acceptor->open(_ep.protocol());
+
+			acceptor->set_option(boost::asio::socket_base::reuse_address(true));
+#if defined(SO_REUSEPORT)
+			if (reuse_port)
+				acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+			acceptor->bind(_ep);
+
+			acceptor->listen(boost::asio::socket_base::max_listen_connections);
+		}
+
+		std::lock_guard lock(_listeners_mutex);
+		_acceptors.push_back(acceptor);
+		return acceptor;
+	}
+
+	// PerCore without a socket per context: the first context accepts and hands each socket to the next context
+	void SpawnFirstContextAccept()
+	{
+		std::vector<boost::asio::any_io_executor> targets;
+		for (auto& context : _contexts)
+			targets.push_back(context->get_executor());
+
+		do
+		{
+			SpawnAcceptLoops(_contexts.front()->get_executor(), Listen(_contexts.front()->get_executor(), false), targets, AcceptDepth());
+		} while (!_inherited.empty());
+	}
+
+#if defined(SO_REUSEPORT)
+	// whether a new socket can be bound next to the inherited ones: all of them have SO_REUSEPORT set
+	bool InheritedReusePort() const
+	{
+		for (const int handle : _inherited)
+		{
+			int value = 0;
+			socklen_t size = sizeof(value);
+			if (::getsockopt(handle, SOL_SOCKET, SO_REUSEPORT, &value, &size) != 0 || value == 0)
+				return false;
+		}
+		return true;
+	}
+#endif
+
+	// a socket handed off stays open in the next instance: close() alone leaves it in the epoll set of this process
+	// (the kernel only drops it once the file is closed everywhere), and the next instance receiving it under the
+	// same descriptor number then fails to register it (EEXIST). release() takes it out of the set first
+	static void CloseAcceptor(boost::asio::ip::tcp::acceptor& acceptor)
+	{
+		boost::system::error_code ec;
+#if !defined(_WIN32)
+		if (acceptor.is_open())
+		{
+			const int handle = acceptor.release(ec);
+			if (!ec)
+			{
+				::close(handle);
+				return;
+			}
+		}
+#endif
+		acceptor.close(ec);
+	}
+
+	// the server lends exec to the Date refresh until Stop()
+	void StartDateCache(boost::asio::any_io_executor exec)
+	{
+		_date_executor = exec;
+		DateCache::Start(std::move(exec));
+	}
+
+	void SpawnHandoff(boost::asio::any_io_executor exec)
+	{
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		if (!_config.handoff_path.empty())
+			boost::asio::co_spawn(exec, HandoffLoop(ScopedGauge(_accepting)), &HttpServer::OnSessionEnd);
+#else
+		if (!_config.handoff_path.empty())
+			Log::Warn("Listening socket handoff is not supported on this platform");
+		(void)exec;
+#endif
+	}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	/// <summary>
+	/// Wait for the next instance on the handoff path, pass it the listening sockets then drain
+	/// </summary>
+	boost::asio::awaitable<void> HandoffLoop(ScopedGauge /*accepting*/)
+	{
+		using Local = boost::asio::local::stream_protocol;
+
+		// the path left by a former instance, or by the one just inherited from which no longer listens on it
+		::unlink(_config.handoff_path.c_str());
+		auto handoff = std::make_shared<Local::acceptor>(co_await boost::asio::this_coro::executor, Local::endpoint(_config.handoff_path));
+		{
+			std::lock_guard lock(_listeners_mutex);
+			_handoff = handoff;
+		}
+		if (_draining)
+			co_return;
+
+		auto [error_accept, channel] = co_await handoff->async_accept(boost::asio::as_tuple(boost::asio::use_awaitable));
+		if (error_accept)
+			co_return;
+
+		std::vector<int> handles;
+		{
+			std::lock_guard lock(_listeners_mutex);
+			for (const auto& acceptor : _acceptors)
+			{
+				if (acceptor->is_open())
+					handles.push_back(acceptor->native_handle());
+			}
+		}
+		if (!ListenerHandoff::Send(channel.native_handle(), handles))
+		{
+			Log::Error("Listening socket handoff through {} failed", _config.handoff_path);
+			co_return;
+		}
+
+		Log::Info("Http server handed off {} listening socket(s) through {}", handles.size(), _config.handoff_path);
+		if (_on_handoff)
+			_on_handoff();
+		else
+			BeginDrain();
+	}
+#endif
+
+	/// <summary>
+	/// Spawn count accept loops sharing acceptor, see ServerConfig::accept_depth
+	/// Each loop starts its round robin on a different target so a burst is still spread over all of them
+	/// </summary>
+	void SpawnAcceptLoops(boost::asio::any_io_executor exec, const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor, std::vector<boost::asio::any_io_executor> targets, std::size_t count)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			boost::asio::co_spawn(exec, AcceptLoop(acceptor, targets, ScopedGauge(_accepting)), &HttpServer::OnSessionEnd);
+			std::rotate(targets.begin(), targets.begin() + 1, targets.end());
+		}
+	}
+
+	std::size_t AcceptDepth() const
+	{
+		// more loops than max_connections could never all hold a slot, the extra ones would only poll for one
+		const std::size_t depth = std::max<std::size_t>(1, _config.accept_depth);
+		return _config.limits.max_connections ? std::min(depth, _config.limits.max_connections) : depth;
+	}
+
+	/// <summary>
+	/// Accept connections and spawn each of them on the next target executor (round robin)
+	/// The accepted socket is created on the target executor so the connection never leaves it
+	/// At max_connections the loop stops accepting until a connection ends: the next clients wait in the listen
+	/// backlog instead of each holding a socket and a coroutine frame. An accept is only left pending while it has
+	/// a slot (ReserveAccept), so the loops sharing the limit cannot overshoot it whatever accept_depth
+	/// A failed accept (out of file descriptors: EMFILE, ENFILE) is retried after ErrorDelay, warning at most once
+	/// per second, rather than at once: it would fail again and spin
+	/// The loop ends when Drain() closes the acceptor
+	/// </summary>
+	boost::asio::awaitable<void> AcceptLoop(std::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor, std::vector<boost::asio::any_io_executor> targets, ScopedGauge /*accepting*/)
+	{
+		// polled rather than signaled: connections end on every thread and the timer belongs to this one
+		constexpr auto BackoffDelay = std::chrono::milliseconds(10);
+		constexpr auto ErrorDelay = std::chrono::milliseconds(100);
+		boost::asio::steady_timer backoff(acceptor->get_executor());
+		std::chrono::steady_clock::time_point warned{};
+		std::size_t failures = 0;
+
+		for (std::size_t next = 0; !_draining; ++next)
+		{
+			const std::size_t max_connections = _config.limits.max_connections;
+			if (max_connections && !ReserveAccept())
+			{
+				++_stats.deferred;
+				while (!_draining && _stats.open.load(std::memory_order_relaxed) + _accepts_pending.load(std::memory_order_relaxed) >= max_connections)
+				{
+					backoff.expires_after(BackoffDelay);
+					co_await backoff.async_wait(boost::asio::use_awaitable);
+				}
+				continue;
+			}
+
+			const auto& target = targets[next % targets.size()];
+			auto [error_accept, socket] = co_await acceptor->async_accept(target, boost::asio::as_tuple(boost::asio::use_awaitable));
+			// the slot goes to the connection: counted open before the accept stops holding it
+			std::optional<ScopedGauge> open;
+			if (!error_accept)
+				open.emplace(_stats.open);
+			if (max_connections)
+				--_accepts_pending;
+
+			if (error_accept)
+			{
+				if (_draining || error_accept == boost::asio::error::operation_aborted)
+					break;
+				++failures;
+				if (const auto now = std::chrono::steady_clock::now(); now - warned >= std::chrono::seconds(1))
+				{
+					Log::Warn("Accept failed on {}:{}: {} ({} failure(s) since the last warning)", _ep.address().to_string(), _ep.port(), error_accept.message(), failures);
+					warned = now;
+					failures = 0;
+				}
+				// the clients wait in the listen backlog until a descriptor is released
+				backoff.expires_after(ErrorDelay);
+				co_await backoff.async_wait(boost::asio::use_awaitable);
+				continue;
+			}
+			boost::asio::co_spawn(target, OnAccept(boost::beast::tcp_stream(std::move(socket)), std::move(*open)), &HttpServer::OnSessionEnd);
+		}
+	}
+
+	/// <summary>
+	/// Take a slot under max_connections for one more pending accept, false when the open connections and the
+	/// accepts already pending fill them. Each caller gets its own rank among the pending accepts, so two loops
+	/// cannot both take the last slot
+	/// </summary>
+	bool ReserveAccept()
+	{
+		// sequentially consistent: a connection is counted open before its accept stops holding the slot
+		const std::size_t rank = _accepts_pending.fetch_add(1);
+		if (_stats.open.load() + rank < _config.limits.max_connections)
+			return true;
+		--_accepts_pending;
+		return false;
+	}
+
+	/// <summary>
+	/// Read the rest of a buffered body, dropping a client that sends it slower than min_rate
+	/// The rate is the average since the body started, checked once min_rate_grace has passed
+	/// </summary>
+	template <typename Stream, typename Token>
+	boost::asio::awaitable<boost::beast::error_code> ReadBody(Stream& stream, boost::beast::flat_buffer& buffer, Request& req, const Token& token)
+	{
+		const ConnectionLimits& limits = _config.limits;
+		const auto start = std::chrono::steady_clock::now();
+		std::uint64_t received = 0;
+
+		while (!req.is_done())
+		{
+			auto [ec, bytes] = co_await boost::beast::http::async_read_some(stream, buffer, req, boost::asio::as_tuple(token));
+			if (ec)
+				co_return ec;
+
+			received += bytes;
+			const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+			if (limits.min_rate && !req.is_done() && elapsed > limits.min_rate_grace && received * 1000 < limits.min_rate * static_cast<std::uint64_t>(elapsed.count()))
+			{
+				++_stats.too_slow;
+				co_return boost::beast::error::timeout;
+			}
+		}
+		co_return boost::beast::error_code{};
+	}
+
+	/// <summary>
+	/// Parse a pipelined request from the bytes already in the buffer without touching the socket
+	/// The buffer is only consumed when the request is complete, an incomplete one is left for the next read, as is
+	/// a request whose route streams its body or refuses its size
+	/// </summary>
+	bool ParseBuffered(boost::beast::flat_buffer& buffer, Request& req, const StoredApi*& api) const
+	{
+		const auto data = buffer.data();
+		std::size_t used = 0;
+		const auto feed = [&](auto&& complete)
+		{
+			boost::beast::error_code ec;
+			while (!complete() && used < data.size())
+			{
+				const std::size_t n = req.put(boost::asio::buffer(data + used), ec);
+				used += n;
+				if (ec == boost::beast::http::error::need_more && n > 0)
+					ec = {};
+				else if (ec)
+					break;
+			}
+			return !ec && complete();
+		};
+
+		req.eager(false);
+		req.body_limit(std::numeric_limits<std::uint64_t>::max());
+		if (!feed([&]() { return req.is_header_done(); }))
+			return false;
+
+		const auto [claimed, policy] = Route(req);
+		if (policy.streaming || (req.content_length() && *req.content_length() > policy.limit))
+			return false;
+
+		req.body_limit(policy.limit);
+		req.eager(true);
+		if (!feed([&]() { return req.is_done(); }))
+			return false;
+
+		buffer.consume(used);
+		api = claimed;
+		return true;
+	}
+
+	/// <summary>
+	/// Expose the connection stats as Metrics gauges, labelled with the listening address
+	/// </summary>
+	void RegisterGauges()
+	{
+		if (!_gauges.empty())
+			return;
+
+		auto& metrics = Metrics::Instance();
+		const std::string labels = "server=\"" + Metrics::Escape(_ep.address().to_string() + ":" + std::to_string(_ep.port())) + "\"";
+		const auto add = [&](const char* name, const char* help, const char* type, std::function<double()> read)
+		{
+			_gauges.push_back(metrics.AddGauge(name, help, type, labels, std::move(read)));
+		};
+		add("http_connections_open", "Connections accepted and not closed yet", "gauge", [this] { return static_cast<double>(_stats.open.load()); });
+		add("http_connections_idle", "Keep-alive connections waiting for their next request", "gauge", [this] { return static_cast<double>(_stats.idle.load()); });
+		add("http_requests_in_flight", "Connections busy with a request", "gauge", [this] { return static_cast<double>(InFlight()); });
+		add("http_accepts_deferred_total", "Accepts delayed because max_connections was reached", "counter", [this] { return static_cast<double>(_stats.deferred.load()); });
+		add("http_connections_timed_out_total", "Connections closed by a deadline or the minimum rate", "counter", [this] { return static_cast<double>(_stats.timed_out.load()); });
+		add("http_connections_too_slow_total", "Connections closed for sending their body slower than min_rate", "counter", [this] { return static_cast<double>(_stats.too_slow.load()); });
+	}
+
+	/// <summary>
+	/// Delay of a handler queued on exec, measured every second while metrics are on
+	/// asio does not expose the depth of its queues, the wait of a handler posted behind the others is what a
+	/// deep queue costs each request (depth = delay x handlers run per second)
+	/// </summary>
+	void SpawnQueueProbe(boost::asio::any_io_executor exec, std::string name)
+	{
+		if (!Metrics::Enabled())
+			return;
+
+		auto& delay = *_queue_delays.emplace_back(std::make_unique<std::atomic<std::int64_t>>(0));
+		const std::string labels = "server=\"" + Metrics::Escape(_ep.address().to_string() + ":" + std::to_string(_ep.port())) + "\",executor=\"" + name + "\"";
+		_gauges.push_back(Metrics::Instance().AddGauge("http_executor_queue_delay_seconds", "Time a handler posted to the executor waited before running", "gauge", labels,
+			[&delay] { return delay.load() / 1e9; }));
+		boost::asio::co_spawn(exec, ProbeQueue(delay), &HttpServer::OnSessionEnd);
+	}
+
+	boost::asio::awaitable<void> ProbeQueue(std::atomic<std::int64_t>& delay)
+	{
+		const auto exec = co_await boost::asio::this_coro::executor;
+		boost::asio::steady_timer timer(exec);
+		while (!_draining)
+		{
+			timer.expires_after(std::chrono::seconds(1));
+			co_await timer.async_wait(boost::asio::use_awaitable);
+
+			const std::int64_t posted = Metrics::Now();
+			co_await boost::asio::post(exec, boost::asio::use_awaitable);
+			delay = Metrics::Now() - posted;
+		}
+	}
+
+	/// <summary>
+	/// Connections busy with a request (or with their first one), as opposed to idle keep-alive connections
+	/// </summary>
+	std::size_t InFlight() const
+	{
+		const std::size_t idle = _stats.idle.load();
+		const std::size_t open = _stats.open.load();
+		return open > idle ? open - idle : 0;
+	}
+
+	/// <summary>
+	/// First api with a route for the request and the body policy of that route
+	/// Without one, api is null and the default policy applies
+	/// </summary>
+	Claim Route(const Request& req) const
+	{
+		for (const auto& api : _apis)
+		{
+			if (auto policy = api.policy(api.api, req))
+				return { &api, *policy };
+		}
+		return {};
+	}
+
+	/// <summary>
+	/// Response of the api claiming the request
+	/// A request no api claims goes to the first one, whose middlewares (authentication...) run before its 404
+	/// No frame of its own: the api coroutine is returned as is
+	/// </summary>
+	boost::asio::awaitable<boost::beast::http::message_generator> Dispatch(const StoredApi* api, const Request& req, BodyStream* body = nullptr) const
+	{
+		if (!api && !_apis.empty())
+			api = &_apis.front();
+		if (api)
+			return (*api)(req, body);
+		return NotFound(req);
+	}
+
+	static boost::asio::awaitable<boost::beast::http::message_generator> NotFound(const Request& req)
+	{
+		co_return ResponseBuilder(Status::not_found, req.get().version(), req.get().keep_alive(), req.get().get_allocator()).Body({});
+	}
+
+	static boost::beast::http::message_generator PayloadTooLarge(const Request& req)
+	{
+		return ResponseBuilder(Status::payload_too_large, req.get().version(), false, req.get().get_allocator()).Body({});
+	}
+
+	/// <summary>
+	/// Write the responses of a batch in order with as few writes as possible
+	/// Small serialized chunks are coalesced in the output buffer, a large chunk (mapped file, big body) is sent in
+	/// one gather write together with what is already coalesced in front of it
+	/// A response whose request carries a FileRange or a StreamProducer is only its header, the file follows it
+	/// through SendFile, the body produced by the route through SendStream
+	/// </summary>
+	template <typename Stream, typename Token>
+	boost::asio::awaitable<void> WriteBatch(Stream& stream, boost::beast::flat_buffer& output, std::pmr::list<Request>& batch, std::pmr::vector<boost::beast::http::message_generator>& responses, RequestArena& arena, const Token& token)
+	{
+		constexpr std::size_t MaxCoalesce = 64 * 1024;
+
+		// a client that does not read its responses is dropped like one that does not send its requests
+		boost::beast::get_lowest_layer(stream).expires_after(_config.limits.write_timeout);
+		const std::int64_t write_start = Metrics::Enabled() ? Metrics::Now() : 0;
+
+		std::pmr::vector<boost::asio::const_buffer> gather(&arena);
+		auto req = batch.begin();
+		for (auto& response : responses)
+		{
+			while (!response.is_done())
+			{
+				boost::beast::error_code ec;
+				const auto chunk = response.prepare(ec);
+				if (ec)
+					throw boost::system::system_error(ec);
+
+				const std::size_t size = boost::beast::buffer_bytes(chunk);
+				if (output.size() + size <= MaxCoalesce)
+				{
+					output.commit(boost::asio::buffer_copy(output.prepare(size), chunk));
+					response.consume(size);
+					continue;
+				}
+
+				gather.clear();
+				gather.push_back(output.data());
+				for (const auto& b : chunk)
+					gather.push_back(b);
+
+				co_await boost::asio::async_write(stream, gather, token);
+				output.consume(output.size());
+				response.consume(size);
+			}
+
+			// the deadline covers each stall of a download, not the whole of it
+			RequestContext& context = Context(*req);
+			if (context.file.file)
+			{
+				co_await SendFile(stream, output, context.file, arena, token);
+				context.file.file.reset();
+				boost::beast::get_lowest_layer(stream).expires_after(_config.limits.write_timeout);
+			}
+			if (context.stream)
+			{
+				co_await SendStream(stream, output, *req, context.stream, arena, token);
+				context.stream = nullptr;
+				boost::beast::get_lowest_layer(stream).expires_after(_config.limits.write_timeout);
+
+				// a body without chunked framing ends with the connection, nothing can be answered after it
+				if (!ResponseStream::Chunked(*req))
+				{
+					batch.back().get().keep_alive(false);
+					break;
+				}
+			}
+			++req;
+		}
+
+		if (output.size() > 0)
+		{
+			co_await boost::asio::async_write(stream, output.data(), token);
+			output.consume(output.size());
+		}
+		RecordPhase(Metrics::Phase::Write, write_start);
+	}
+
+	/// <summary>
+	/// Flush output then send range of its file
+	/// Plain connections on Linux: sendfile, the kernel copies the page cache to the socket and the bytes never
+	/// reach user space. TLS has to encrypt them and other systems lack the call: the file is read in windows of
+	/// the arena and written one window at a time. Either way a download costs the same memory whatever its size
+	/// The operations repeated per window do not take their state from the arena, it is only reset between batches
+	/// </summary>
+	template <typename Stream, typename Token>
+	boost::asio::awaitable<void> SendFile(Stream& stream, boost::beast::flat_buffer& output, const FileRange& range, RequestArena& arena, const Token& token)
+	{
+		if (output.size() > 0)
+		{
+			co_await boost::asio::async_write(stream, output.data(), token);
+			output.consume(output.size());
+		}
+
+#if defined(__linux__)
+		if constexpr (std::is_same_v<Stream, boost::beast::tcp_stream>)
+		{
+			using namespace boost::asio::experimental::awaitable_operators;
+
+			// the stalls are timed below: the stream deadline would close the socket in the middle of a long download
+			stream.expires_never();
+			auto& socket = stream.socket();
+			socket.native_non_blocking(true);
+			off_t position = static_cast<off_t>(range.offset);
+			std::uint64_t remaining = range.size;
+			while (remaining > 0)
+			{
+				const ssize_t sent = ::sendfile(socket.native_handle(), range.file->native_handle(), &position, static_cast<std::size_t>(std::min<std::uint64_t>(remaining, 0x7ffff000)));
+				if (sent > 0)
+				{
+					remaining -= static_cast<std::uint64_t>(sent);
+					continue;
+				}
+				// the file got shorter since its header was sent
+				if (sent == 0)
+					throw boost::system::system_error(boost::beast::http::error::partial_message);
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					throw boost::system::system_error(errno, boost::system::system_category());
+
+				// socket buffer full: wait until the client reads, under the write deadline
+				boost::asio::steady_timer deadline(socket.get_executor(), _config.limits.write_timeout);
+				const auto ready = co_await (socket.async_wait(boost::asio::socket_base::wait_write, boost::asio::as_tuple(boost::asio::use_awaitable))
+					|| deadline.async_wait(boost::asio::as_tuple(boost::asio::use_awaitable)));
+				if (ready.index() == 1)
+					throw boost::system::system_error(boost::beast::error::timeout);
+				if (const auto [ec] = std::get<0>(ready); ec)
+					throw boost::system::system_error(ec);
+			}
+			co_return;
+		}
+#endif
+
+		constexpr std::size_t WindowSize = 64 * 1024;
+		char* window = static_cast<char*>(arena.allocate(WindowSize, 1));
+
+		boost::beast::error_code ec;
+		range.file->seek(range.offset, ec);
+		if (ec)
+			throw boost::system::system_error(ec);
+		for (std::uint64_t remaining = range.size; remaining > 0;)
+		{
+			const std::size_t read = range.file->read(window, static_cast<std::size_t>(std::min<std::uint64_t>(remaining, WindowSize)), ec);
+			if (ec)
+				throw boost::system::system_error(ec);
+			if (read == 0)
+				throw boost::system::system_error(boost::beast::http::error::partial_message);
+
+			boost::beast::get_lowest_layer(stream).expires_after(_config.limits.write_timeout);
+			co_await boost::asio::async_write(stream, boost::asio::buffer(window, read), boost::asio::use_awaitable);
+			remaining -= read;
+		}
+	}
+
+	/// <summary>
+	/// Flush output then run the producer of a streamed response, its body goes out through a ResponseStream
+	/// writing in a window of the arena
+	/// </summary>
+	template <typename Stream, typename Token>
+	boost::asio::awaitable<void> SendStream(Stream& stream, boost::beast::flat_buffer& output, const Request& req, const StreamProducer& producer, RequestArena& arena, const Token& token)
+	{
+		if (output.size() > 0)
+		{
+			co_await boost::asio::async_write(stream, output.data(), token);
+			output.consume(output.size());
+		}
+
+		std::span<char> window(static_cast<char*>(arena.allocate(ResponseStream::WindowSize, 1)), ResponseStream::WindowSize);
+		ResponseStream body(stream, ResponseStream::Chunked(req), window, _config.limits.write_timeout);
+		co_await producer(body);
+		co_await body.Finish();
+	}
+
+	static void RecordPhase(Metrics::Phase phase, std::int64_t start)
+	{
+		if (start)
+			Metrics::Instance().RecordPhase(phase, Metrics::Now() - start);
+	}
+
+	static void OnSessionEnd(std::exception_ptr e)
+	{
+		if (e)
+		try
+		{
+			std::rethrow_exception(e);
+		}
+		catch (const std::exception& e)
+		{
+			Log::Error("Error in session: {}", e.what());
+		}
+	}
+
+	static void PinThread(int cpu)
+	{
+#if defined(_WIN32)
+		SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
 	}
 
 private:
 	boost::asio::any_io_executor _exec;
 	boost::asio::ip::tcp::endpoint _ep;
-	std::list<StoredApi> _apis;
+	ServerConfig _config;
+	std::vector<StoredApi> _apis;
+	Stats _stats;
+
+	// accept and handoff loops still running, Drain() waits for them
+	std::atomic<std::size_t> _accepting = 0;
+	// accepts pending under max_connections, each one holds the slot of the connection it will open
+	std::atomic<std::size_t> _accepts_pending = 0;
+	std::atomic<bool> _draining = false;
+	std::function<void()> _on_handoff;
+	std::optional<boost::asio::any_io_executor> _date_executor;
+
+	// every acceptor ever opened, and the handoff socket, guarded for Drain() and the handoff
+	std::mutex _listeners_mutex;
+	std::vector<std::shared_ptr<boost::asio::ip::tcp::acceptor>> _acceptors;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	std::shared_ptr<boost::asio::local::stream_protocol::acceptor> _handoff;
+#endif
+	// listening sockets received from the previous instance, consumed by Listen()
+	std::vector<int> _inherited;
+
+	// Metrics gauges registered by Start(), removed with the server
+	std::vector<std::uint64_t> _gauges;
+	std::vector<std::unique_ptr<std::atomic<std::int64_t>>> _queue_delays;
+
+	// TLS termination, null when serving plain http
+	std::unique_ptr<boost::asio::ssl::context> _ssl;
+	std::string _alpn;
+
+	// PerCore mode: one io_context and one pinned thread per core
+	std::vector<std::unique_ptr<boost::asio::io_context>> _contexts;
+	std::vector<std::thread> _threads;
 };